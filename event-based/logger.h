@@ -0,0 +1,84 @@
+/**************************************************
+ * Title: SP-Project 2  -  Asynchronous Binary Log
+ * Summary: events of the servers as fixed-size
+ binary records (an event number and up to three
+ integers, no formatting), which every thread puts
+ into a ring of its own without any lock. A flusher
+ thread drains the rings into 'stock.log' every
+ LOG_TICK msec, and 'logdump' turns the file into
+ text. A full ring drops the record (and counts
+ it) instead of waiting, so logging never blocks
+ a request. Every event has a level, and events of
+ the hot path are limited to LOG_RATE per second
+ and thread, the rest being counted and reported
+ by one record.
+**************************************************/
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+
+/* Preprocessor Directives */
+#define LOG_FILE		"stock.log"
+#define LOG_MAGIC		"STOCKLOG"	/* first bytes of the file */
+#define LOG_VERSION		1
+#define LOG_RING		256			/* records of the ring of a thread (power of two) */
+#define LOG_TICK		10			/* msec between two flushes */
+#define LOG_RATE		100			/* most hot-path events per second and thread */
+
+#define LOG_DEBUG		0			/* levels */
+#define LOG_INFO		1
+#define LOG_WARN		2
+#define LOG_ERROR		3
+
+
+/* Types */
+typedef enum {						/* events (numbers are stored: append only) */
+	LOG_START,						// port
+	LOG_CONNECT,					// fd, IPv4 address (0: other), port
+	LOG_REQUEST,					// fd, bytes
+	LOG_CLOSE,						// fd
+	LOG_SUPPRESSED,					// count, event
+	LOG_DROPPED,					// count
+	LOG_EVENTS
+}log_type;
+
+typedef struct {					/* one record of the file (host byte order) */
+	uint64_t time;					// nsec since the Epoch
+	uint32_t tid;					// thread which logged it
+	uint16_t event;					// log_type
+	uint16_t level;
+	int64_t arg[3];
+}LogRecord;
+
+typedef struct {					/* header of the file */
+	char magic[8];					// LOG_MAGIC
+	uint32_t version;				// LOG_VERSION
+	uint32_t record_size;			// sizeof(LogRecord)
+}LogHeader;
+
+typedef struct {					/* how to print an event */
+	char *name;
+	char *format;					// with a %s for each argument
+	char *args;						// kind of each argument: 'd' decimal,
+									// 'a' IPv4 address, 'e' event
+	int level;
+	int hot;						// rate-limited
+}LogEventInfo;
+
+
+/* Global Variables */
+extern int log_level;				/* events below this level are not logged */
+extern LogEventInfo log_events[LOG_EVENTS];
+extern char *log_levels[4];
+
+
+/* Log routines */
+void log_init(char *filename, int level);
+void log_event(log_type event, int64_t a, int64_t b, int64_t c);
+void log_connect(int fd, struct sockaddr_storage *addr);
+void log_flush(void);
+
+#endif /* __LOGGER_H__ */
@@ -0,0 +1,113 @@
+/**************************************************
+ * Title: SP-Project 2  -  Request Latency Statistics
+ * Summary: implementation of 'stats.h'. Values are
+ nanoseconds: below 16 every value has a bucket of
+ its own, above that each power of two is split
+ into 16 buckets.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "stats.h"
+#include <time.h>
+
+
+/* Global Variables */
+char *stat_kind[STAT_KINDS] = { "show", "buy", "sell", "other", "error" };
+char *stat_phase[STAT_PHASES] = { "queue", "execute", "write" };
+uint64_t stat_count[STAT_KINDS][STAT_PHASES][STAT_BUCKETS];	/* the histograms */
+uint64_t stat_max[STAT_KINDS][STAT_PHASES];
+
+
+/* Subroutines */
+static int bucket_of(uint64_t v);
+static uint64_t bucket_value(int b);
+static uint64_t percentile(uint64_t *count, uint64_t total, double q);
+
+
+/**************** Implementation *****************/
+/***          Statistics Routines              ***/
+/* Return the monotonic time in nanoseconds */
+uint64_t stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count the phases of a request */
+void stats_record(StatSample *s) {
+	for (int ph = 0; ph < STAT_PHASES; ph++) {
+		uint64_t v = s->phase[ph];
+
+		stat_count[s->kind][ph][bucket_of(v)]++;
+		if (v > stat_max[s->kind][ph])
+			stat_max[s->kind][ph] = v;
+	}
+}
+
+/* Write the percentiles of every phase of every kind which has requests
+   into 'buf'; return the length */
+size_t stats_report(char *buf, size_t size) {
+	size_t len;
+
+	len = snprintf(buf, size, "%-6s %-8s %10s %10s %10s %10s %10s %10s (usec)\n", "kind",
+			"phase", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (int k = 0; k < STAT_KINDS; k++)
+		for (int ph = 0; ph < STAT_PHASES && len < size; ph++) {
+			uint64_t *c = stat_count[k][ph], total = 0, m = stat_max[k][ph], p[4];
+			double q[4] = { 0.5, 0.9, 0.99, 0.999 };
+
+			for (int b = 0; b < STAT_BUCKETS; b++)
+				total += c[b];
+			if (total == 0)
+				continue;
+			for (int i = 0; i < 4; i++)
+				if ((p[i] = percentile(c, total, q[i])) > m)
+					p[i] = m;					// (the middle of its bucket may be past it)
+			len += snprintf(buf + len, size - len, "%-6s %-8s %10lu %10.1f %10.1f %10.1f "
+					"%10.1f %10.1f\n", stat_kind[k], stat_phase[ph], (unsigned long)total,
+					p[0] / 1e3, p[1] / 1e3, p[2] / 1e3, p[3] / 1e3, m / 1e3);
+		}
+
+	return len < size ? len : size - 1;
+}
+/***          Statistics Routines End          ***/
+
+
+
+/***      Subroutines for the Histograms       ***/
+/* Return the bucket of value 'v' */
+static int bucket_of(uint64_t v) {
+	int e;
+
+	if (v >= 1ULL << STAT_MAX_BITS)
+		v = (1ULL << STAT_MAX_BITS) - 1;
+	if (v < 1 << STAT_SUB_BITS)
+		return v;
+	e = 63 - __builtin_clzll(v);					// v is in [2^e, 2^(e+1))
+	return ((e - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+			+ ((v >> (e - STAT_SUB_BITS)) & ((1 << STAT_SUB_BITS) - 1));
+}
+
+/* Return the middle of the values of bucket 'b' */
+static uint64_t bucket_value(int b) {
+	int e = (b >> STAT_SUB_BITS) + STAT_SUB_BITS - 1, sub = b & ((1 << STAT_SUB_BITS) - 1);
+
+	if (b < 1 << STAT_SUB_BITS)
+		return b;
+	return ((uint64_t)((1 << STAT_SUB_BITS) + sub) << (e - STAT_SUB_BITS))
+			+ (1ULL << (e - STAT_SUB_BITS)) / 2;
+}
+
+/* Return the value below which a fraction 'q' of the 'total' samples is */
+static uint64_t percentile(uint64_t *count, uint64_t total, double q) {
+	uint64_t want = (uint64_t)(q * total + 0.999999), seen = 0;
+
+	for (int b = 0; b < STAT_BUCKETS; b++)
+		if ((seen += count[b]) >= want && count[b] > 0)
+			return bucket_value(b);
+	return 0;
+}
+/***    Subroutines for the Histograms End     ***/
+/************** End of the Program ***************/
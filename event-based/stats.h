@@ -0,0 +1,47 @@
+/**************************************************
+ * Title: SP-Project 2  -  Request Latency Statistics
+ * Summary: log-linear (HDR-style) histograms of the
+ time requests spend in each phase, by command:
+ waiting in the round after select has seen them
+ (queue), running (execute) and sending the reply
+ (write). Only the event loop records, so one set
+ of counts serves the whole server, without locks.
+**************************************************/
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+
+/* Preprocessor Directives */
+#define STAT_SHOW		0			/* kinds of request */
+#define STAT_BUY		1
+#define STAT_SELL		2
+#define STAT_OTHER		3			/* list, delist, stats, exit */
+#define STAT_ERROR		4
+#define STAT_KINDS		5
+
+#define STAT_QUEUE		0			/* phases of a request */
+#define STAT_EXECUTE	1
+#define STAT_WRITE		2
+#define STAT_PHASES		3
+
+#define STAT_SUB_BITS	4			/* 16 buckets per power of two (6% wide) */
+#define STAT_MAX_BITS	40			/* longer than 2^40 nsec (18 min) is clamped */
+#define STAT_BUCKETS	((STAT_MAX_BITS - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+
+
+/* Types */
+typedef struct {					/* phases of one request (nsec) */
+	int kind;						// STAT_SHOW, ...
+	uint64_t phase[STAT_PHASES];	// STAT_QUEUE, ...
+}StatSample;
+
+
+/* Statistics routines */
+uint64_t stats_now(void);
+void stats_record(StatSample *s);
+size_t stats_report(char *buf, size_t size);
+
+#endif /* __STATS_H__ */
@@ -3,7 +3,10 @@
  * Summary: 'Event-Based Concurrent Stock Server'
  for studying the concepts of network programming,
  I/O multiplexing, fine-grained programming, pros
- and cons of event-based concurrency, etc
+ and cons of event-based concurrency, hot upgrades,
+ batching of the trades of one round by item,
+ 'show' formatted by helper threads, an
+ asynchronous binary log, latency statistics, etc
  *  |Date              |Author             |Version
 	|2022-05-21        |Park Junhyeok      |1.0.0
 **************************************************/
@@ -11,26 +14,74 @@
 /****************** Declaration ******************/
 /* Headers */
 #include "csapp.h"
+#include "logger.h"
+#include "stats.h"
+#include <stdint.h>
+#include <time.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 
 
 /* Preprocessor Directives */
-#define MAX_ITEM	1000000			/* size of pointer array */
+#define NIL			UINT32_MAX		/* null link of AVL tree */
+#define NODE(i)		(slab.nodes[i])	/* node at slab index i */
+#define KEY(i)		(slab.ID[i])	/* ID of the item at slab index i */
+#define UPGRADE_SOCK	"stock.sock"	/* control socket of hot upgrades */
+#define UPGRADE_TAG		8			/* bytes of the tag which heads a message */
+#define UPGRADE_FDS		250			/* most descriptors in one message */
+#define UPGRADE_ROWS	4096		/* most items in one message */
+#define UPGRADE_SNAP	"stock.snap"	/* the catalog for a new server (rows in ID order) */
+#define CPU_WORDS	16				/* words of a CPU mask (1024 CPUs) */
+#define SHOW_HELPERS	16			/* most helper threads of 'show' */
+#define STATS_REPLY	4096			/* room for the text of a 'stats' reply */
 
 
 /* Types */
-typedef struct item {				/* node structure of AVL tree */
+typedef struct item {				/* one stock item as a row (loading, upgrades) */
 	int ID;							// ID, left_stock, price : attributes of stock item
 	int left_stock;
 	int price;
-	int height;						// balance factor of node (for AVL operations)
-	struct item *right;				// left and right link of node
-	struct item *left;
 }Item;
 
+typedef struct node {				/* node structure of AVL tree */
+	int height;						// balance factor of node (for AVL operations)
+	uint32_t right;					// left and right link of node (slab indexes)
+	uint32_t left;
+}Node;
+
+typedef struct {					/* growable slab of items (32-bit indexes) */
+	Node *nodes;					// every node lives here, so links are indexes
+	int *ID;						// item columns, parallel to the nodes, so a
+	int *left_stock;				// scan only loads the fields it uses
+	int *price;
+	uint32_t used;					// number of slots ever handed out
+	uint32_t capacity;
+	uint32_t *free;					// stack of recycled slots
+	uint32_t nfree, free_cap;
+}Slab;
+
+typedef struct snapshot {			/* the catalog as rows, at one version */
+	Item *rows;						// in ID order
+	uint32_t n;
+	unsigned long version;			// 'catalog_version' when it was taken
+	int refs;						// the loop's cache and every job using it
+}Snapshot;
+
+typedef struct job {				/* a 'show' formatted by a helper (-H) */
+	int connfd;
+	Snapshot *snap;					// rows to format
+	char *buf;						// the reply as frames, made by the helper
+	size_t len, sent;				// sent by the loop without blocking
+	struct job *next;
+}Job;
+
 typedef struct {					/* structure for I/O Multiplexing */
 	int maxfd;
 	fd_set read_set;				// bit vector for 'Active Descriptors'
 	fd_set ready_set;				// subset of 'read_set'
+	fd_set write_set;				// clients whose 'show' reply is half sent
+	fd_set writable_set;			// subset of 'write_set'
 	int nready;						// num of file descriptors that has pending inputs
 	int maxi;
 	int clientfd[FD_SETSIZE];
@@ -38,100 +89,237 @@ typedef struct {					/* structure for I/O Multiplexing */
 } Pool;
 
 typedef enum {						/* enumeration for choosing the type of service */
-	_show_, _buy_, _sell_, _exit_, _error_
+	_show_, _buy_, _sell_, _list_, _delist_, _stats_, _exit_, _error_
 }command;
 
+typedef struct {					/* a buy/sell read in this round (batch mode) */
+	int id;							// item, then order of arrival (the sort key)
+	int seq;
+	int connfd;
+	command cmd;					// _buy_ or _sell_
+	int amount;
+	char *reply;					// set when the batch is applied
+}Trade;
 
-/* Global Variables */
-Item *root = NULL;					/* root of AVL tree */
-Item *print[MAX_ITEM];				/* pointer array for 'show' routine, etc */
-int print_size;						/* size of pointer array */
 
-char buy_success_msg[] = "[buy] success\n";
-char buy_error_msg[] = "Not enough left stock\n";
-char sell_success_msg[] = "[sell] success\n";
-char error_msg[] = "Invalid Command\n";
-char exit_msg[] = "exit";			/* these are global strings for providing service */
+/* Global Variables */
+Slab slab;							/* storage of every stock item */
+uint32_t root = NIL;				/* root of AVL tree */
+uint32_t *order;					/* slab indexes sorted by ID for 'show', etc */
+uint32_t order_size, order_cap;		/* size and capacity of the index */
+int batching;						/* apply the trades of a round by item (-B) */
+unsigned long catalog_version;		/* bumped by every change of the catalog */
+uint64_t round_start;				/* when select returned (requests queue from here) */
+uint64_t write_time;				/* nsec spent writing replies so far */
+
+int show_helpers;					/* threads formatting 'show' (-H, 0: inline) */
+int showfd = -1;					/* eventfd: a helper has finished a job */
+Snapshot *snapshot;					/* the latest snapshot (reused while current) */
+Job *outbox[FD_SETSIZE];			/* the 'show' in flight of every descriptor */
+int shows_in_flight;
+Job *job_head, *job_tail;			/* jobs for the helpers (FIFO) */
+sem_t job_mutex, job_items;
+Job *job_done;						/* jobs formatted, to be sent by the loop */
+sem_t done_mutex;
+
+int upgrade_ctl = -1;				/* control connection of a new server taking over */
+pid_t upgrade_pid;					/* child writing the snapshot it loads */
+int upgrade_asked;					/* it has loaded, the handoff is due between rounds */
+int *dirty;							/* IDs changed since the snapshot (sent at the end) */
+uint32_t ndirty, dirty_cap;
+
+char buy_success_msg[MAXLINE] = "[buy] success\n";
+char buy_error_msg[MAXLINE] = "Not enough left stock\n";
+char sell_success_msg[MAXLINE] = "[sell] success\n";
+char list_success_msg[MAXLINE] = "[list] success\n";
+char list_error_msg[MAXLINE] = "Stock already listed\n";
+char delist_success_msg[MAXLINE] = "[delist] success\n";
+char no_item_msg[MAXLINE] = "No such stock\n";
+char error_msg[MAXLINE] = "Invalid Command\n";
+char exit_msg[MAXLINE] = "exit";	/* global strings (padded to MAXLINE) for service */
 
 
 /* Subroutines for the AVL Tree */
-Item* InsertTree(Item*, int, int, int);
-Item* SearchTree(Item* node, int id);
-void ClearTree(Item* node);
-Item* SingleRotateLeft(Item *nodeB);
-Item* SingleRotateRight(Item *nodeA);
-Item* DoubleRotateLeft(Item *node);
-Item* DoubleRotateRight(Item *node);
-int GetHeight(Item *node);
+uint32_t InsertTree(uint32_t node, uint32_t item);
+uint32_t DeleteTree(uint32_t node, int id);
+uint32_t DeleteMin(uint32_t node, uint32_t *min);
+uint32_t SearchTree(uint32_t node, int id);
+uint32_t SingleRotateLeft(uint32_t nodeB);
+uint32_t SingleRotateRight(uint32_t nodeA);
+uint32_t DoubleRotateLeft(uint32_t node);
+uint32_t DoubleRotateRight(uint32_t node);
+uint32_t Rebalance(uint32_t node);
+int GetHeight(uint32_t node);
 int GetGreater(int, int);
 
 
+/* Subroutines for the item slab and the index */
+uint32_t slab_alloc(void);
+void slab_release(uint32_t idx);
+uint32_t order_search(int id);
+void order_insert(uint32_t pos, uint32_t idx);
+
+
 /* Subroutines for I/O Multiplexing */
 void init_pool(int listenfd, Pool *p);
 void add_client(int connfd, Pool *p);
 void check_client(Pool *p);
+void check_batch(Pool *p);
+int line_buffered(rio_t *rp);
+int lines_buffered(Pool *p);
+command peek_command(rio_t *rp);
 
 
 /* Subroutines for Service of Stock Server */
-command what_command(char *buf, int *id, int *amount);
+command what_command(char *buf, int *id, int *amount, int *price);
 void service(int connfd, char *buf, int n);
 void show_routine(int connfd);
+void write_frames(int connfd, char *buf, size_t len);
+void write_reply(int connfd, char *buf, size_t len);
+char *format_catalog(size_t *len, size_t slack);
+char *format_rows(Item *rows, uint32_t n, size_t *len, size_t slack);
 void buy_routine(int connfd, int id, int amount);
 void sell_routine(int connfd, int id, int amount);
+void list_routine(int connfd, int id, int amount, int price);
+void delist_routine(int connfd, int id);
+void stats_routine(int connfd);
+void apply_batch(Trade *trades, int n);
+int compare_trade(const void *a, const void *b);
 void exit_routine(int connfd);
 void error_routine(int connfd);
 void stock_load(void);
+void load_rows(Item *rows, uint32_t n);
 void stock_store(void);
+int compare_item(const void *a, const void *b);
 void sigint_handler(int sig);
 
 
+/* Subroutines for Show Helpers */
+void show_init(int n, Pool *p);
+void show_offload(int connfd);
+void *show_helper(void *vargp);
+void take_shows(Pool *p);
+void flush_shows(Pool *p);
+void send_show(Job *job, Pool *p);
+void snapshot_put(Snapshot *snap);
+
+
+/* Subroutines for Hot Upgrade */
+int upgrade_listen(void);
+int upgrade_take(int *kept, int *nkept);
+void load_snapshot(void);
+void apply_rows(Item *rows, uint32_t n);
+void remove_ids(int *ids, uint32_t n);
+void upgrade_accept(int ctlfd, Pool *p);
+void write_snapshot(int ctl);
+void upgrade_message(Pool *p);
+void upgrade_end(Pool *p);
+void mark_dirty(int id);
+int compare_int(const void *a, const void *b);
+void handoff(int listenfd, Pool *p);
+int send_msg(int sock, char *tag, void *data, size_t len, int *fds, int nfds);
+ssize_t recv_msg(int sock, char *tag, void *data, size_t size, int *fds, int *nfds);
+
+
+/* Subroutines for Decimal Formatting */
+char *format_int(char *dst, int v);
+char *format_digits(char *dst, uint32_t u, int width);
+
+
 /**************** Implementation *****************/
 /**   Subroutines for Service of Stock Server   **/
 /* Main routine of 'Event-Based Concurrent Stock Server' */
 int main(int argc, char **argv) {
-	int listenfd, connfd;
+	int listenfd, connfd, ctlfd, c, upgrade = 0, cpu = -1;
+	struct timeval poll = {0, 0};
 	socklen_t clientlen;
 	struct sockaddr_storage clientaddr;
-	char client_hostname[MAXLINE], client_port[MAXLINE];
+	static int kept[FD_SETSIZE];
+	int nkept = 0;
 	static Pool pool;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	while ((c = getopt(argc, argv, "uA:BH:L:")) != -1) {
+		switch (c) {
+		case 'u': upgrade = 1; break;		// take over the running server
+		case 'A': cpu = atoi(optarg); break;	// run the event loop on this CPU
+		case 'B': batching = 1; break;		// parse, group by item, then apply
+		case 'H': show_helpers = atoi(optarg); break;	// threads formatting 'show'
+		case 'L': log_level = atoi(optarg); break;	// least level logged (0: debug)
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-u] [-A cpu] [-B] [-H helpers] [-L level] <port>\n", argv[0]);
 		exit(0);
 	}
-	stock_load();							// load the 'stock.txt', and construct tree
+	if (cpu >= 0) {							// before the catalog is loaded, so
+		unsigned long set[CPU_WORDS] = {0};	// it is touched first on our node
+
+		if (cpu < CPU_WORDS * 64)
+			set[cpu / 64] = 1UL << cpu % 64;
+		if (syscall(SYS_sched_setaffinity, 0, sizeof(set), set) < 0)
+			fprintf(stderr, "Can't run on CPU %d (%s), not pinned\n", cpu, strerror(errno));
+	}
+	if (upgrade)
+		listenfd = upgrade_take(kept, &nkept);	// sockets and catalog of the old one
+	else
+		stock_load();						// load the 'stock.txt', and construct tree
 	Signal(SIGINT, sigint_handler);			// install the SIGINT handler
+	log_init(LOG_FILE, log_level);			// events into 'stock.log'
 
-	listenfd = Open_listenfd(argv[1]);
+	if (!upgrade)
+		listenfd = Open_listenfd(argv[optind]);
+	log_event(LOG_START, atoi(argv[optind]), 0, 0);
 	init_pool(listenfd, &pool);				// initialize the pool for I/O Multiplexing
+	for (int i = 0; i < nkept; i++)
+		add_client(kept[i], &pool);			// (clients of the old server)
+	ctlfd = upgrade_listen();
+	FD_SET(ctlfd, &pool.read_set);			// a new server may ask for a handoff
+	if (ctlfd > pool.maxfd)
+		pool.maxfd = ctlfd;
+	if (show_helpers > 0)
+		show_init(show_helpers, &pool);		// 'show' leaves the loop
 
 	while (1) {
 		pool.ready_set = pool.read_set;
-		pool.nready = Select(pool.maxfd + 1, &pool.ready_set, NULL, NULL, NULL);
+		pool.writable_set = pool.write_set;
+		pool.nready = Select(pool.maxfd + 1, &pool.ready_set, &pool.writable_set, NULL,
+				lines_buffered(&pool) ? &poll : NULL);	// (don't wait: requests are read)
+		round_start = stats_now();
 
 		if (FD_ISSET(listenfd, &pool.ready_set)) {			// if pending at listenfd,
 			clientlen = sizeof(struct sockaddr_storage);
 			connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-
-			Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-			printf("Connected to (%s, %s)\n", client_hostname, client_port);
+			log_connect(connfd, &clientaddr);				// (no name lookup)
 
 			add_client(connfd, &pool);						// add new connfd to pool
 		}
-
-		check_client(&pool);				// check if there's any pendings at connfds
+		if (FD_ISSET(ctlfd, &pool.ready_set))				// a new server takes over:
+			upgrade_accept(ctlfd, &pool);					// it loads a snapshot first
+		if (upgrade_ctl >= 0 && FD_ISSET(upgrade_ctl, &pool.ready_set))
+			upgrade_message(&pool);							// (loaded, or gone)
+		if (showfd >= 0 && FD_ISSET(showfd, &pool.ready_set))
+			take_shows(&pool);								// replies made by helpers
+		flush_shows(&pool);									// and the rest of them
+
+		if (batching)
+			check_batch(&pool);				// every ready request, trades by item
+		else
+			check_client(&pool);			// check if there's any pendings at connfds
+		if (upgrade_asked)
+			handoff(listenfd, &pool);		// between two rounds (returns until done)
 	}
 
 	exit(0);
 }
 
 /* Get and analyze the requests of clients */
-command what_command(char *buf, int *id, int *amount) {
+command what_command(char *buf, int *id, int *amount, int *price) {
 	char argument[10];
 	if (buf[0] == '\n')
 		return _error_;
 
-	sscanf(buf, "%s %d %d", argument, id, amount);
+	sscanf(buf, "%9s %d %d %d", argument, id, amount, price);
 
 	if (!strcmp(argument, "show"))
 		return _show_;
@@ -141,68 +329,247 @@ command what_command(char *buf, int *id, int *amount) {
 		return _buy_;
 	if (!strcmp(argument, "sell"))
 		return _sell_;
+	if (!strcmp(argument, "list"))				// admin commands for the catalog
+		return _list_;
+	if (!strcmp(argument, "delist"))
+		return _delist_;
+	if (!strcmp(argument, "stats"))				// latency of the requests
+		return _stats_;
 	return _error_;
 }
 
-/* Choose task based on the type of request */
+/* Choose task based on the type of request, and count its phases (it has
+   queued since select returned; a 'show' made by a helper counts the copy
+   of the rows only) */
 void service(int connfd, char *buf, int n) {
-	int id, amount;
+	int id, amount, price;
+	command cmd = what_command(buf, &id, &amount, &price);	// call by reference
+	uint64_t start = stats_now(), written = write_time;
+	StatSample stat = { STAT_OTHER, { start - round_start } };
 
-	switch (what_command(buf, &id, &amount)) {		// call by reference for id, amount
+	switch (cmd) {
 	case _show_: show_routine(connfd); break;
 	case _buy_: buy_routine(connfd, id, amount); break;
 	case _sell_: sell_routine(connfd, id, amount); break;
+	case _list_: list_routine(connfd, id, amount, price); break;
+	case _delist_: delist_routine(connfd, id); break;
+	case _stats_: stats_routine(connfd); break;
 	case _exit_: exit_routine(connfd); break;
 	case _error_: error_routine(connfd); break;
 	}
+
+	switch (cmd) {
+	case _show_: stat.kind = STAT_SHOW; break;
+	case _buy_: stat.kind = STAT_BUY; break;
+	case _sell_: stat.kind = STAT_SELL; break;
+	case _error_: stat.kind = STAT_ERROR; break;
+	default: break;
+	}
+	stat.phase[STAT_WRITE] = write_time - written;
+	stat.phase[STAT_EXECUTE] = stats_now() - start - stat.phase[STAT_WRITE];
+	stats_record(&stat);
 }
 
 /* Routine for 'show' service */
 void show_routine(int connfd) {
-	char printbuf[MAXLINE] = "";
+	size_t len;
+	char *printbuf;
+
+	if (show_helpers > 0) {
+		show_offload(connfd);						// (the caller parks the client)
+		return;
+	}
+	printbuf = format_catalog(&len, MAXLINE);		// room for the padding
+
+	write_frames(connfd, printbuf, len);
+	Free(printbuf);
+}
 
-	for (int i = 0; i < print_size; i++) {
-		char s1[128], s2[128], s3[128];
+/* Send a reply as MAXLINE-sized frames, a full frame means 'to be continued' */
+void write_frames(int connfd, char *buf, size_t len) {
+	size_t total = (len / MAXLINE + 1) * MAXLINE;	// at least one '\0' at the end
 
-		rio_itoa(print[i]->ID, s1, 10);
-		rio_itoa(print[i]->left_stock, s2, 10); 	// transform integer into string
-		rio_itoa(print[i]->price, s3, 10);
+	memset(buf + len, 0, total - len);				// (buf must hold len + MAXLINE)
+	write_reply(connfd, buf, total);
+}
+
+/* Send a reply, and add the time it took to 'write_time' */
+void write_reply(int connfd, char *buf, size_t len) {
+	uint64_t start = stats_now();
+
+	Rio_writen(connfd, buf, len);
+	write_time += stats_now() - start;
+}
 
-		strcat(printbuf, s1); strcat(printbuf, " ");
-		strcat(printbuf, s2); strcat(printbuf, " ");
-		strcat(printbuf, s3); strcat(printbuf, "\n");
+/* Format every item as 'ID left_stock price' lines ('slack' spare bytes at the end) */
+char *format_catalog(size_t *len, size_t slack) {
+	size_t size = (size_t)order_size * 24 + slack + 64;
+	char *buf = Malloc(size), *p = buf;
+
+	for (uint32_t i = 0; i < order_size; i++) {		// sequential walk in ID order
+		uint32_t k = order[i];
+
+		if ((size_t)(p - buf) + 3 * 12 + slack > size) {	// room for the longest line
+			size_t off = p - buf;
+
+			buf = Realloc(buf, size *= 2);
+			p = buf + off;
+		}
+		p = format_int(p, slab.ID[k]);
+		*p++ = ' ';
+		p = format_int(p, slab.left_stock[k]);	// transform integer into string
+		*p++ = ' ';
+		p = format_int(p, slab.price[k]);
+		*p++ = '\n';
+	}
+
+	*len = p - buf;
+	return buf;
+}
+
+/* Format 'n' rows like 'format_catalog' (thread-safe: helpers call it) */
+char *format_rows(Item *rows, uint32_t n, size_t *len, size_t slack) {
+	char *buf = Malloc((size_t)n * 3 * 12 + slack + 64), *p = buf;	// the longest lines
+
+	for (uint32_t i = 0; i < n; i++) {
+		p = format_int(p, rows[i].ID);
+		*p++ = ' ';
+		p = format_int(p, rows[i].left_stock);
+		*p++ = ' ';
+		p = format_int(p, rows[i].price);
+		*p++ = '\n';
 	}
-	Rio_writen(connfd, printbuf, MAXLINE);
+
+	*len = p - buf;
+	return buf;
 }
 
 /* Routine for 'buy' service */
 void buy_routine(int connfd, int id, int amount) {
-	Item *temp = SearchTree(root, id);
+	uint32_t temp = SearchTree(root, id);
 	char *buy_msg;
 
-	if (temp->left_stock < amount)
+	if (temp == NIL) {						// the item is not (or no longer) listed
+		write_reply(connfd, no_item_msg, MAXLINE);
+		return;
+	}
+	if (slab.left_stock[temp] < amount)
 		buy_msg = buy_error_msg;
 	else {
-		temp->left_stock -= amount;		// update the left_stock
+		slab.left_stock[temp] -= amount;	// update the left_stock
 		buy_msg = buy_success_msg;
+		catalog_version++;
+		mark_dirty(id);
 	}
 
-	Rio_writen(connfd, buy_msg, MAXLINE);
+	write_reply(connfd, buy_msg, MAXLINE);
 }
 
 /* Routine for 'sell' service */
 void sell_routine(int connfd, int id, int amount) {
-	Item *temp = SearchTree(root, id);
+	uint32_t temp = SearchTree(root, id);
 
-	temp->left_stock += amount;			// update the left_stock
+	if (temp == NIL) {
+		write_reply(connfd, no_item_msg, MAXLINE);
+		return;
+	}
+	slab.left_stock[temp] += amount;		// update the left_stock
+	catalog_version++;
+	mark_dirty(id);
 
-	Rio_writen(connfd, sell_success_msg, MAXLINE);
+	write_reply(connfd, sell_success_msg, MAXLINE);
+}
+
+/* Routine for 'list' service (adds a new item at runtime) */
+void list_routine(int connfd, int id, int amount, int price) {
+	uint32_t idx;
+
+	if (SearchTree(root, id) != NIL) {
+		write_reply(connfd, list_error_msg, MAXLINE);
+		return;
+	}
+
+	idx = slab_alloc();
+	slab.ID[idx] = id;
+	slab.left_stock[idx] = amount;
+	slab.price[idx] = price;
+
+	root = InsertTree(root, idx);
+	order_insert(order_search(id), idx);		// keep the ID order
+	catalog_version++;
+	mark_dirty(id);
+	write_reply(connfd, list_success_msg, MAXLINE);
+}
+
+/* Routine for 'delist' service (removes an item at runtime) */
+void delist_routine(int connfd, int id) {
+	uint32_t pos;
+
+	if (SearchTree(root, id) == NIL) {
+		write_reply(connfd, no_item_msg, MAXLINE);
+		return;
+	}
+
+	pos = order_search(id);
+	memmove(&order[pos], &order[pos + 1], (--order_size - pos) * sizeof(uint32_t));
+	root = DeleteTree(root, id);				// the slot goes back to the slab
+	catalog_version++;
+	mark_dirty(id);
+
+	write_reply(connfd, delist_success_msg, MAXLINE);
+}
+
+/* Routine for 'stats' service (percentiles of every phase of the requests
+   served so far, by kind) */
+void stats_routine(int connfd) {
+	char *buf = Malloc(STATS_REPLY + MAXLINE);
+
+	write_frames(connfd, buf, stats_report(buf, STATS_REPLY));
+	Free(buf);
+}
+
+/* Apply the buy/sell of one round ('n' trades) grouped by item: each item
+   is looked up once and its trades applied in order of arrival */
+void apply_batch(Trade *trades, int n) {
+	qsort(trades, n, sizeof(Trade), compare_trade);	// (neighbor IDs share a path)
+	catalog_version += n > 0;
+
+	for (int i = 0, j; i < n; i = j) {
+		uint32_t temp = SearchTree(root, trades[i].id);
+
+		if (temp != NIL)
+			mark_dirty(trades[i].id);
+		for (j = i; j < n && trades[j].id == trades[i].id; j++) {
+			Trade *t = &trades[j];
+
+			if (temp == NIL)
+				t->reply = no_item_msg;
+			else if (t->cmd == _sell_) {
+				slab.left_stock[temp] += t->amount;
+				t->reply = sell_success_msg;
+			}
+			else if (slab.left_stock[temp] < t->amount)
+				t->reply = buy_error_msg;
+			else {
+				slab.left_stock[temp] -= t->amount;
+				t->reply = buy_success_msg;
+			}
+		}
+	}
 }
 
+/* Compare two trades by item, then by order of arrival (for qsort) */
+int compare_trade(const void *a, const void *b) {
+	const Trade *x = a, *y = b;
+
+	if (x->id != y->id)
+		return (x->id > y->id) - (x->id < y->id);
+	return x->seq - y->seq;
+}
 
 /* Routine for 'exit' service */
 void exit_routine(int connfd) {
-	Rio_writen(connfd, exit_msg, MAXLINE);
+	write_reply(connfd, exit_msg, MAXLINE);
 	// server has nothing to do with termination of client!
 	// client will be terminated based on its own routine.
 	//  ex) client check the message from server at every iteration,
@@ -211,14 +578,22 @@ void exit_routine(int connfd) {
 
 /* Routine for errorneous requests from clients */
 void error_routine(int connfd) {
-	Rio_writen(connfd, error_msg, MAXLINE);		// just send the 'error msg'
+	write_reply(connfd, error_msg, MAXLINE);		// just send the 'error msg'
+}
+
+/* Compare two items by ID (for qsort) */
+int compare_item(const void *a, const void *b) {
+	int x = ((const Item *)a)->ID, y = ((const Item *)b)->ID;
+
+	return (x > y) - (x < y);
 }
 
 /* Read the 'stock.txt' file and construct the AVL tree */
 void stock_load(void) {
-	int id, left_stock, price;
+	uint32_t n = 0, capacity = 16;
 	char eachLine[128];
 	FILE *fp;
+	Item *loaded = Malloc(capacity * sizeof(Item));
 
 	if (!(fp = fopen("stock.txt", "rt"))) {
 		fprintf(stderr, "The 'stock.txt' file does not exist.\n");
@@ -226,29 +601,46 @@ void stock_load(void) {
 	}
 
 	while (Fgets(eachLine, sizeof(eachLine), fp)) {
-		sscanf(eachLine, "%d %d %d", &id, &left_stock, &price);
-		root = InsertTree(root, id, left_stock, price);
+		if (n == capacity)							// grow the temporary array
+			loaded = Realloc(loaded, (capacity *= 2) * sizeof(Item));
+		sscanf(eachLine, "%d %d %d", &loaded[n].ID, &loaded[n].left_stock, &loaded[n].price);
+		n++;
 	}
-
 	Fclose(fp);
+
+	qsort(loaded, n, sizeof(Item), compare_item);	// slab in ID order,
+	load_rows(loaded, n);
+	Free(loaded);
+}
+
+/* Add rows sorted by ID (and above every listed ID) to the catalog */
+void load_rows(Item *rows, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {				// so the index is sequential
+		uint32_t idx = slab_alloc();
+
+		slab.ID[idx] = rows[i].ID;					// split the rows into columns
+		slab.left_stock[idx] = rows[i].left_stock;
+		slab.price[idx] = rows[i].price;
+		root = InsertTree(root, idx);
+		order_insert(order_size, idx);
+	}
+	catalog_version++;
 }
 
 /* Store the updated 'stock.txt' file (when the server terminates) */
 void stock_store(void) {
 	FILE *fp;
+	size_t len;
+	char *buf;
 
 	if (!(fp = fopen("stock.txt", "wt"))) {
 		fprintf(stderr, "File open error occurs in Store Routine.\n");
 		exit(0);
 	}
 
-	for (int i = 0; i < print_size; i++) {		// just traverse the pointer array
-		char eachLine[128];
-
-		sprintf(eachLine, "%d %d %d\n", print[i]->ID, print[i]->left_stock, print[i]->price);
-
-		Fputs(eachLine, fp);
-	}
+	buf = format_catalog(&len, 0);				// same format as 'show'
+	Fwrite(buf, 1, len, fp);
+	Free(buf);
 
 	Fclose(fp);
 }
@@ -258,7 +650,11 @@ void sigint_handler(int sig) {
 	int olderrno = errno;
 
 	stock_store();				// if Ctrl+C pressed, update the 'stock.txt',
-	ClearTree(root);			// clear the AVL tree.
+	Free(slab.nodes);			// clear the AVL tree.
+	Free(slab.ID);
+	Free(slab.left_stock);
+	Free(slab.price);
+	log_flush();				// (what the flusher has not written yet)
 	printf("\nServer has terminated with 'stock.txt' update!\n");
 	exit(0);
 
@@ -277,6 +673,7 @@ void init_pool(int listenfd, Pool *p) {
 
 	p->maxfd = listenfd;
 	FD_ZERO(&p->read_set);
+	FD_ZERO(&p->write_set);
 	FD_SET(listenfd, &p->read_set);			// set 'listenfd' in read_set
 }
 
@@ -305,63 +702,679 @@ void add_client(int connfd, Pool *p) {
 		app_error("Error in add_client!\n");
 }
 
-/* Check if there are any pending inputs, and provide service */
+/* Check if there are any pending inputs, and provide service (every
+   request a client has pipelined, in order) */
 void check_client(Pool *p) {
 	int n, connfd;
 	char buf[MAXLINE];
-	rio_t rio;
+	rio_t *rp;
 
-	for (int i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
+	for (int i = 0; i <= p->maxi; i++) {			// (buffered requests aren't in 'nready')
 		connfd = p->clientfd[i];
-		rio = p->clientrio[i];
+		rp = &p->clientrio[i];
 
-		if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set))) {	// if pending,
-			if ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {		// then read!
-				printf("server received %d bytes\n", n);
+		if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set)		// if pending,
+				|| (FD_ISSET(connfd, &p->read_set) && line_buffered(rp)))) {
+			do {
+				if ((n = Rio_readlineb(rp, buf, MAXLINE)) == 0) {	// then read!
+					log_event(LOG_CLOSE, connfd, 0, 0);
+					Close(connfd);
+					FD_CLR(connfd, &p->read_set);
+					p->clientfd[i] = -1;
+					break;
+				}
+				log_event(LOG_REQUEST, connfd, n, 0);
 				service(connfd, buf, n);							// and service!
-			}
-			else {
-				Close(connfd);
-				FD_CLR(connfd, &p->read_set);
-				p->clientfd[i] = -1;
-			}
+				if (outbox[connfd]) {								// (a helper
+					FD_CLR(connfd, &p->read_set);					// makes the reply)
+					break;
+				}
+			} while (line_buffered(rp));
 		}
 	}
 } 
+
+/* Serve every pending input as 'check_client' does, but in three stages:
+   read and parse every request (serving the others on the spot, as if
+   they came first), apply the buy/sell by item, then write their replies.
+   The trades a client has pipelined all join the batch; a later request
+   of another kind waits for the next round, after their replies */
+void check_batch(Pool *p) {
+	static Trade *trades;
+	static int size;
+	int n, connfd, ntrades = 0, id, amount, price;
+	uint64_t start, applied;
+	char buf[MAXLINE];
+	command cmd;
+	rio_t *rp;
+
+	for (int i = 0; i <= p->maxi; i++) {
+		int mine = 0;								// trades of this client so far
+
+		connfd = p->clientfd[i];
+		rp = &p->clientrio[i];
+		if ((connfd <= 0) || !(FD_ISSET(connfd, &p->ready_set)
+				|| (FD_ISSET(connfd, &p->read_set) && line_buffered(rp))))
+			continue;
+		do {
+			if (mine > 0 && (cmd = peek_command(rp)) != _buy_ && cmd != _sell_)
+				break;
+			if ((n = Rio_readlineb(rp, buf, MAXLINE)) == 0) {	// (only the first read
+				log_event(LOG_CLOSE, connfd, 0, 0);				// may wait for data)
+				Close(connfd);
+				FD_CLR(connfd, &p->read_set);
+				p->clientfd[i] = -1;
+				break;
+			}
+			log_event(LOG_REQUEST, connfd, n, 0);
+			cmd = what_command(buf, &id, &amount, &price);
+			if (cmd == _buy_ || cmd == _sell_) {			// parsed now, applied below
+				if (ntrades == size)
+					trades = Realloc(trades, (size = size ? 2 * size : FD_SETSIZE) * sizeof(Trade));
+				trades[ntrades] = (Trade){ id, ntrades, connfd, cmd, amount, NULL };
+				ntrades++;
+				mine++;
+			}
+			else {
+				service(connfd, buf, n);
+				if (outbox[connfd]) {
+					FD_CLR(connfd, &p->read_set);			// until its reply is out
+					break;
+				}
+			}
+		} while (line_buffered(rp));
+	}
+
+	start = stats_now();
+	apply_batch(trades, ntrades);
+	applied = stats_now();
+	for (int i = 0; i < ntrades; i++) {				// (a trade waits for the batch)
+		StatSample stat = { trades[i].cmd == _buy_ ? STAT_BUY : STAT_SELL,
+				{ start - round_start, applied - start } };
+		uint64_t written = write_time;
+
+		write_reply(trades[i].connfd, trades[i].reply, MAXLINE);
+		stat.phase[STAT_WRITE] = write_time - written;
+		stats_record(&stat);
+	}
+}
+
+/* Return 1 if a whole request is buffered in 'rp' (read without blocking) */
+int line_buffered(rio_t *rp) {
+	return rp->rio_cnt > 0 && memchr(rp->rio_bufptr, '\n', rp->rio_cnt) != NULL;
+}
+
+/* Return 1 if a client which is served has a whole request buffered
+   (select can't see it, the socket may have nothing more) */
+int lines_buffered(Pool *p) {
+	for (int i = 0; i <= p->maxi; i++)
+		if (p->clientfd[i] > 0 && FD_ISSET(p->clientfd[i], &p->read_set)
+				&& line_buffered(&p->clientrio[i]))
+			return 1;
+	return 0;
+}
+
+/* Return the command of the request buffered in 'rp', which stays there */
+command peek_command(rio_t *rp) {
+	char line[MAXLINE];
+	int id, amount, price;
+	size_t len = (char *)memchr(rp->rio_bufptr, '\n', rp->rio_cnt) - rp->rio_bufptr + 1;
+
+	if (len > MAXLINE - 1)
+		len = MAXLINE - 1;
+	memcpy(line, rp->rio_bufptr, len);
+	line[len] = '\0';
+	return what_command(line, &id, &amount, &price);
+}
 /***    Subroutines for I/O Multiplexing End   ***/
 
 
+/***       Subroutines for Show Helpers        ***/
+/* Start 'n' helper threads and watch their eventfd from the loop */
+void show_init(int n, Pool *p) {
+	pthread_t tid;
+
+	if ((showfd = eventfd(0, EFD_NONBLOCK)) < 0)
+		unix_error("eventfd error");
+	FD_SET(showfd, &p->read_set);
+	if (showfd > p->maxfd)
+		p->maxfd = showfd;
+	Sem_init(&job_mutex, 0, 1);
+	Sem_init(&job_items, 0, 0);
+	Sem_init(&done_mutex, 0, 1);
+	for (int i = 0; i < n && i < SHOW_HELPERS; i++)
+		Pthread_create(&tid, NULL, show_helper, NULL);
+}
+
+/* Hand the 'show' of 'connfd' to a helper: the loop copies the rows (or
+   reuses the copy if nothing has changed since), which is much cheaper
+   than formatting them, so the helper formats a consistent catalog */
+void show_offload(int connfd) {
+	Job *job = Malloc(sizeof(Job));
+
+	if (snapshot == NULL || snapshot->version != catalog_version) {
+		snapshot_put(snapshot);
+		snapshot = Malloc(sizeof(Snapshot));
+		snapshot->rows = Malloc((order_size + 1) * sizeof(Item));
+		snapshot->n = order_size;
+		snapshot->version = catalog_version;
+		snapshot->refs = 1;							// (the loop's own reference)
+		for (uint32_t i = 0; i < order_size; i++) {
+			uint32_t k = order[i];
+
+			snapshot->rows[i] = (Item){ slab.ID[k], slab.left_stock[k], slab.price[k] };
+		}
+	}
+	__atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+
+	job->connfd = connfd;
+	job->snap = snapshot;
+	job->buf = NULL;
+	job->len = job->sent = 0;
+	job->next = NULL;
+	outbox[connfd] = job;
+	shows_in_flight++;
+
+	P(&job_mutex);
+	if (job_tail)
+		job_tail->next = job;
+	else
+		job_head = job;
+	job_tail = job;
+	V(&job_mutex);
+	V(&job_items);
+}
+
+/* Thread routine of a helper: format the rows of a job into frames and
+   hand it back to the loop */
+void *show_helper(void *vargp) {
+	uint64_t one = 1;
+
+	Pthread_detach(pthread_self());
+	while (1) {
+		Job *job;
+		size_t len;
+
+		P(&job_items);
+		P(&job_mutex);
+		job = job_head;
+		if ((job_head = job->next) == NULL)
+			job_tail = NULL;
+		V(&job_mutex);
+
+		job->buf = format_rows(job->snap->rows, job->snap->n, &len, MAXLINE);
+		job->len = (len / MAXLINE + 1) * MAXLINE;		// as 'write_frames' does
+		memset(job->buf + len, 0, job->len - len);
+		snapshot_put(job->snap);
+
+		P(&done_mutex);
+		job->next = job_done;
+		job_done = job;
+		V(&done_mutex);
+		if (write(showfd, &one, sizeof(one)) < 0)
+			unix_error("eventfd write error");
+	}
+
+	return NULL;
+}
+
+/* Take the jobs the helpers have finished and start sending them */
+void take_shows(Pool *p) {
+	uint64_t count;
+	Job *job;
+
+	if (read(showfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		unix_error("eventfd read error");
+	P(&done_mutex);
+	job = job_done;
+	job_done = NULL;
+	V(&done_mutex);
+
+	while (job) {
+		Job *next = job->next;
+
+		send_show(job, p);
+		job = next;
+	}
+}
+
+/* Go on sending the replies whose clients can take more */
+void flush_shows(Pool *p) {
+	for (int i = 0; i <= p->maxi; i++) {
+		int connfd = p->clientfd[i];
+
+		if (connfd > 0 && FD_ISSET(connfd, &p->write_set) && FD_ISSET(connfd, &p->writable_set))
+			send_show(outbox[connfd], p);
+	}
+}
+
+/* Send as much of a reply as the socket takes without blocking; once it
+   is out, the client is served again (a client which is gone is closed) */
+void send_show(Job *job, Pool *p) {
+	int connfd = job->connfd;
+	ssize_t n;
+
+	while (job->sent < job->len) {
+		n = send(connfd, job->buf + job->sent, job->len - job->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			FD_SET(connfd, &p->write_set);			// the rest when it is writable
+			return;
+		}
+		if (n < 0)
+			break;
+		job->sent += n;
+	}
+
+	FD_CLR(connfd, &p->write_set);
+	if (job->sent == job->len)
+		FD_SET(connfd, &p->read_set);				// the next request
+	else {
+		for (int i = 0; i <= p->maxi; i++)
+			if (p->clientfd[i] == connfd)
+				p->clientfd[i] = -1;
+		log_event(LOG_CLOSE, connfd, 0, 0);
+		Close(connfd);
+	}
+	outbox[connfd] = NULL;
+	shows_in_flight--;
+	Free(job->buf);
+	Free(job);
+}
+
+/* Drop a reference to a snapshot (from any thread), free it with the last */
+void snapshot_put(Snapshot *snap) {
+	if (snap && __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		Free(snap->rows);
+		Free(snap);
+	}
+}
+/***     Subroutines for Show Helpers End      ***/
+
+
+/***        Subroutines for Hot Upgrade        ***/
+/* Open the control socket where a new server asks for the handoff */
+int upgrade_listen(void) {
+	struct sockaddr_un addr;
+	int fd = Socket(AF_UNIX, SOCK_SEQPACKET, 0);		// messages keep their bounds
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, UPGRADE_SOCK);
+	unlink(UPGRADE_SOCK);							// left by the previous server
+	if (bind(fd, (SA *)&addr, sizeof(addr)) < 0)
+		unix_error("Upgrade socket error");
+	Listen(fd, 1);
+
+	return fd;
+}
+
+/* Take over the server running in this directory: load the snapshot it
+   writes while it serves on, then ask for the handoff. Return its
+   listening socket; its clients go to 'kept', and the changes made during
+   the load are applied to the catalog */
+int upgrade_take(int *kept, int *nkept) {
+	struct sockaddr_un addr;
+	struct timespec start, loaded, end;
+	int ctl = Socket(AF_UNIX, SOCK_SEQPACKET, 0), fds[UPGRADE_FDS], nfds, listenfd = -1;
+	char tag[UPGRADE_TAG + 1];
+	Item *rows = Malloc(UPGRADE_ROWS * sizeof(Item));
+	uint32_t changed = 0;
+	ssize_t len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, UPGRADE_SOCK);
+	if (connect(ctl, (SA *)&addr, sizeof(addr)) < 0)
+		unix_error("No server to take over");
+	if (send_msg(ctl, "hold", NULL, 0, NULL, 0) < 0
+			|| recv_msg(ctl, tag, NULL, 0, NULL, NULL) < 0 || strcmp(tag, "snap"))
+		app_error("The running server failed to write its catalog");
+	load_snapshot();									// (the old server serves on)
+	clock_gettime(CLOCK_MONOTONIC, &loaded);
+	if (send_msg(ctl, "handoff", NULL, 0, NULL, 0) < 0)
+		app_error("The running server is gone");
+
+	while ((len = recv_msg(ctl, tag, rows, UPGRADE_ROWS * sizeof(Item), fds, &nfds)) >= 0) {
+		if (!strcmp(tag, "listen") && nfds == 1)
+			listenfd = fds[0];
+		else if (!strcmp(tag, "conns")) {
+			if (*nkept + nfds > FD_SETSIZE) {			// more than we can serve: fail,
+				for (int i = 0; i < nfds; i++)			// so the old server serves on
+					Close(fds[i]);
+				break;
+			}
+			memcpy(kept + *nkept, fds, nfds * sizeof(int));
+			*nkept += nfds;
+		}
+		else if (!strcmp(tag, "rows")) {				// changed or listed since
+			apply_rows(rows, len / sizeof(Item));
+			changed += len / sizeof(Item);
+		}
+		else if (!strcmp(tag, "gone")) {				// delisted since
+			remove_ids((int *)rows, len / sizeof(int));
+			changed += len / sizeof(int);
+		}
+		else if (!strcmp(tag, "done") && listenfd >= 0) {
+			send_msg(ctl, "taken", NULL, 0, NULL, 0);	// the old server may exit
+			Close(ctl);
+			Free(rows);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			printf("Took over %u items (%u changed during the load) and %d clients: "
+					"loaded in %.1f ms, handed over in %.1f ms\n", order_size, changed, *nkept,
+					(loaded.tv_sec - start.tv_sec) * 1e3 + (loaded.tv_nsec - start.tv_nsec) / 1e6,
+					(end.tv_sec - loaded.tv_sec) * 1e3 + (end.tv_nsec - loaded.tv_nsec) / 1e6);
+			return listenfd;
+		}
+	}
+	app_error("The running server failed to hand over");
+	return -1;
+}
+
+/* Load the snapshot written by the old server and remove it */
+void load_snapshot(void) {
+	struct stat st;
+	Item *rows;
+	int fd;
+
+	if ((fd = open(UPGRADE_SNAP, O_RDONLY)) < 0)
+		unix_error("Snapshot open error");
+	Fstat(fd, &st);
+	rows = Malloc(st.st_size + 1);
+	if (rio_readn(fd, rows, st.st_size) != st.st_size)
+		app_error("The snapshot is cut short");
+	Close(fd);
+	unlink(UPGRADE_SNAP);
+
+	load_rows(rows, st.st_size / sizeof(Item));		// (rows in ID order)
+	Free(rows);
+}
+
+/* Set the rows changed during the load, adding the ones listed since */
+void apply_rows(Item *rows, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t idx = SearchTree(root, rows[i].ID);
+
+		if (idx == NIL) {
+			idx = slab_alloc();
+			slab.ID[idx] = rows[i].ID;
+			root = InsertTree(root, idx);
+			order_insert(order_search(rows[i].ID), idx);
+		}
+		slab.left_stock[idx] = rows[i].left_stock;
+		slab.price[idx] = rows[i].price;
+	}
+	catalog_version++;
+}
+
+/* Remove the items delisted during the load */
+void remove_ids(int *ids, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t pos;
+
+		if (SearchTree(root, ids[i]) == NIL)
+			continue;								// (listed and delisted since)
+		pos = order_search(ids[i]);
+		memmove(&order[pos], &order[pos + 1], (--order_size - pos) * sizeof(uint32_t));
+		root = DeleteTree(root, ids[i]);
+	}
+	catalog_version++;
+}
+
+/* Accept a new server, which asks to 'hold': a child writes the catalog as
+   it is now while the loop serves on, and every change from now on is
+   marked to be sent along with the handoff */
+void upgrade_accept(int ctlfd, Pool *p) {
+	int ctl = accept(ctlfd, NULL, NULL);
+	char tag[UPGRADE_TAG + 1];
+
+	p->nready--;
+	if (ctl < 0)
+		return;
+	if (upgrade_ctl >= 0 || recv_msg(ctl, tag, NULL, 0, NULL, NULL) < 0
+			|| strcmp(tag, "hold")) {				// (one upgrade at a time)
+		Close(ctl);
+		return;
+	}
+	if ((upgrade_pid = fork()) == 0)
+		write_snapshot(ctl);						// (does not return)
+	if (upgrade_pid < 0) {
+		fprintf(stderr, "Can't fork for the upgrade (%s)\n", strerror(errno));
+		Close(ctl);
+		return;
+	}
+
+	upgrade_ctl = ctl;
+	ndirty = 0;
+	FD_SET(ctl, &p->read_set);						// its 'handoff' once loaded
+	if (ctl > p->maxfd)
+		p->maxfd = ctl;
+}
+
+/* Child routine: write the catalog (copy-on-write, so as it was at the
+   fork) as rows in ID order, tell the new server and exit. Only system
+   calls are used, the other threads of the parent are not here */
+void write_snapshot(int ctl) {
+	static Item rows[UPGRADE_ROWS];
+	char tmp[] = UPGRADE_SNAP ".tmp";
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644), ok = (fd >= 0);
+
+	for (uint32_t i = 0, n; ok && i < order_size; i += n) {
+		n = (order_size - i < UPGRADE_ROWS) ? order_size - i : UPGRADE_ROWS;
+		for (uint32_t j = 0; j < n; j++) {
+			uint32_t k = order[i + j];
+
+			rows[j] = (Item){ slab.ID[k], slab.left_stock[k], slab.price[k] };
+		}
+		ok = (rio_writen(fd, rows, n * sizeof(Item)) == (ssize_t)(n * sizeof(Item)));
+	}
+	if (fd >= 0 && close(fd) < 0)
+		ok = 0;
+	if (ok && rename(tmp, UPGRADE_SNAP) < 0)		// (a torn one is never loaded)
+		ok = 0;
+	send_msg(ctl, ok ? "snap" : "failed", NULL, 0, NULL, 0);
+	_exit(0);
+}
+
+/* Read the message of the new server: it has loaded and asks for the
+   handoff (done between two rounds), or it is gone */
+void upgrade_message(Pool *p) {
+	char tag[UPGRADE_TAG + 1];
+
+	p->nready--;
+	if (recv_msg(upgrade_ctl, tag, NULL, 0, NULL, NULL) < 0 || strcmp(tag, "handoff")) {
+		fprintf(stderr, "The new server gave up, serving on\n");
+		upgrade_end(p);
+		return;
+	}
+	FD_CLR(upgrade_ctl, &p->read_set);				// (it waits for us now)
+	upgrade_asked = 1;
+}
+
+/* Stop an upgrade which has failed */
+void upgrade_end(Pool *p) {
+	FD_CLR(upgrade_ctl, &p->read_set);
+	Close(upgrade_ctl);
+	waitpid(upgrade_pid, NULL, 0);					// (the child is done, or soon)
+	unlink(UPGRADE_SNAP);
+	upgrade_ctl = -1;
+	upgrade_asked = 0;
+	ndirty = 0;
+}
+
+/* Mark an item changed while a new server loads the snapshot */
+void mark_dirty(int id) {
+	if (upgrade_ctl < 0)
+		return;
+	if (ndirty == dirty_cap)
+		dirty = Realloc(dirty, (dirty_cap = dirty_cap ? 2 * dirty_cap : 1024) * sizeof(int));
+	dirty[ndirty++] = id;
+}
+
+/* Compare two IDs (for qsort) */
+int compare_int(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Hand everything to the new server and exit, once no request is in
+   flight: the listening socket, every client and the items changed since
+   the snapshot. A 'show' still being sent, or bytes of a request read
+   into a client's buffer, would be lost, so the handoff waits for a later
+   round. Nothing is closed until the new server has taken it all, so a
+   failed handoff just serves on */
+void handoff(int listenfd, Pool *p) {
+	int fds[UPGRADE_FDS], gone[UPGRADE_ROWS], n = 0, ngone = 0, nrows = 0, ok;
+	char tag[UPGRADE_TAG + 1];
+	uint32_t changed = 0;
+	Item *rows;
+
+	if (shows_in_flight > 0)
+		return;
+	for (int i = 0; i <= p->maxi; i++)
+		if (p->clientfd[i] > 0 && p->clientrio[i].rio_cnt > 0)
+			return;
+
+	ok = (send_msg(upgrade_ctl, "listen", NULL, 0, &listenfd, 1) == 0);
+	for (int j = 0; ok && j <= p->maxi; j++) {
+		if (p->clientfd[j] >= 0)
+			fds[n++] = p->clientfd[j];
+		if (n == UPGRADE_FDS || (j == p->maxi && n > 0)) {
+			ok = (send_msg(upgrade_ctl, "conns", NULL, 0, fds, n) == 0);
+			n = 0;
+		}
+	}
+
+	qsort(dirty, ndirty, sizeof(int), compare_int);	// (each item once)
+	rows = Malloc(UPGRADE_ROWS * sizeof(Item));
+	for (uint32_t i = 0; ok && i < ndirty; i++) {
+		uint32_t k;
+
+		if (i > 0 && dirty[i] == dirty[i - 1])
+			continue;
+		changed++;
+		if ((k = SearchTree(root, dirty[i])) != NIL)
+			rows[nrows++] = (Item){ slab.ID[k], slab.left_stock[k], slab.price[k] };
+		else
+			gone[ngone++] = dirty[i];
+		if (nrows == UPGRADE_ROWS) {
+			ok = (send_msg(upgrade_ctl, "rows", rows, nrows * sizeof(Item), NULL, 0) == 0);
+			nrows = 0;
+		}
+		if (ngone == UPGRADE_ROWS) {
+			ok = ok && (send_msg(upgrade_ctl, "gone", gone, ngone * sizeof(int), NULL, 0) == 0);
+			ngone = 0;
+		}
+	}
+	if (ok && nrows > 0)								// (the rest)
+		ok = (send_msg(upgrade_ctl, "rows", rows, nrows * sizeof(Item), NULL, 0) == 0);
+	if (ok && ngone > 0)
+		ok = (send_msg(upgrade_ctl, "gone", gone, ngone * sizeof(int), NULL, 0) == 0);
+	Free(rows);
+
+	if (ok && send_msg(upgrade_ctl, "done", NULL, 0, NULL, 0) == 0	// (until the new
+			&& recv_msg(upgrade_ctl, tag, NULL, 0, NULL, NULL) >= 0	// server has them,
+			&& !strcmp(tag, "taken")) {								// we have too)
+		printf("Handed over %u items (%u changes) and the clients to the new server\n",
+				order_size, changed);
+		log_flush();
+		exit(0);
+	}
+	fprintf(stderr, "The upgrade failed, serving on\n");
+	upgrade_end(p);
+}
+
+/* Send a message of the upgrade protocol: a tag, 'len' bytes of data and
+   up to UPGRADE_FDS descriptors; -1 if the peer is gone */
+int send_msg(int sock, char *tag, void *data, size_t len, int *fds, int nfds) {
+	char head[UPGRADE_TAG] = {0};
+	struct iovec iov[2] = {{head, UPGRADE_TAG}, {data, len}};
+	union {											// aligned for cmsghdr
+		char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+
+	memcpy(head, tag, strnlen(tag, UPGRADE_TAG));
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	if (nfds > 0) {									// the descriptors are
+		memset(&ctrl, 0, sizeof(ctrl));				// duplicated into the peer
+		mh.msg_control = ctrl.buf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/* Receive a message of the upgrade protocol into 'tag' (UPGRADE_TAG + 1
+   bytes), 'data' and 'fds'; return the length of the data (-1: gone) */
+ssize_t recv_msg(int sock, char *tag, void *data, size_t size, int *fds, int *nfds) {
+	struct iovec iov[2] = {{tag, UPGRADE_TAG}, {data, size}};
+	union {
+		char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	ssize_t n;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	mh.msg_control = ctrl.buf;
+	mh.msg_controllen = sizeof(ctrl.buf);
+	if ((n = recvmsg(sock, &mh, 0)) < UPGRADE_TAG || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+		return -1;
+	tag[UPGRADE_TAG] = '\0';
+
+	if (nfds)
+		*nfds = 0;
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && fds) {
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+
+	return n - UPGRADE_TAG;
+}
+/***      Subroutines for Hot Upgrade End      ***/
+
+
 /***        Subroutines for the AVL Tree       ***/
-/* Node insertion routine of AVL tree */
-Item* InsertTree(Item* node, int id, int left_stock, int price) {
-	Item* new_item;
-
-	if (node == NULL) {								// if recursion met NULL,
-		new_item = (Item*)malloc(sizeof(Item));		// create new node!
-		new_item->ID = id;
-		new_item->left_stock = left_stock;
-		new_item->price = price;
-		new_item->height = 0;
-		new_item->left = new_item->right = NULL;	// initialization routine
-		print[print_size++] = new_item;				// insert into pointer array too!
-		return new_item;
-	}
-
-	if (id > node->ID) {
-		node->right = InsertTree(node->right, id, left_stock, price);
-
-		if ((GetHeight(node->right) - GetHeight(node->left)) == 2) {
-			if (id > node->right->ID)
+/* Node insertion routine of AVL tree (links an allocated slot) */
+uint32_t InsertTree(uint32_t node, uint32_t item) {
+	int id = KEY(item);
+
+	if (node == NIL) {								// if recursion met NIL,
+		NODE(item).height = 0;						// link the new node!
+		NODE(item).left = NODE(item).right = NIL;	// initialization routine
+		return item;
+	}
+
+	if (id > KEY(node)) {
+		NODE(node).right = InsertTree(NODE(node).right, item);
+
+		if ((GetHeight(NODE(node).right) - GetHeight(NODE(node).left)) == 2) {
+			if (id > KEY(NODE(node).right))
 				node = SingleRotateRight(node);
 			else
 				node = DoubleRotateRight(node);
 		}											// insertion algorithm of AVL tree
 	}
-	else if (id < node->ID) {
-		node->left = InsertTree(node->left, id, left_stock, price);
+	else if (id < KEY(node)) {
+		NODE(node).left = InsertTree(NODE(node).left, item);
 
-		if ((GetHeight(node->left) - GetHeight(node->right)) == 2) {
-			if (id < node->left->ID)
+		if ((GetHeight(NODE(node).left) - GetHeight(NODE(node).right)) == 2) {
+			if (id < KEY(NODE(node).left))
 				node = SingleRotateLeft(node);
 			else
 				node = DoubleRotateLeft(node);
@@ -369,78 +1382,125 @@ Item* InsertTree(Item* node, int id, int left_stock, int price) {
 	}
 	else unix_error("Stock list in stock.txt has something wrong!\n");
 
-	node->height = GetGreater(GetHeight(node->left), GetHeight(node->right)) + 1;
+	NODE(node).height = GetGreater(GetHeight(NODE(node).left), GetHeight(NODE(node).right)) + 1;
 	// coordinates heights!
 	return node;
 }
 
-/* Inorder traversal for searching some items */
-Item* SearchTree(Item* node, int id) {
-	if (node == NULL || node->ID == id)
-		return node;
+/* Node deletion routine of AVL tree */
+uint32_t DeleteTree(uint32_t node, int id) {
+	uint32_t succ, right;
+
+	if (node == NIL)
+		return NIL;
+
+	if (id > KEY(node))
+		NODE(node).right = DeleteTree(NODE(node).right, id);
+	else if (id < KEY(node))
+		NODE(node).left = DeleteTree(NODE(node).left, id);
+	else {
+		if (NODE(node).left == NIL || NODE(node).right == NIL) {
+			succ = (NODE(node).left != NIL) ? NODE(node).left : NODE(node).right;
+			slab_release(node);
+			return succ;
+		}
 
-	if (node->ID > id)
-		return SearchTree(node->left, id);
+		right = DeleteMin(NODE(node).right, &succ);	// relink the successor node
+		NODE(succ).left = NODE(node).left;			// (the index holds slots)
+		NODE(succ).right = right;
+		slab_release(node);
+		node = succ;
+	}
 
-	return SearchTree(node->right, id);
+	return Rebalance(node);
 }
 
-/* Inorder traversal for freeing AVL tree */
-void ClearTree(Item* node) {
-	if (node != NULL) {
-		ClearTree(node->left);
-		ClearTree(node->right);
-		Free(node);
+/* Unlink the minimum node of a subtree and return the new subtree */
+uint32_t DeleteMin(uint32_t node, uint32_t *min) {
+	if (NODE(node).left == NIL) {
+		*min = node;
+		return NODE(node).right;
 	}
+
+	NODE(node).left = DeleteMin(NODE(node).left, min);
+	return Rebalance(node);
+}
+
+/* Inorder traversal for searching some items */
+uint32_t SearchTree(uint32_t node, int id) {
+	while (node != NIL && KEY(node) != id)
+		node = (KEY(node) > id) ? NODE(node).left : NODE(node).right;
+
+	return node;
+}
+
+/* Restore the AVL property of a node after deletion */
+uint32_t Rebalance(uint32_t node) {
+	Node *n = &NODE(node);
+
+	if ((GetHeight(n->left) - GetHeight(n->right)) == 2) {
+		if (GetHeight(NODE(n->left).left) >= GetHeight(NODE(n->left).right))
+			node = SingleRotateLeft(node);
+		else
+			node = DoubleRotateLeft(node);
+	}
+	else if ((GetHeight(n->right) - GetHeight(n->left)) == 2) {
+		if (GetHeight(NODE(n->right).right) >= GetHeight(NODE(n->right).left))
+			node = SingleRotateRight(node);
+		else
+			node = DoubleRotateRight(node);
+	}
+
+	n = &NODE(node);
+	n->height = GetGreater(GetHeight(n->left), GetHeight(n->right)) + 1;
+	return node;
 }
 
 /* Left single rotation */
-Item* SingleRotateLeft(Item *nodeB) {
-	Item* nodeA = NULL;
+uint32_t SingleRotateLeft(uint32_t nodeB) {
+	uint32_t nodeA = NODE(nodeB).left;
 
-	nodeA = nodeB->left;
-	nodeB->left = nodeA->right;		// rotating process
-	nodeA->right = nodeB;
+	NODE(nodeB).left = NODE(nodeA).right;		// rotating process
+	NODE(nodeA).right = nodeB;
 
-	nodeB->height = GetGreater(GetHeight(nodeB->left), GetHeight(nodeB->right)) + 1;
-	nodeA->height = GetGreater(GetHeight(nodeA->left), GetHeight(nodeB)) + 1;
+	NODE(nodeB).height = GetGreater(GetHeight(NODE(nodeB).left), GetHeight(NODE(nodeB).right)) + 1;
+	NODE(nodeA).height = GetGreater(GetHeight(NODE(nodeA).left), GetHeight(nodeB)) + 1;
 
 	return nodeA;
 }
 
 /* Right single rotation */
-Item* SingleRotateRight(Item *nodeA) {
-	Item* nodeB = NULL;
+uint32_t SingleRotateRight(uint32_t nodeA) {
+	uint32_t nodeB = NODE(nodeA).right;
 
-	nodeB = nodeA->right;
-	nodeA->right = nodeB->left;		// rotating process
-	nodeB->left = nodeA;
+	NODE(nodeA).right = NODE(nodeB).left;		// rotating process
+	NODE(nodeB).left = nodeA;
 
-	nodeA->height = GetGreater(GetHeight(nodeA->left), GetHeight(nodeA->right)) + 1;
-	nodeB->height = GetGreater(GetHeight(nodeB->right), GetHeight(nodeA)) + 1;
+	NODE(nodeA).height = GetGreater(GetHeight(NODE(nodeA).left), GetHeight(NODE(nodeA).right)) + 1;
+	NODE(nodeB).height = GetGreater(GetHeight(NODE(nodeB).right), GetHeight(nodeA)) + 1;
 
 	return nodeB;
 }
 
 /* Left double rotation */
-Item* DoubleRotateLeft(Item *node) {
-	node->left = SingleRotateRight(node->left);
+uint32_t DoubleRotateLeft(uint32_t node) {
+	NODE(node).left = SingleRotateRight(NODE(node).left);
 
 	return SingleRotateLeft(node);
 }
 
 /* Right double rotation */
-Item* DoubleRotateRight(Item *node) {
-	node->right = SingleRotateLeft(node->right);
+uint32_t DoubleRotateRight(uint32_t node) {
+	NODE(node).right = SingleRotateLeft(NODE(node).right);
 
 	return SingleRotateRight(node);
 }
 
 /* Return the height of input node */
-int GetHeight(Item *node) {
-	if (node == NULL)
+int GetHeight(uint32_t node) {
+	if (node == NIL)
 		return -1;					// -1 for comparison and addition
-	return node->height;
+	return NODE(node).height;
 }
 
 /* Return greater one between two heights */
@@ -448,4 +1508,110 @@ int GetGreater(int heightA, int heightB) {
 	return (heightA > heightB) ? heightA : heightB;
 }
 /***      Subroutines for the AVL Tree End     ***/
+
+
+
+/***  Subroutines for the Item Slab and Index  ***/
+/* Hand out a slot for a new item, growing the slab on demand */
+uint32_t slab_alloc(void) {
+	if (slab.nfree > 0)							// reuse a delisted slot first
+		return slab.free[--slab.nfree];
+
+	if (slab.used == slab.capacity) {			// links are indexes, so the slab
+		if (slab.capacity >= NIL / 2)			// can move freely on growth
+			app_error("Item slab is full");
+		slab.capacity = GetGreater(16, 2 * slab.capacity);
+		slab.nodes = Realloc(slab.nodes, slab.capacity * sizeof(Node));
+		slab.ID = Realloc(slab.ID, slab.capacity * sizeof(int));
+		slab.left_stock = Realloc(slab.left_stock, slab.capacity * sizeof(int));
+		slab.price = Realloc(slab.price, slab.capacity * sizeof(int));
+	}
+
+	return slab.used++;
+}
+
+/* Give a slot of a delisted item back to the slab */
+void slab_release(uint32_t idx) {
+	if (slab.nfree == slab.free_cap) {
+		slab.free_cap = GetGreater(16, 2 * slab.free_cap);
+		slab.free = Realloc(slab.free, slab.free_cap * sizeof(uint32_t));
+	}
+	slab.free[slab.nfree++] = idx;
+}
+
+/* Return the position of the first entry of the index whose ID >= id */
+uint32_t order_search(int id) {
+	uint32_t lo = 0, hi = order_size;
+
+	while (lo < hi) {							// binary search on the index
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (KEY(order[mid]) < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Insert slab index 'idx' at position 'pos' of the index */
+void order_insert(uint32_t pos, uint32_t idx) {
+	if (order_size == order_cap) {				// grow with the catalog
+		order_cap = GetGreater(16, 2 * order_cap);
+		order = Realloc(order, order_cap * sizeof(uint32_t));
+	}
+
+	memmove(&order[pos + 1], &order[pos], (order_size - pos) * sizeof(uint32_t));
+	order[pos] = idx;
+	order_size++;
+}
+/***Subroutines for the Item Slab and Index End***/
+
+
+
+/***     Subroutines for Decimal Formatting    ***/
+/* Write 'v' in decimal at 'dst' and return the end (no '\0', 11 bytes at most) */
+char *format_int(char *dst, int v) {
+	uint32_t u = (uint32_t)v;
+
+	if (v < 0) {
+		*dst++ = '-';
+		u = 0u - u;
+	}
+	if (u >= 100000000) {					// 9 or 10 digits: 1-2 leading ones
+		uint32_t hi = u / 100000000;		// and then exactly 8 more
+
+		if (hi >= 10)
+			*dst++ = '0' + hi / 10;
+		*dst++ = '0' + hi % 10;
+		return format_digits(dst, u % 100000000, 8);
+	}
+	return format_digits(dst, u, 0);
+}
+
+/* Convert u < 10^8 into 8 digits at once inside one 64-bit word (SWAR),
+   then write the last 'width' of them (0: drop the leading zeros) */
+char *format_digits(char *dst, uint32_t u, int width) {
+	uint64_t x = (u / 10000) | ((uint64_t)(u % 10000) << 32);	// 4 + 4 digits
+	uint64_t y;
+	char digits[8];
+
+	y = ((x * 10486) >> 20) & 0x0000007F0000007FULL;	// x / 100 in every half
+	x = y | ((x - y * 100) << 16);						// 2 + 2 + 2 + 2 digits
+	y = ((x * 103) >> 10) & 0x000F000F000F000FULL;		// x / 10 in every quarter
+	x = y | ((x - y * 10) << 8);						// one digit per byte, the
+														// most significant one first
+	if (width == 0)
+		width = x ? 8 - __builtin_ctzll(x) / 8 : 1;		// leading zeros are low bytes
+	x |= 0x3030303030303030ULL;							// into ASCII
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	memcpy(digits, &x, 8);
+	memcpy(dst, digits + 8 - width, width);
+
+	return dst + width;
+}
+/***  Subroutines for Decimal Formatting End   ***/
 /************** End of the Program ***************/
\ No newline at end of file
@@ -0,0 +1,160 @@
+/**************************************************
+ * Title: SP-Project 2  -  CPU and Memory Placement
+ * Summary: implementation of 'affinity.h'. The nodes
+ are those of '/sys/devices/system/node/online'
+ (numbers may have gaps), the CPUs of node N those
+ of 'node<N>/cpulist'; without them every CPU is on
+ node 0. Memory is a fresh mapping placed with
+ mbind(MPOL_PREFERRED) before any page of it is
+ touched, so the kernel takes another node rather
+ than failing when the node is full, and the policy
+ goes away with the mapping.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "affinity.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+/* Preprocessor Directives */
+#define NODE_DIR		"/sys/devices/system/node"
+#define CPU_MAX			1024		/* most CPUs (bits of a CPU mask) */
+#define NODE_MAX		1024		/* most nodes */
+#define WORD_BITS		(8 * sizeof(unsigned long))
+#define MPOL_PREFERRED	1			/* (from <linux/mempolicy.h>) */
+
+
+/* Global Variables */
+int cpus[CPU_MAX];					/* the CPUs we may run on, ascending */
+int ncpus;
+int node_of[CPU_MAX];				/* node of every CPU */
+int nodes[NODE_MAX] = {0};			/* the online nodes, ascending */
+int nnodes = 1;
+
+
+/* Subroutines */
+static int read_list(char *path, char *member, int max);
+
+
+/**************** Implementation *****************/
+/***          Placement Routines               ***/
+/* Read the CPUs we may run on and the node of each; return their number */
+int affinity_init(void) {
+	unsigned long set[CPU_MAX / WORD_BITS] = {0};
+	static char online[NODE_MAX], on_node[CPU_MAX];
+	char path[MAXLINE];
+
+	if (syscall(SYS_sched_getaffinity, 0, sizeof(set), set) < 0)
+		unix_error("sched_getaffinity error");
+	ncpus = 0;
+	for (int c = 0; c < CPU_MAX; c++)
+		if (set[c / WORD_BITS] >> (c % WORD_BITS) & 1)
+			cpus[ncpus++] = c;
+
+	if (read_list(NODE_DIR "/online", online, NODE_MAX) < 0)
+		return ncpus;							// (no NUMA: node 0)
+	nnodes = 0;
+	for (int n = 0; n < NODE_MAX; n++) {		// "0-1,4": node 2 may not exist
+		if (!online[n])
+			continue;
+		nodes[nnodes++] = n;
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", NODE_DIR, n);
+		memset(on_node, 0, sizeof(on_node));
+		if (read_list(path, on_node, CPU_MAX) == 0)
+			for (int c = 0; c < CPU_MAX; c++)
+				if (on_node[c])
+					node_of[c] = n;
+	}
+	if (nnodes == 0)
+		nnodes = 1;								// (node 0, as if there were none)
+
+	return ncpus;
+}
+
+/* Return the number of CPUs we may run on */
+int affinity_cpus(void) {
+	return ncpus;
+}
+
+/* Return the 'i'-th CPU we may run on (wrapping around) */
+int affinity_cpu(int i) {
+	return cpus[(unsigned)i % ncpus];
+}
+
+/* Return the number of NUMA nodes (1 on a machine without them) */
+int affinity_nodes(void) {
+	return nnodes;
+}
+
+/* Return the number of the 'i'-th node (wrapping around) */
+int affinity_node(int i) {
+	return nodes[(unsigned)i % nnodes];
+}
+
+/* Return the node of 'cpu' */
+int affinity_node_of(int cpu) {
+	return cpu >= 0 && cpu < CPU_MAX ? node_of[cpu] : 0;
+}
+
+/* Pin the calling thread to 'cpu'; -1 if the kernel refuses */
+int affinity_pin(int cpu) {
+	unsigned long set[CPU_MAX / WORD_BITS] = {0};
+
+	if (cpu < 0 || cpu >= CPU_MAX)
+		return -1;
+	set[cpu / WORD_BITS] = 1UL << (cpu % WORD_BITS);
+	return syscall(SYS_sched_setaffinity, syscall(SYS_gettid), sizeof(set), set) < 0 ? -1 : 0;
+}
+
+/* Map 'size' bytes of fresh memory whose pages prefer 'node' (release it
+   with affinity_free) */
+void *affinity_alloc(size_t size, int node) {
+	unsigned long mask[NODE_MAX / WORD_BITS] = {0};
+	void *p;
+
+	if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+			== MAP_FAILED)
+		unix_error("mmap error");
+	if (nnodes > 1 && node >= 0 && node < NODE_MAX) {	// (no page is faulted in yet)
+		mask[node / WORD_BITS] = 1UL << (node % WORD_BITS);
+		syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, NODE_MAX, 0);
+	}
+	return p;
+}
+
+/* Unmap memory of affinity_alloc (its policy goes with it) */
+void affinity_free(void *p, size_t size) {
+	if (p != NULL && munmap(p, size) < 0)
+		unix_error("munmap error");
+}
+/***          Placement Routines End           ***/
+
+
+
+/* Set member[i] for every i below 'max' of a list file ("0-3,8,10-11");
+   -1 if there is no such file */
+static int read_list(char *path, char *member, int max) {
+	char buf[MAXLINE], *p = buf;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL)
+		return -1;
+	if (fgets(buf, sizeof(buf), fp) == NULL)
+		buf[0] = '\0';
+	Fclose(fp);
+
+	while (*p >= '0' && *p <= '9') {
+		int lo = strtol(p, &p, 10), hi = lo;
+
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for (int i = lo; i <= hi && i < max; i++)
+			member[i] = 1;
+		if (*p == ',')
+			p++;
+	}
+	return 0;
+}
+/************** End of the Program ***************/
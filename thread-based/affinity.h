@@ -0,0 +1,27 @@
+/**************************************************
+ * Title: SP-Project 2  -  CPU and Memory Placement
+ * Summary: the CPUs this process may run on and the
+ NUMA nodes they belong to (from sysfs), pinning of
+ threads to CPUs, and memory which prefers a node.
+ Everything degrades to a no-op on a machine with a
+ single node (or where the kernel refuses), so the
+ callers need no special case.
+**************************************************/
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include "csapp.h"
+
+
+/* Placement routines */
+int affinity_init(void);
+int affinity_cpus(void);
+int affinity_cpu(int i);
+int affinity_nodes(void);
+int affinity_node(int i);
+int affinity_node_of(int cpu);
+int affinity_pin(int cpu);
+void *affinity_alloc(size_t size, int node);
+void affinity_free(void *p, size_t size);
+
+#endif /* __AFFINITY_H__ */
@@ -0,0 +1,312 @@
+/**************************************************
+ * Title: SP-Project 2  -  Cluster Benchmark
+ * Summary: starts a cluster of 1 to N stockservers
+ on localhost in a scratch directory, each owning an
+ equal range of IDs of a shard map, with a routing
+ proxy in front of them. Client threads trade at
+ random through the proxy (or route by themselves
+ with '-d') for a while, and a merged 'show' of the
+ cluster is checked; prints the throughput and the
+ time of 'show' for every cluster size.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include "route.h"
+#include <time.h>
+
+
+/* Preprocessor Directives */
+#define CLIENTS		16				/* default number of client threads */
+#define ITEMS		100000			/* default catalog size */
+#define SECONDS		3				/* default length of a run (sec) */
+#define INIT_STOCK	1000000			/* left stock of every item at the start */
+#define READY_WAIT	30				/* longest wait (sec) for a server */
+
+
+/* Types */
+typedef struct {					/* per-client state */
+	pthread_t tid;
+	unsigned long long rng;			// state of xorshift generator
+	long ops;						// number of replies
+	int *cfds;						// connection to every server (direct),
+	rio_t *rios;					// or to the proxy only
+}Client;
+
+
+/* Global Variables */
+char server[MAXLINE], proxy[MAXLINE];	/* absolute paths of the programs */
+ShardMap *map;						/* map of the running cluster */
+char *base_port;					/* port of the proxy */
+int nitems = ITEMS;					/* catalog size */
+int direct = 0;						/* clients route by themselves */
+volatile int stop;					/* end of a run */
+
+
+/* Subroutines */
+pid_t start(char *path, char *dir, char **args);
+void wait_ready(char *port);
+void *client(void *vargp);
+int request(int fd, rio_t *rp, char *cmd, char *reply);
+long show(int *items, int *once);
+double now(void);
+
+
+/**************** Implementation *****************/
+/* Main routine: run the benchmark for every cluster size from 1 to N */
+int main(int argc, char **argv) {
+	char dir[] = "/tmp/clusterbench.XXXXXX", *spath = "./stockserver", *ppath = "./stockproxy";
+	int nclients = CLIENTS, seconds = SECONDS, c, maxshards, failures = 0;
+
+	while ((c = getopt(argc, argv, "n:c:t:ds:p:")) != -1) {
+		switch (c) {
+		case 'n': nitems = atoi(optarg); break;
+		case 'c': nclients = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'd': direct = 1; break;
+		case 's': spath = optarg; break;
+		case 'p': ppath = optarg; break;
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc - 2 || (maxshards = atoi(argv[optind])) < 1) {
+		fprintf(stderr, "usage: %s [-n items] [-c clients] [-t sec] [-d] [-s stockserver] "
+				"[-p stockproxy] <max shards> <base port>\n", argv[0]);
+		exit(0);
+	}
+	base_port = argv[optind + 1];
+	if (realpath(spath, server) == NULL || (!direct && realpath(ppath, proxy) == NULL))
+		unix_error("realpath error");
+	Signal(SIGPIPE, SIG_IGN);				// writes to a killed server fail
+
+	if (mkdtemp(dir) == NULL)
+		unix_error("mkdtemp error");
+	if (chdir(dir) < 0)
+		unix_error("chdir error");
+	printf("scratch directory %s, %d items, %d clients, %s\n%-7s %12s %12s %10s %s\n",
+			dir, nitems, nclients, direct ? "direct" : "through the proxy",
+			"shards", "ops", "ops/sec", "show ms", "merged");
+
+	for (int k = 1; k <= maxshards; k++) {
+		pid_t *pids = Malloc((k + 1) * sizeof(pid_t));
+		char name[MAXLINE], port[NI_MAXSERV];
+		Client *clients;
+		long ops = 0, total;
+		double begin, elapsed, shown;
+		int items, once, ok, status;
+		FILE *fp, *mp = Fopen("cluster.map", "w");
+
+		for (int i = 0; i < k; i++) {		// an equal range of IDs for every server
+			int lo = (long)nitems * i / k + 1, hi = (long)nitems * (i + 1) / k;
+
+			snprintf(port, sizeof(port), "%d", atoi(base_port) + 1 + i);
+			fprintf(mp, "%d %d localhost %s\n", lo, hi, port);
+			snprintf(name, sizeof(name), "shard%d", i);
+			mkdir(name, 0755);
+			snprintf(name, sizeof(name), "shard%d/stock.txt", i);
+			fp = Fopen(name, "w");
+			for (int id = lo; id <= hi; id++)
+				fprintf(fp, "%d %d %d\n", id, INIT_STOCK, id % 1000 + 1);
+			Fclose(fp);
+		}
+		Fclose(mp);
+		map = route_load("cluster.map");
+
+		for (int i = 0; i < k; i++) {
+			char *args[] = { server, "-c", "0", "-M", "../cluster.map", map->ranges[i].port, NULL };
+
+			snprintf(name, sizeof(name), "shard%d", i);
+			pids[i] = start(server, name, args);
+		}
+		for (int i = 0; i < k; i++)
+			wait_ready(map->ranges[i].port);
+		if (!direct) {
+			char *args[] = { proxy, "cluster.map", base_port, NULL };
+
+			pids[k] = start(proxy, ".", args);
+			wait_ready(base_port);
+		}
+
+		stop = 0;
+		clients = Calloc(nclients, sizeof(Client));
+		begin = now();
+		for (int i = 0; i < nclients; i++) {
+			clients[i].rng = 0x9E3779B97F4A7C15ULL * (k * nclients + i + 1);
+			Pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+		}
+		sleep(seconds);
+		stop = 1;
+		for (int i = 0; i < nclients; i++) {
+			Pthread_join(clients[i].tid, NULL);
+			ops += clients[i].ops;
+		}
+		elapsed = now() - begin;
+		Free(clients);
+
+		shown = now();
+		total = show(&items, &once);		// every item of every range once
+		shown = (now() - shown) * 1e3;
+		ok = items == nitems && once && total > 0;
+		failures += !ok;
+		printf("%-7d %12ld %12.0f %10.1f %s\n", k, ops, ops / elapsed, shown,
+				ok ? "ok" : "WRONG");
+		if (!ok)
+			printf("        expected %d items once each, got %d items%s\n", nitems, items,
+					once ? "" : " with repeats");
+
+		for (int i = 0; i < k + !direct; i++) {
+			kill(pids[i], SIGKILL);
+			waitpid(pids[i], &status, 0);
+		}
+		for (int i = 0; i < k; i++) {
+			char *files[] = { "stock.txt", "stock.snap", "stock.wal", "stock.wal.old",
+					"server.log" };
+
+			for (int f = 0; f < 5; f++) {
+				snprintf(name, sizeof(name), "shard%d/%s", i, files[f]);
+				if (ok)
+					unlink(name);
+			}
+			snprintf(name, sizeof(name), "shard%d", i);
+			rmdir(name);
+		}
+		route_free(map);
+		Free(pids);
+	}
+
+	if (failures == 0) {					// keep the files of a failure
+		unlink("cluster.map");
+		unlink("server.log");
+		chdir("/");
+		rmdir(dir);
+	}
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	exit(failures ? 1 : 0);
+}
+
+/* Start a program in directory 'dir' with its output to 'server.log' there */
+pid_t start(char *path, char *dir, char **args) {
+	pid_t pid;
+	int fd;
+
+	if ((pid = Fork()) == 0) {
+		if (chdir(dir) < 0)
+			unix_error("chdir error");
+		fd = Open("server.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+		Dup2(fd, STDOUT_FILENO);
+		Dup2(fd, STDERR_FILENO);
+		execv(path, args);
+		unix_error("execv error");
+	}
+	return pid;
+}
+
+/* Wait until the server at 'port' accepts connections */
+void wait_ready(char *port) {
+	double begin = now();
+	int fd;
+
+	while ((fd = open_clientfd("localhost", port)) < 0) {
+		if (now() - begin > READY_WAIT)
+			app_error("a server did not come up");
+		usleep(1000);
+	}
+	Close(fd);
+}
+
+/* Thread routine of the clients: random buy/sell until the end of the run */
+void *client(void *vargp) {
+	Client *c = vargp;
+	int n = direct ? map->n : 1;
+	char cmd[64], reply[MAXLINE];
+
+	c->cfds = Malloc(n * sizeof(int));
+	c->rios = Malloc(n * sizeof(rio_t));
+	for (int i = 0; i < n; i++) {				// to every server, or to the proxy
+		c->cfds[i] = Open_clientfd("localhost", direct ? map->ranges[i].port : base_port);
+		Rio_readinitb(&c->rios[i], c->cfds[i]);
+	}
+
+	while (!stop) {
+		unsigned long long x = c->rng;
+		int id, amount, sell, i;
+
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;	// xorshift64
+		c->rng = x;
+		id = (int)(x % nitems) + 1;
+		amount = (int)((x >> 32) % 10) + 1;
+		sell = (x >> 48) & 1;
+		snprintf(cmd, sizeof(cmd), "%s %d %d\n", sell ? "sell" : "buy", id, amount);
+
+		i = direct ? route_find(map, id) : 0;
+		if (request(c->cfds[i], &c->rios[i], cmd, reply) < 0)
+			break;
+		c->ops++;
+	}
+
+	for (int i = 0; i < n; i++)
+		Close(c->cfds[i]);
+	Free(c->cfds);
+	Free(c->rios);
+	return NULL;
+}
+
+/* Send a command and read its one-frame reply; -1 if the server is gone */
+int request(int fd, rio_t *rp, char *cmd, char *reply) {
+	if (rio_writen(fd, cmd, strlen(cmd)) < 0)
+		return -1;
+	if (rio_readnb(rp, reply, MAXLINE) != MAXLINE)
+		return -1;
+	return 0;
+}
+
+/* Return the sum of left stock of the cluster by a merged 'show' (of the
+   proxy, or of every server in the order of their ranges) */
+long show(int *items, int *once) {
+	char reply[MAXLINE], line[64], *seen = Calloc(nitems + 1, 1);
+	long total = 0;
+	size_t len = 0;
+
+	*items = 0;
+	*once = 1;
+	for (int i = 0; i < (direct ? map->n : 1); i++) {
+		int fd = Open_clientfd("localhost", direct ? map->ranges[i].port : base_port);
+		rio_t rio;
+
+		Rio_readinitb(&rio, fd);
+		Rio_writen(fd, "show\n", 5);
+		do {
+			Rio_readnb(&rio, reply, MAXLINE);	// a line may cross frames
+			for (size_t j = 0; j < MAXLINE && reply[j]; j++) {
+				int id;
+
+				if (reply[j] != '\n') {
+					if (len < sizeof(line) - 1)
+						line[len++] = reply[j];
+					continue;
+				}
+				line[len] = '\0';
+				len = 0;
+				id = atoi(line);
+				if (id < 1 || id > nitems || seen[id]++)
+					*once = 0;
+				total += strtol(strchr(line, ' ') + 1, NULL, 10);
+				(*items)++;
+			}
+		} while (reply[MAXLINE - 1] != '\0');
+		Close(fd);
+	}
+	Free(seen);
+
+	return total;
+}
+
+/* Return the monotonic time in seconds */
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/************** End of the Program ***************/
@@ -0,0 +1,167 @@
+/**************************************************
+ * Title: SP-Project 2  -  Stackless Coroutines
+ * Summary: implementation of 'coro.h'. The epoll
+ data of a descriptor points at its coroutine (the
+ eventfd has none). An event resumes a coroutine
+ only if it waits for it (or on an error or hang-
+ up); since the descriptors are edge-triggered and
+ a coroutine drains its descriptor before waiting,
+ an event it ignores is never lost. Before a loop
+ sleeps it sets 'idle', then looks at its inbox
+ and its own work once more; a notifier queues its
+ work first and then reads 'idle', so either the
+ loop finds the work or the notifier wakes it.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "coro.h"
+#include <sys/eventfd.h>
+
+
+/* Preprocessor Directives */
+#define CO_EVENTS		256			/* most readiness events taken at once */
+#define CO_BATCH		64			/* most descriptors taken from the inbox at once */
+
+
+/* Subroutines */
+static int take_inbox(CoLoop *loop);
+static int run_later(CoLoop *loop);
+
+
+/**************** Implementation *****************/
+/***          Coroutine Routines               ***/
+/* Create an empty loop: 'open' makes a coroutine of every descriptor in
+   the inbox, 'close' frees a coroutine once it has ended */
+void co_loop_init(CoLoop *loop, void (*open)(CoLoop *, int), void (*close)(Coro *)) {
+	struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+
+	memset(loop, 0, sizeof(CoLoop));
+	loop->open = open;
+	loop->close = close;
+	ring_init(&loop->inbox, CO_INBOX);
+	if ((loop->epfd = epoll_create1(0)) < 0)
+		unix_error("epoll_create1 error");
+	if ((loop->wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+		unix_error("eventfd error");
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0)
+		unix_error("epoll_ctl error");
+}
+
+/* Start coroutine 'fn' on descriptor 'fd' (called by the thread of 'loop');
+   it runs until it first waits */
+void co_start(CoLoop *loop, Coro *co, int fd, coro_fn fn) {
+	struct epoll_event ev = { EPOLLIN | EPOLLOUT | EPOLLET, { .ptr = co } };
+
+	co->line = 0;
+	co->fd = fd;
+	co->waits = 0;
+	co->fn = fn;
+	co->loop = loop;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		unix_error("epoll_ctl error");
+	__atomic_store_n(&loop->live, loop->live + 1, __ATOMIC_RELAXED);
+	co_resume(co);
+}
+
+/* Hand descriptor 'fd' to 'loop' (from any thread) */
+void co_submit(CoLoop *loop, int fd) {
+	ring_insert(&loop->inbox, fd);
+	co_notify(loop);
+}
+
+/* Wake 'loop' if it sleeps, after work for it has been queued (from any
+   thread) */
+void co_notify(CoLoop *loop) {
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&loop->idle, __ATOMIC_SEQ_CST))
+		return;									// it looks once more anyway
+	if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		unix_error("eventfd write error");		// (EAGAIN: it is signaled anyway)
+}
+
+/* Run a coroutine until it waits again, free it if it has ended (called
+   by the thread of its loop) */
+void co_resume(Coro *co) {
+	CoLoop *loop = co->loop;
+
+	__atomic_store_n(&loop->resumed, loop->resumed + 1, __ATOMIC_RELAXED);
+	if (co->fn(co) == CO_DONE) {
+		__atomic_store_n(&loop->live, loop->live - 1, __ATOMIC_RELAXED);
+		loop->close(co);						// (closing leaves the epoll set)
+	}
+}
+
+/* Resume a coroutine on the next turn of its loop (see CO_YIELD) */
+void co_later(Coro *co) {
+	co->next = co->loop->later;
+	co->loop->later = co;
+}
+
+/* Run the loop (never returns): resume every coroutine whose descriptor is
+   ready for what it waits for */
+void co_run(CoLoop *loop) {
+	struct epoll_event events[CO_EVENTS];
+
+	while (1) {
+		int n, found;
+
+		__atomic_store_n(&loop->idle, 1, __ATOMIC_SEQ_CST);
+		found = take_inbox(loop) + run_later(loop);		// (a notify sees 'idle' now)
+		if (loop->poll)
+			found += loop->poll(loop);
+		n = epoll_wait(loop->epfd, events, CO_EVENTS, found ? 0 : -1);
+		__atomic_store_n(&loop->idle, 0, __ATOMIC_RELAXED);
+
+		if (n < 0 && errno != EINTR)
+			unix_error("epoll_wait error");
+		for (int i = 0; i < n; i++) {
+			Coro *co = events[i].data.ptr;
+			uint64_t count;
+
+			if (co == NULL) {					// woken: the work is taken above
+				if (read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					unix_error("eventfd read error");
+			}
+			else if (co->waits && (events[i].events & (co->waits | EPOLLERR | EPOLLHUP)))
+				co_resume(co);
+		}
+	}
+}
+/***          Coroutine Routines End           ***/
+
+
+
+/***        Subroutines for the Loop           ***/
+/* Make a coroutine of every descriptor in the inbox; return how many */
+static int take_inbox(CoLoop *loop) {
+	int fds[CO_BATCH], n, total = 0;
+	double stamps[CO_BATCH];
+
+	while ((n = ring_remove_batch(&loop->inbox, fds, stamps, CO_BATCH, 0)) > 0) {
+		for (int i = 0; i < n; i++)
+			loop->open(loop, fds[i]);
+		total += n;
+	}
+	return total;
+}
+
+/* Resume the coroutines which yielded on the last turn; return how many */
+static int run_later(CoLoop *loop) {
+	Coro *co = loop->later;
+	int n = 0;
+
+	loop->later = NULL;							// (they may yield again)
+	while (co) {
+		Coro *next = co->next;
+
+		co_resume(co);
+		co = next;
+		n++;
+	}
+	return n;
+}
+/***      Subroutines for the Loop End         ***/
+/************** End of the Program ***************/
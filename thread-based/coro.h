@@ -0,0 +1,80 @@
+/**************************************************
+ * Title: SP-Project 2  -  Stackless Coroutines
+ * Summary: coroutines over an epoll loop, written
+ as straight-line code. CO_WAIT suspends one until
+ its descriptor is ready: it records where to go
+ on and returns, and the next resume jumps back in
+ through the 'switch' of CO_BEGIN (Duff's device).
+ There is no stack to keep, so a coroutine costs
+ its own struct, and whatever must survive a wait
+ lives there instead of in local variables (and no
+ CO_WAIT may sit inside another 'switch').
+ A descriptor is registered once, edge-triggered,
+ so a coroutine waits only after read or write
+ has said EAGAIN. A coroutine may also wait for
+ nothing and be resumed by the code of its loop
+ (co_resume), or yield until the next turn of the
+ loop. Other threads hand descriptors to a loop
+ through its inbox, and wake it by an eventfd
+ only while it sleeps.
+**************************************************/
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include "csapp.h"
+#include "ring.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+
+
+/* Preprocessor Directives */
+#define CO_WAITING		0			/* the coroutine waits (descriptor or resume) */
+#define CO_DONE			1			/* the coroutine has ended */
+#define CO_INBOX		1024		/* descriptors queued for a loop */
+
+#define CO_BEGIN(co)	switch ((co)->line) { case 0:
+#define CO_WAIT(co, ev)	do { (co)->line = __LINE__; (co)->waits = (ev); return CO_WAITING;	\
+							case __LINE__:; } while (0)
+#define CO_YIELD(co)	do { co_later(co); CO_WAIT(co, 0); } while (0)
+#define CO_END(co)		} return CO_DONE
+
+
+/* Types */
+typedef struct coro Coro;
+typedef struct co_loop CoLoop;
+typedef int (*coro_fn)(Coro *co);	/* runs a coroutine until it waits or ends */
+
+struct coro {						/* state of a coroutine (heads a larger struct) */
+	int line;						// where it goes on (0: at the start)
+	int fd;							// descriptor it does I/O on
+	uint32_t waits;					// events it waits for
+	coro_fn fn;
+	CoLoop *loop;
+	struct coro *next;				// link of the coroutines yielding this turn
+};
+
+struct co_loop {					/* one event loop, run by one thread */
+	int epfd;
+	int wakefd;						// eventfd: the inbox has descriptors
+	Ring inbox;						// descriptors handed over by other threads
+	void (*open)(CoLoop *loop, int fd);	// makes a coroutine of a new descriptor
+	void (*close)(Coro *co);		// frees an ended coroutine
+	int (*poll)(CoLoop *loop);		// work of the loop's own (if any) before it
+									// sleeps, returns how much it found
+	Coro *later;					// coroutines resumed on the next turn
+	int idle;						// sleeps (or is about to) in epoll_wait
+	long resumed;					// resumes so far
+	int live;						// coroutines alive
+};
+
+
+/* Coroutine routines */
+void co_loop_init(CoLoop *loop, void (*open)(CoLoop *, int), void (*close)(Coro *));
+void co_start(CoLoop *loop, Coro *co, int fd, coro_fn fn);
+void co_submit(CoLoop *loop, int fd);
+void co_notify(CoLoop *loop);
+void co_resume(Coro *co);
+void co_later(Coro *co);
+void co_run(CoLoop *loop);
+
+#endif /* __CORO_H__ */
@@ -0,0 +1,295 @@
+/**************************************************
+ * Title: SP-Project 2  -  Crash Recovery Harness
+ * Summary: runs 'stockserver' in strict mode with
+ frequent checkpoints in a scratch directory, trades
+ against it from client threads, and kills it with
+ SIGKILL in the middle of the load. After every
+ restart the recovered total of left stock must be
+ the total before plus every acknowledged trade (a
+ trade without a reply may or may not be there).
+ Some clients buy and sell only one hot item, whose
+ stock stays low, so a buy often needs the sell
+ just before it: the item must be recovered as
+ well, and no logged change may fail on replay.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include <time.h>
+
+
+/* Preprocessor Directives */
+#define ROUNDS		5				/* default number of kills */
+#define CLIENTS		8				/* default number of client threads */
+#define HOT_CLIENTS	4				/* default number of clients of the hot item */
+#define HOT_ID		1				/* the hot item */
+#define HOT_STOCK	20				/* its left stock at the start */
+#define ITEMS		10000			/* default catalog size */
+#define INIT_STOCK	1000000			/* left stock of every item at the start */
+#define READY_WAIT	30				/* longest wait (sec) for a restarted server */
+
+
+/* Types */
+typedef struct {					/* per-client state */
+	pthread_t tid;
+	unsigned long long rng;			// state of xorshift generator
+	long acked;						// net change of the acknowledged trades
+	long trades;					// number of acknowledged trades
+	int pending;					// change of the trade without a reply (if any)
+	int hot;						// trades only the hot item
+}Client;
+
+
+/* Global Variables */
+char *port;							/* port of the server */
+char server[MAXLINE];				/* absolute path of 'stockserver' */
+int nitems = ITEMS;					/* catalog size */
+
+
+/* Subroutines */
+pid_t start_server(double *ready);
+long long total_stock(int *items, long long *hot);
+int replay_failed(void);
+void *client(void *vargp);
+int request(int fd, rio_t *rp, char *cmd, char *reply);
+double now(void);
+
+
+/**************** Implementation *****************/
+/* Main routine: kill the server 'rounds' times and check every recovery */
+int main(int argc, char **argv) {
+	char dir[] = "/tmp/crashtest.XXXXXX", *path = "./stockserver";
+	int rounds = ROUNDS, nclients = CLIENTS, nhot = HOT_CLIENTS, c, failures = 0;
+	long long lo, hi, hot_lo, hot_hi;
+	long trades = 0;
+	FILE *fp;
+
+	while ((c = getopt(argc, argv, "r:c:h:n:s:")) != -1) {
+		switch (c) {
+		case 'r': rounds = atoi(optarg); break;
+		case 'c': nclients = atoi(optarg); break;
+		case 'h': nhot = atoi(optarg); break;
+		case 'n': nitems = atoi(optarg); break;
+		case 's': path = optarg; break;
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc - 1 || nitems < 2) {
+		fprintf(stderr, "usage: %s [-r rounds] [-c clients] [-h hot clients] [-n items (2+)] "
+				"[-s stockserver] <port>\n", argv[0]);
+		exit(0);
+	}
+	port = argv[optind];
+	if (realpath(path, server) == NULL)
+		unix_error("realpath error");
+	Signal(SIGPIPE, SIG_IGN);				// writes to a killed server fail
+
+	if (mkdtemp(dir) == NULL)
+		unix_error("mkdtemp error");
+	if (chdir(dir) < 0)
+		unix_error("chdir error");
+	fp = Fopen("stock.txt", "w");
+	for (int id = 1; id <= nitems; id++)
+		fprintf(fp, "%d %d %d\n", id, id == HOT_ID ? HOT_STOCK : INIT_STOCK, id % 1000 + 1);
+	Fclose(fp);
+	lo = hi = (long long)(nitems - 1) * INIT_STOCK + HOT_STOCK;
+	hot_lo = hot_hi = HOT_STOCK;
+	srand(getpid());
+	printf("scratch directory %s\n%-6s %10s %12s %16s %8s %s\n", dir, "round", "trades",
+			"ready ms", "total", "hot", "recovered");
+
+	for (int r = 0; ; r++) {
+		Client *clients;
+		long long total, hot;
+		double ready;
+		int items, status, ok, failed;
+		pid_t pid = start_server(&ready);
+
+		total = total_stock(&items, &hot);	// what the server recovered
+		failed = replay_failed();
+		ok = total >= lo && total <= hi && items == nitems && hot >= hot_lo && hot <= hot_hi
+				&& failed == 0;
+		failures += !ok;
+		printf("%-6d %10ld %12.1f %16lld %8lld %s\n", r, trades, ready, total, hot,
+				ok ? "ok" : "LOST");
+		if (!ok)
+			printf("       expected %lld..%lld (hot %lld..%lld) and %d items, got %d items"
+					" and %d failed changes\n", lo, hi, hot_lo, hot_hi, nitems, items, failed);
+		if (r == rounds) {
+			kill(pid, SIGINT);				// clean shutdown at last
+			waitpid(pid, &status, 0);
+			break;
+		}
+
+		clients = Calloc(nclients + nhot, sizeof(Client));
+		for (int i = 0; i < nclients + nhot; i++) {
+			clients[i].rng = 0x9E3779B97F4A7C15ULL * (r * (nclients + nhot) + i + 1);
+			clients[i].hot = (i >= nclients);
+			Pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+		}
+		usleep(500000 + rand() % 2000000);	// kill in the middle of the load
+											// (and of checkpoints, now and then)
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+
+		lo = hi = total;
+		hot_lo = hot_hi = hot;
+		trades = 0;
+		for (int i = 0; i < nclients + nhot; i++) {
+			long long *l = clients[i].hot ? &hot_lo : &lo, *h = clients[i].hot ? &hot_hi : &hi;
+
+			Pthread_join(clients[i].tid, NULL);
+			*l += clients[i].acked;
+			*h += clients[i].acked;
+			trades += clients[i].trades;
+			if (clients[i].pending < 0)		// a trade without a reply
+				*l += clients[i].pending;
+			else
+				*h += clients[i].pending;
+		}
+		lo += hot_lo - hot;					// (the total holds the hot item too)
+		hi += hot_hi - hot;
+		Free(clients);
+	}
+
+	if (failures == 0) {					// keep the files of a failure
+		unlink("stock.txt");
+		unlink("stock.snap");
+		unlink("stock.wal");
+		unlink("stock.wal.old");
+		unlink("server.log");
+		chdir("/");
+		rmdir(dir);
+	}
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	exit(failures ? 1 : 0);
+}
+
+/* Start the server (strict acks, a checkpoint every second) and wait until
+   it accepts connections; 'ready' is the time of recovery in ms */
+pid_t start_server(double *ready) {
+	double start = now();
+	pid_t pid;
+	int fd;
+
+	if ((pid = Fork()) == 0) {
+		fd = Open("server.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+		Dup2(fd, STDOUT_FILENO);
+		Dup2(fd, STDERR_FILENO);
+		execl(server, server, "-S", "-c", "1", port, (char *)NULL);
+		unix_error("execl error");
+	}
+
+	while ((fd = open_clientfd("localhost", port)) < 0) {
+		if (now() - start > READY_WAIT)
+			app_error("the server did not come back");
+		usleep(1000);
+	}
+	*ready = (now() - start) * 1e3;
+	Close(fd);
+
+	return pid;
+}
+
+/* Return the sum of left stock of every item, by 'show' (and that of the
+   hot item in 'hot') */
+long long total_stock(int *items, long long *hot) {
+	char reply[MAXLINE], line[64];
+	long long total = 0;
+	size_t len = 0;
+	int fd = Open_clientfd("localhost", port);
+	rio_t rio;
+
+	*items = 0;
+	*hot = -1;
+	Rio_readinitb(&rio, fd);
+	Rio_writen(fd, "show\n", 5);
+	do {
+		Rio_readnb(&rio, reply, MAXLINE);	// a line may cross frames
+		for (size_t i = 0; i < MAXLINE && reply[i]; i++) {
+			if (reply[i] != '\n') {
+				if (len < sizeof(line) - 1)
+					line[len++] = reply[i];
+				continue;
+			}
+			line[len] = '\0';
+			len = 0;
+			total += strtol(strchr(line, ' ') + 1, NULL, 10);
+			if (atoi(line) == HOT_ID)
+				*hot = strtol(strchr(line, ' ') + 1, NULL, 10);
+			(*items)++;
+		}
+	} while (reply[MAXLINE - 1] != '\0');
+	Close(fd);
+
+	return total;
+}
+
+/* Thread routine of the clients: random buy/sell until the server dies */
+void *client(void *vargp) {
+	Client *c = vargp;
+	char cmd[64], reply[MAXLINE];
+	int fd = open_clientfd("localhost", port);
+	rio_t rio;
+
+	if (fd < 0)
+		return NULL;
+	Rio_readinitb(&rio, fd);
+	while (1) {
+		unsigned long long x = c->rng;
+		int id, amount, sell;
+
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;	// xorshift64
+		c->rng = x;
+		id = c->hot ? HOT_ID : (int)(x % (nitems - 1)) + 2;
+		amount = (int)((x >> 32) % 10) + 1;
+		sell = c->hot ? (x >> 48) % 3 == 0 : (x >> 48) & 1;	// (buys keep it drained)
+		snprintf(cmd, sizeof(cmd), "%s %d %d\n", sell ? "sell" : "buy", id, amount);
+
+		c->pending = sell ? amount : -amount;	// unknown until the reply
+		if (request(fd, &rio, cmd, reply) < 0)
+			break;
+		c->pending = 0;
+		if (!strncmp(reply, "[buy] success", 13) || !strncmp(reply, "[sell] success", 14)) {
+			c->acked += sell ? amount : -amount;
+			c->trades++;
+		}
+	}
+	close(fd);
+
+	return NULL;
+}
+
+/* Return the number of logged changes which failed in the last recovery,
+   from the report of the server */
+int replay_failed(void) {
+	char line[MAXLINE], *p;
+	int failed = 0;
+	FILE *fp = Fopen("server.log", "r");
+
+	while (fgets(line, sizeof(line), fp))
+		if (!strncmp(line, "Recovered ", 10) && (p = strstr(line, "changes (")))
+			failed = atoi(p + 9);
+	Fclose(fp);
+
+	return failed;
+}
+
+/* Send a command and read its one-frame reply; -1 if the server is gone */
+int request(int fd, rio_t *rp, char *cmd, char *reply) {
+	if (rio_writen(fd, cmd, strlen(cmd)) < 0)
+		return -1;
+	if (rio_readnb(rp, reply, MAXLINE) != MAXLINE)
+		return -1;
+	return 0;
+}
+
+/* Return the monotonic time in seconds */
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/************** End of the Program ***************/
@@ -0,0 +1,322 @@
+/**************************************************
+ * Title: SP-Project 2  -  Mixed Load Benchmark
+ * Summary: starts 'stockserver' in a scratch
+ directory, with the adaptive worker pool (a thread
+ per connection) and with its trades applied by a
+ single sequencer thread ('-Q'), with work-stealing
+ workers ('-W') and with coroutines on event loops
+ ('-C'), then the event-based server (also with the
+ trades of a round batched by item, '-B', and with
+ 'show' formatted by helper threads, '-H'), and drives
+ each from client threads with a mix of 'show' and
+ buy/sell on persistent connections. Prints the
+ throughput and the latency percentiles of trades
+ and of 'show' for every design, and with '-A' also
+ for the thread-based ones with pinned threads and
+ items on the node of their shard. With '-P' it adds
+ the shared-nothing mode at 1, 2, 4, ... cores up to
+ every core, which shows how it scales.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include <time.h>
+
+
+/* Preprocessor Directives */
+#define CLIENTS		64				/* default number of client threads */
+#define ITEMS		10000			/* default catalog size */
+#define SECONDS		5				/* default length of a run (sec) */
+#define SHOW_PCT	1.0				/* default share (%) of 'show' requests */
+#define WORKERS		4				/* default work-stealing workers */
+#define LOOPS		2				/* default event loops of coroutines */
+#define SAMPLES		(1 << 16)		/* most latencies kept per client and type */
+#define READY_WAIT	30				/* longest wait (sec) for the server */
+
+
+/* Types */
+typedef struct {					/* per-client state */
+	pthread_t tid;
+	unsigned long long rng;			// state of xorshift generator
+	double *trade, *show;			// latencies (sec)
+	long ntrade, nshow;
+	int failed;						// the server went away
+}Client;
+
+
+/* Global Variables */
+char server[MAXLINE];				/* absolute path of 'stockserver' */
+char event[MAXLINE];				/* and of the event-based one ("": none) */
+char *port;							/* port of the server */
+int nitems = ITEMS;					/* catalog size */
+double show_pct = SHOW_PCT;			/* share (%) of 'show' */
+int pinned;							/* the server pins its threads (-A) */
+volatile int stop;					/* end of a run */
+
+
+/* Subroutines */
+int run(char *name, char *path, char *opt, char *arg, int nclients, int seconds);
+pid_t start_server(char *path, char *opt, char *arg);
+void *client(void *vargp);
+int request(int fd, rio_t *rp, char *cmd);
+double percentile(double *v, long n, double p);
+int cmp_double(const void *a, const void *b);
+double now(void);
+
+
+/**************** Implementation *****************/
+/* Main routine: run the load against every design */
+int main(int argc, char **argv) {
+	char dir[] = "/tmp/loadbench.XXXXXX", *path = "./stockserver", steal[32], coro[32];
+	char *event_path = "../event-based/stockserver";
+	int nclients = CLIENTS, seconds = SECONDS, workers = WORKERS, loops = LOOPS, c;
+	int failures = 0, place = 0, scale = 0;
+	FILE *fp;
+
+	while ((c = getopt(argc, argv, "c:t:n:p:W:C:s:e:AP")) != -1) {
+		switch (c) {
+		case 'c': nclients = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'n': nitems = atoi(optarg); break;
+		case 'p': show_pct = atof(optarg); break;
+		case 'W': workers = atoi(optarg); break;
+		case 'C': loops = atoi(optarg); break;
+		case 's': path = optarg; break;
+		case 'e': event_path = optarg; break;
+		case 'A': place = 1; break;
+		case 'P': scale = 1; break;
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-c clients] [-t sec] [-n items] [-p show %%] [-W workers] "
+				"[-C loops] [-s stockserver] [-e event-based stockserver] [-A] [-P] <port>\n", argv[0]);
+		exit(0);
+	}
+	port = argv[optind];
+	if (realpath(path, server) == NULL)
+		unix_error("realpath error");
+	if (realpath(event_path, event) == NULL || access(event, X_OK) < 0)
+		event[0] = '\0';						// (not built: skipped)
+	Signal(SIGPIPE, SIG_IGN);
+
+	if (mkdtemp(dir) == NULL)
+		unix_error("mkdtemp error");
+	if (chdir(dir) < 0)
+		unix_error("chdir error");
+	printf("%d clients, %d items, %.1f%% show, %d s per run, latency in ms\n", nclients, nitems,
+			show_pct, seconds);
+	printf("%-22s %10s %9s %9s %9s %9s %9s\n", "design", "req/sec", "trade p50", "p99",
+			"p99.9", "show p50", "p99");
+
+	fp = Fopen("stock.txt", "w");
+	for (int id = 1; id <= nitems; id++)
+		fprintf(fp, "%d %d %d\n", id, 1000000, id % 1000 + 1);
+	Fclose(fp);
+	snprintf(steal, sizeof(steal), "%d", workers);
+	snprintf(coro, sizeof(coro), "%d", loops);
+	for (pinned = 0; pinned <= place; pinned++) {	// unpinned, then pinned
+		failures += run(pinned ? "pool, pinned" : "pool (thread/conn)", server, NULL, NULL,
+				nclients, seconds);
+		failures += run(pinned ? "pool + sequencer, pinned" : "pool + sequencer", server, "-Q",
+				NULL, nclients, seconds);
+		failures += run(pinned ? "work stealing, pinned" : "work stealing", server, "-W", steal,
+				nclients, seconds);
+		failures += run(pinned ? "coroutines, pinned" : "coroutines", server, "-C", coro,
+				nclients, seconds);
+	}
+	pinned = place;
+	for (int cores = 1, all = sysconf(_SC_NPROCESSORS_ONLN); scale && cores <= all;
+			cores = cores < all && 2 * cores > all ? all : 2 * cores) {	// (last: all)
+		char name[32], arg[16];
+
+		snprintf(name, sizeof(name), "shared-nothing, %d core%s", cores, cores > 1 ? "s" : "");
+		snprintf(arg, sizeof(arg), "%d", cores);
+		failures += run(name, server, "-P", arg, nclients, seconds);
+	}
+	pinned = 0;
+	if (event[0]) {
+		failures += run("event-based (select)", event, NULL, NULL, nclients, seconds);
+		failures += run("event-based, batched", event, "-B", NULL, nclients, seconds);
+		failures += run("event-based, helpers", event, "-H", "2", nclients, seconds);
+	}
+
+	unlink("stock.txt");
+	unlink("stock.snap");
+	unlink("stock.wal");
+	unlink("stock.wal.old");
+	unlink("stock.sock");
+	if (failures == 0)
+		unlink("server.log");
+	chdir("/");
+	rmdir(dir);
+	exit(failures ? 1 : 0);
+}
+
+/* Run the load against server 'path' with option 'opt' and its 'arg' (if
+   any); 1 if the server failed */
+int run(char *name, char *path, char *opt, char *arg, int nclients, int seconds) {
+	Client *clients = Calloc(nclients, sizeof(Client));
+	double begin, elapsed, *trade, *show;
+	long ntrade = 0, nshow = 0;
+	int status, failed = 0;
+	pid_t pid = start_server(path, opt, arg);
+
+	stop = 0;
+	begin = now();
+	for (int i = 0; i < nclients; i++) {
+		clients[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		clients[i].trade = Malloc(SAMPLES * sizeof(double));
+		clients[i].show = Malloc(SAMPLES * sizeof(double));
+		Pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (int i = 0; i < nclients; i++) {
+		Pthread_join(clients[i].tid, NULL);
+		ntrade += clients[i].ntrade;
+		nshow += clients[i].nshow;
+		failed |= clients[i].failed;
+	}
+	elapsed = now() - begin;
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	unlink("stock.wal");					// the next run starts from 'stock.txt'
+
+	trade = Malloc((ntrade + 1) * sizeof(double));	// every sample of every client
+	show = Malloc((nshow + 1) * sizeof(double));
+	ntrade = nshow = 0;
+	for (int i = 0; i < nclients; i++) {
+		memcpy(trade + ntrade, clients[i].trade, clients[i].ntrade * sizeof(double));
+		memcpy(show + nshow, clients[i].show, clients[i].nshow * sizeof(double));
+		ntrade += clients[i].ntrade;
+		nshow += clients[i].nshow;
+		Free(clients[i].trade);
+		Free(clients[i].show);
+	}
+	qsort(trade, ntrade, sizeof(double), cmp_double);
+	qsort(show, nshow, sizeof(double), cmp_double);
+	printf("%-22s %10.0f %9.3f %9.3f %9.3f %9.3f %9.3f%s\n", name, (ntrade + nshow) / elapsed,
+			percentile(trade, ntrade, 0.5), percentile(trade, ntrade, 0.99),
+			percentile(trade, ntrade, 0.999), percentile(show, nshow, 0.5),
+			percentile(show, nshow, 0.99), failed ? "  (server failed)" : "");
+
+	Free(trade);
+	Free(show);
+	Free(clients);
+	return failed;
+}
+
+/* Start a server (the thread-based one without checkpoints and pinned if
+   so) and wait until it accepts */
+pid_t start_server(char *path, char *opt, char *arg) {
+	double begin = now();
+	char *args[8];
+	pid_t pid;
+	int fd, n = 0;
+
+	args[n++] = path;
+	if (path == server) {
+		args[n++] = "-c";
+		args[n++] = "0";
+	}
+	if (opt)
+		args[n++] = opt;
+	if (arg)
+		args[n++] = arg;
+	if (pinned)
+		args[n++] = "-A";
+	args[n++] = port;
+	args[n] = NULL;
+	if ((pid = Fork()) == 0) {
+		fd = Open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		Dup2(fd, STDOUT_FILENO);
+		Dup2(fd, STDERR_FILENO);
+		execv(path, args);
+		unix_error("execv error");
+	}
+
+	while ((fd = open_clientfd("localhost", port)) < 0) {
+		if (now() - begin > READY_WAIT)
+			app_error("the server did not come up");
+		usleep(1000);
+	}
+	Close(fd);
+	return pid;
+}
+
+/* Thread routine of the clients: the mix of requests until the end */
+void *client(void *vargp) {
+	Client *c = vargp;
+	char cmd[64];
+	int fd = open_clientfd("localhost", port);
+	rio_t rio;
+
+	if (fd < 0) {
+		c->failed = 1;
+		return NULL;
+	}
+	Rio_readinitb(&rio, fd);
+	while (!stop) {
+		unsigned long long x = c->rng;
+		int is_show;
+		double t;
+
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;	// xorshift64
+		c->rng = x;
+		if ((is_show = (x % 100000) < show_pct * 1000))
+			strcpy(cmd, "show\n");
+		else
+			snprintf(cmd, sizeof(cmd), "%s %d %d\n", (x >> 48) & 1 ? "sell" : "buy",
+					(int)((x >> 16) % nitems) + 1, (int)((x >> 32) % 10) + 1);
+
+		t = now();
+		if (request(fd, &rio, cmd) < 0) {
+			c->failed = 1;
+			break;
+		}
+		t = now() - t;
+		if (is_show && c->nshow < SAMPLES)
+			c->show[c->nshow++] = t;
+		else if (!is_show && c->ntrade < SAMPLES)
+			c->trade[c->ntrade++] = t;
+	}
+	Close(fd);
+
+	return NULL;
+}
+
+/* Send a command and read its whole reply; -1 if the server is gone */
+int request(int fd, rio_t *rp, char *cmd) {
+	char reply[MAXLINE];
+
+	if (rio_writen(fd, cmd, strlen(cmd)) < 0)
+		return -1;
+	do {
+		if (rio_readnb(rp, reply, MAXLINE) != MAXLINE)
+			return -1;
+	} while (reply[MAXLINE - 1] != '\0');		// a full frame is continued
+	return 0;
+}
+
+/* Return the 'p' percentile of sorted 'v' in msec */
+double percentile(double *v, long n, double p) {
+	return n ? v[(long)(n * p)] * 1e3 : 0;
+}
+
+/* Comparison function of doubles for qsort */
+int cmp_double(const void *a, const void *b) {
+	double x = *(double *)a, y = *(double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Return the monotonic time in seconds */
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/************** End of the Program ***************/
@@ -0,0 +1,104 @@
+/**************************************************
+ * Title: SP-Project 2  -  Log Decoder
+ * Summary: prints the binary log of a server
+ ('stock.log' of either server, see 'logger.h') as
+ text, one line per record in time order (the
+ flusher writes the rings of the threads one after
+ another), optionally only from a level up.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include "logger.h"
+#include <time.h>
+
+
+/* Subroutines */
+void print_record(LogRecord *rec);
+char *format_arg(char *dst, size_t size, char kind, int64_t v);
+int compare_record(const void *a, const void *b);
+
+
+/**************** Implementation *****************/
+/* Main routine of the decoder */
+int main(int argc, char **argv) {
+	char *filename = LOG_FILE;
+	int c, level = LOG_DEBUG, fd;
+	LogHeader hdr;
+	LogRecord *recs;
+	struct stat st;
+	size_t n;
+
+	while ((c = getopt(argc, argv, "l:")) != -1) {
+		switch (c) {
+		case 'l': level = atoi(optarg); break;		// least level printed
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind < argc - 1) {
+		fprintf(stderr, "usage: %s [-l level] [logfile]\n", argv[0]);
+		exit(0);
+	}
+	if (optind == argc - 1)
+		filename = argv[optind];
+
+	fd = Open(filename, O_RDONLY, 0);
+	Fstat(fd, &st);
+	if (Rio_readn(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr.magic, LOG_MAGIC, 8)
+			|| hdr.version != LOG_VERSION || hdr.record_size != sizeof(LogRecord))
+		app_error("not a log of this version");
+	n = (st.st_size - sizeof(hdr)) / sizeof(LogRecord);	// (a torn last record is left out)
+	recs = Malloc(n * sizeof(LogRecord) + 1);
+	if (Rio_readn(fd, recs, n * sizeof(LogRecord)) != n * sizeof(LogRecord))
+		app_error("the log is shorter than it was");
+	Close(fd);
+
+	qsort(recs, n, sizeof(LogRecord), compare_record);
+	for (size_t i = 0; i < n; i++)
+		if (recs[i].level >= level && recs[i].event < LOG_EVENTS)
+			print_record(&recs[i]);
+	Free(recs);
+	exit(0);
+}
+
+/* Print one record as 'date time.usec LEVEL [tid] text' */
+void print_record(LogRecord *rec) {
+	LogEventInfo *info = &log_events[rec->event];
+	char when[32], a[3][32];
+	time_t sec = rec->time / 1000000000;
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	for (int i = 0; i < 3; i++)
+		format_arg(a[i], sizeof(a[i]), i < (int)strlen(info->args) ? info->args[i] : 'd',
+				rec->arg[i]);
+
+	printf("%s.%06lu %-5s [%u] ", when, (unsigned long)(rec->time % 1000000000 / 1000),
+			log_levels[rec->level & 3], rec->tid);
+	printf(info->format, a[0], a[1], a[2]);
+	printf("\n");
+}
+
+/* Write an argument of kind 'kind' (see LogEventInfo) as text */
+char *format_arg(char *dst, size_t size, char kind, int64_t v) {
+	uint32_t addr = (uint32_t)v;
+
+	if (kind == 'a')							// (stored in host byte order)
+		snprintf(dst, size, "%u.%u.%u.%u", addr >> 24, addr >> 16 & 255, addr >> 8 & 255,
+				addr & 255);
+	else if (kind == 'e' && v >= 0 && v < LOG_EVENTS)
+		snprintf(dst, size, "%s", log_events[v].name);
+	else
+		snprintf(dst, size, "%lld", (long long)v);
+	return dst;
+}
+
+/* Compare two records by time (for qsort) */
+int compare_record(const void *a, const void *b) {
+	uint64_t x = ((const LogRecord *)a)->time, y = ((const LogRecord *)b)->time;
+
+	return (x > y) - (x < y);
+}
+/************** End of the Program ***************/
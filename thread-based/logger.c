@@ -0,0 +1,252 @@
+/**************************************************
+ * Title: SP-Project 2  -  Asynchronous Binary Log
+ * Summary: implementation of 'logger.h'. A ring has
+ one producer (its thread) and one consumer (who
+ flushes), so a record is published by a release
+ store of 'tail' and taken back by one of 'head',
+ as in 'spsc.h'. A thread which exits leaves its
+ ring to the next thread, after the flusher has
+ taken what is in it. The rate limit counts the
+ events of the current second; the count of those
+ which did not fit is logged when the next second
+ sees one of them.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "logger.h"
+#include <time.h>
+#include <sys/syscall.h>
+
+
+/* Preprocessor Directives */
+#define LOG_BATCH		1024		/* records written at once by the flusher */
+
+
+/* Types */
+typedef struct log_ring {			/* the records of one thread */
+	LogRecord rec[LOG_RING];
+	uint64_t tail __attribute__((aligned(64)));	// producer: next record to fill
+	uint64_t dropped;				// and records it found no room for
+	uint32_t tid;
+	uint64_t window[LOG_EVENTS];	// second of the rate limit of every event,
+	uint32_t count[LOG_EVENTS];		// events logged in it
+	uint64_t suppressed[LOG_EVENTS];	// and not logged
+	uint64_t head __attribute__((aligned(64)));	// consumer: next record to take
+	uint64_t dropped_seen;			// drops reported so far
+	int busy;						// a live thread owns it
+	struct log_ring *next;			// link of every ring ever made
+}LogRing;
+
+
+/* Global Variables */
+int log_level = LOG_INFO;			/* events below this level are not logged */
+LogEventInfo log_events[LOG_EVENTS] = {
+	[LOG_START] = { "start", "listening at port %s", "d", LOG_INFO, 0 },
+	[LOG_CONNECT] = { "connect", "connection %s from %s port %s", "dad", LOG_INFO, 1 },
+	[LOG_REQUEST] = { "request", "connection %s: request of %s bytes", "dd", LOG_DEBUG, 1 },
+	[LOG_CLOSE] = { "close", "connection %s closed", "d", LOG_INFO, 1 },
+	[LOG_SUPPRESSED] = { "suppressed", "%s more '%s' events in that second (rate limit)", "de", LOG_WARN, 0 },
+	[LOG_DROPPED] = { "dropped", "%s records dropped (ring full)", "d", LOG_WARN, 0 },
+};
+char *log_levels[4] = { "DEBUG", "INFO", "WARN", "ERROR" };
+int logfd = -1;						/* the file (-1: not logging) */
+long log_errors;					/* failed writes of the file */
+LogRing *log_rings;					/* every ring, newest first */
+sem_t log_mutex;					/* protects 'busy' and adding rings */
+sem_t flush_mutex;					/* one flusher at a time */
+pthread_key_t log_key;				/* frees the ring of a thread at its exit */
+__thread LogRing *my_ring;			/* ring of the calling thread */
+
+
+/* Subroutines */
+static LogRing *ring_take(void);
+static void ring_release(void *ring);
+static int rate_check(LogRing *r, log_type event, uint64_t now);
+static void push(LogRing *r, log_type event, uint64_t now, int64_t a, int64_t b, int64_t c);
+static int put(LogRecord *buf, int n, LogRecord *rec);
+static void *flusher(void *vargp);
+
+
+/**************** Implementation *****************/
+/***          Log Routines                     ***/
+/* Log the events of at least 'level' into 'filename' (appended), from a
+   flusher thread */
+void log_init(char *filename, int level) {
+	LogHeader hdr = { LOG_MAGIC, LOG_VERSION, sizeof(LogRecord) };
+	struct stat st;
+	sigset_t all, prev;
+	pthread_t tid;
+
+	log_level = level;
+	Sem_init(&log_mutex, 0, 1);
+	Sem_init(&flush_mutex, 0, 1);
+	if (pthread_key_create(&log_key, ring_release) != 0)
+		app_error("pthread_key_create error");
+	if ((logfd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+		fprintf(stderr, "Can't open '%s' (%s), not logging\n", filename, strerror(errno));
+		return;
+	}
+	if (fstat(logfd, &st) == 0 && st.st_size == 0 && write(logfd, &hdr, sizeof(hdr)) < 0)
+		fprintf(stderr, "Can't write '%s' (%s)\n", filename, strerror(errno));
+	sigfillset(&all);							// the flusher takes no signal (a
+	pthread_sigmask(SIG_BLOCK, &all, &prev);	// handler which flushes would
+	Pthread_create(&tid, NULL, flusher, NULL);	// wait for itself)
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* Log 'event' with its arguments (never blocks: a full ring drops it) */
+void log_event(log_type event, int64_t a, int64_t b, int64_t c) {
+	LogRing *r;
+	struct timespec ts;
+	uint64_t now;
+
+	if (log_events[event].level < log_level || logfd < 0)
+		return;									// (costs one comparison)
+	r = my_ring ? my_ring : ring_take();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (log_events[event].hot && !rate_check(r, event, now))
+		return;
+	push(r, event, now, a, b, c);
+}
+
+/* Log the connection of 'fd' from 'addr' (no name lookup) */
+void log_connect(int fd, struct sockaddr_storage *addr) {
+	struct sockaddr_in *in = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+	if (addr->ss_family == AF_INET)
+		log_event(LOG_CONNECT, fd, ntohl(in->sin_addr.s_addr), ntohs(in->sin_port));
+	else if (addr->ss_family == AF_INET6)
+		log_event(LOG_CONNECT, fd, 0, ntohs(in6->sin6_port));
+	else
+		log_event(LOG_CONNECT, fd, 0, 0);
+}
+
+/* Write every record in the rings to the file (the flusher does it every
+   LOG_TICK msec; call it before exiting) */
+void log_flush(void) {
+	static LogRecord buf[LOG_BATCH];
+	struct timespec ts;
+	int n = 0;
+
+	if (logfd < 0)
+		return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	P(&flush_mutex);
+	for (LogRing *r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		uint64_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+
+		for (; head != tail; head++)
+			n = put(buf, n, &r->rec[head & (LOG_RING - 1)]);
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);	// room for the producer
+
+		if (dropped != r->dropped_seen) {		// (a record of the flusher's own)
+			LogRecord rec = { (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, r->tid,
+					LOG_DROPPED, LOG_WARN, { dropped - r->dropped_seen, 0, 0 } };
+
+			n = put(buf, n, &rec);
+			r->dropped_seen = dropped;
+		}
+	}
+	put(buf, n, NULL);
+	V(&flush_mutex);
+}
+/***          Log Routines End                 ***/
+
+
+
+/***        Subroutines for the Rings          ***/
+/* Give the calling thread a ring: a free one, or a new one */
+static LogRing *ring_take(void) {
+	LogRing *r;
+
+	P(&log_mutex);
+	for (r = log_rings; r && r->busy; r = r->next)
+		;
+	if (r == NULL) {
+		r = Calloc(1, sizeof(LogRing));
+		r->next = log_rings;
+		__atomic_store_n(&log_rings, r, __ATOMIC_RELEASE);	// (the flusher reads
+	}															// the list without the lock)
+	r->busy = 1;
+	r->tid = syscall(SYS_gettid);
+	V(&log_mutex);
+
+	pthread_setspecific(log_key, r);			// (released at the thread's exit)
+	return my_ring = r;
+}
+
+/* Hand the ring of an exiting thread to the next one */
+static void ring_release(void *ring) {
+	P(&log_mutex);
+	((LogRing *)ring)->busy = 0;
+	V(&log_mutex);
+}
+
+/* Count a hot-path event in the second of 'now'; 0 if it is over the rate */
+static int rate_check(LogRing *r, log_type event, uint64_t now) {
+	uint64_t sec = now / 1000000000;
+
+	if (r->window[event] != sec) {				// a new second
+		if (r->suppressed[event] > 0)
+			push(r, LOG_SUPPRESSED, now, r->suppressed[event], event, 0);
+		r->window[event] = sec;
+		r->count[event] = 0;
+		r->suppressed[event] = 0;
+	}
+	if (r->count[event] >= LOG_RATE) {
+		r->suppressed[event]++;
+		return 0;
+	}
+	r->count[event]++;
+	return 1;
+}
+
+/* Put a record into ring 'r' of the calling thread, or count it as dropped */
+static void push(LogRing *r, log_type event, uint64_t now, int64_t a, int64_t b, int64_t c) {
+	uint64_t tail = r->tail;
+	LogRecord *rec = &r->rec[tail & (LOG_RING - 1)];
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RING) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	rec->time = now;
+	rec->tid = r->tid;
+	rec->event = event;
+	rec->level = log_events[event].level;
+	rec->arg[0] = a;
+	rec->arg[1] = b;
+	rec->arg[2] = c;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);	// publish
+}
+
+/* Add 'rec' to the 'n' records in 'buf', and write them once it is full
+   (or when 'rec' is NULL); return how many it holds */
+static int put(LogRecord *buf, int n, LogRecord *rec) {
+	if (rec)
+		buf[n++] = *rec;
+	if (n == LOG_BATCH || (!rec && n > 0)) {
+		if (write(logfd, buf, n * sizeof(LogRecord)) < 0)
+			log_errors++;						// (logging goes on regardless)
+		n = 0;
+	}
+	return n;
+}
+
+/* Thread routine of the flusher */
+static void *flusher(void *vargp) {
+	Pthread_detach(pthread_self());
+
+	while (1) {
+		usleep(LOG_TICK * 1000);
+		log_flush();
+	}
+
+	return NULL;
+}
+/***      Subroutines for the Rings End        ***/
+/************** End of the Program ***************/
@@ -74,7 +74,11 @@ int main(int argc, char **argv)
 				Rio_writen(clientfd, buf, strlen(buf));
 				// Rio_readlineb(&rio, buf, MAXLINE);
 				Rio_readnb(&rio, buf, MAXLINE);
-				Fputs(buf, stdout);
+				Fwrite(buf, 1, strnlen(buf, MAXLINE), stdout);
+				while (buf[MAXLINE - 1] != '\0') {	// read the rest of a large 'show'
+					Rio_readnb(&rio, buf, MAXLINE);
+					Fwrite(buf, 1, strnlen(buf, MAXLINE), stdout);
+				}
 
 				usleep(1000000);
 			}
@@ -0,0 +1,427 @@
+/**************************************************
+ * Title: SP-Project 2  -  Replication
+ * Summary: implementation of 'repl.h'. The committer
+ of the log hands every durable group to the tap,
+ which queues it for each replica; a sender thread
+ per replica writes the queue to the socket, so a
+ slow replica never holds up the log (it is dropped
+ once too far behind). The acceptor takes the cut
+ for a new replica while writers are paused.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "repl.h"
+#include "stock.h"
+#include <time.h>
+
+
+/* Types */
+typedef struct replica {			/* a replica of this primary */
+	int fd;
+	char name[NI_MAXHOST + NI_MAXSERV];	// host:port of the replica
+	WalRecord *queue;				// durable records waiting to be sent
+	size_t n, size;
+	uint64_t cut;					// records up to this LSN are in its rows
+	uint64_t sent;					// last LSN sent
+	int dead;						// fell too far behind, or went away
+	pthread_cond_t more;			// signaled by the tap
+	struct replica *next;
+}Replica;
+
+
+/* Global Variables */
+int repl_replica = 0;				/* this server is a read-only replica */
+int repl_listenfd = -1;				/* listening socket of a primary */
+
+pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+Replica *replicas;					/* replicas of this primary */
+uint64_t repl_last;					/* last durable LSN seen by the tap */
+
+char repl_host[NI_MAXHOST];			/* the primary of this replica, */
+char repl_port[NI_MAXSERV];
+char repl_primary[MAXLINE];			/* as host:port */
+int repl_connected;					/* the stream is up */
+uint64_t repl_applied;				/* last LSN applied by this replica */
+uint64_t repl_known;				/* last durable LSN of the primary we know of */
+uint64_t repl_delay;				/* age (nsec) of the last message when applied */
+uint32_t repl_failed;				/* changes which failed here, */
+uint64_t repl_diverged[2];			/* in the group of these LSNs (then it stops) */
+
+
+/* Subroutines */
+static void tap(WalRecord *recs, size_t n);
+static void *acceptor(void *vargp);
+static void *sender(void *vargp);
+static void *applier(void *vargp);
+static int dial(ReplHeader *h, Item **rows);
+static uint32_t resync(Item *rows, uint32_t n);
+static int send_all(int fd, void *buf, size_t len);
+static uint64_t wall_ns(void);
+
+
+/**************** Implementation *****************/
+/***          Replication Routines             ***/
+/* Serve replicas at 'port' (or at 'listenfd', taken over from an old
+   server) and hand them every durable group of the log from now on */
+void repl_serve(char *port, int listenfd) {
+	pthread_t tid;
+
+	repl_listenfd = (listenfd >= 0) ? listenfd : Open_listenfd(port);
+	wal_tap = tap;
+	Pthread_create(&tid, NULL, acceptor, NULL);
+}
+
+/* Load the catalog from the primary at host:port, then apply its log
+   from a thread of its own (the caller serves reads meanwhile) */
+void repl_follow(char *host, char *port) {
+	pthread_t tid;
+	ReplHeader h;
+	Item *rows;
+	int fd;
+
+	strncpy(repl_host, host, sizeof(repl_host) - 1);
+	strncpy(repl_port, port, sizeof(repl_port) - 1);
+	snprintf(repl_primary, sizeof(repl_primary), "%s:%s", host, port);
+	repl_replica = 1;
+	if ((fd = dial(&h, &rows)) < 0)
+		app_error("The primary sent no catalog");
+	stock_load_rows(repl_primary, rows, h.count);
+	Free(rows);
+
+	repl_applied = repl_known = h.lsn;
+	repl_connected = 1;
+	Pthread_create(&tid, NULL, applier, (void *)(long)fd);
+}
+
+/* Format the state of replication (for the 'lag' command) */
+void repl_report(char *buf, size_t size) {
+	int len = 0;
+
+	if (repl_replica) {
+		uint64_t applied = __atomic_load_n(&repl_applied, __ATOMIC_ACQUIRE);
+		uint64_t known = __atomic_load_n(&repl_known, __ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&repl_failed, __ATOMIC_ACQUIRE) > 0) {
+			snprintf(buf, size, "error: replica of %s diverged, %u changes of LSN %llu..%llu "
+					"failed here; stopped at LSN %llu of %llu\n", repl_primary, repl_failed,
+					(unsigned long long)repl_diverged[0], (unsigned long long)repl_diverged[1],
+					(unsigned long long)applied, (unsigned long long)known);
+			return;
+		}
+		snprintf(buf, size, "replica of %s (%s): LSN %llu of %llu, %llu changes and %.1f ms behind\n",
+				repl_primary, repl_connected ? "streaming" : "reconnecting", (unsigned long long)applied,
+				(unsigned long long)known, (unsigned long long)(known - applied),
+				__atomic_load_n(&repl_delay, __ATOMIC_RELAXED) / 1e6);
+		return;
+	}
+	if (repl_listenfd < 0) {
+		snprintf(buf, size, "no replication\n");
+		return;
+	}
+
+	pthread_mutex_lock(&repl_mutex);
+	len = snprintf(buf, size, "primary at LSN %llu\n", (unsigned long long)repl_last);
+	for (Replica *r = replicas; r && len < (int)size; r = r->next)
+		len += snprintf(buf + len, size - len, "replica %s: sent LSN %llu, %zu queued\n",
+				r->name, (unsigned long long)r->sent, r->n);
+	pthread_mutex_unlock(&repl_mutex);
+}
+/***        Replication Routines End           ***/
+
+
+
+/***        Subroutines for Replication        ***/
+/* Queue a durable group of the log for every replica (the committer calls
+   this after each flush, in LSN order) */
+static void tap(WalRecord *recs, size_t n) {
+	pthread_mutex_lock(&repl_mutex);
+	for (Replica *r = replicas; r; r = r->next) {
+		size_t k = 0;
+
+		while (k < n && recs[k].lsn <= r->cut)		// in its rows already
+			k++;
+		if (r->dead || k == n)
+			continue;
+		if (r->n + (n - k) > REPL_BACKLOG) {		// it has to start over
+			r->dead = 1;
+			pthread_cond_signal(&r->more);
+			continue;
+		}
+		if (r->n + (n - k) > r->size) {
+			r->size = (r->n + (n - k)) * 2;
+			r->queue = Realloc(r->queue, r->size * sizeof(WalRecord));
+		}
+		memcpy(r->queue + r->n, recs + k, (n - k) * sizeof(WalRecord));
+		r->n += n - k;
+		pthread_cond_signal(&r->more);
+	}
+	repl_last = recs[n - 1].lsn;
+	pthread_mutex_unlock(&repl_mutex);
+}
+
+/* Thread routine which takes new replicas: each one gets the rows of a
+   cut between two changes, and the tap queues every change after it */
+static void *acceptor(void *vargp) {
+	Pthread_detach(pthread_self());
+	rcu_register();									// the cut reads the catalog
+
+	while (1) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		char host[NI_MAXHOST], port[NI_MAXSERV], line[MAXLINE];
+		int fd = accept(repl_listenfd, (SA *)&addr, &addrlen);
+		pthread_t tid;
+		ReplHeader h;
+		Replica *r;
+		Item *rows;
+		uint32_t n;
+		rio_t rio;
+
+		if (fd < 0)
+			continue;
+		Rio_readinitb(&rio, fd);
+		if (rio_readlineb(&rio, line, MAXLINE) <= 0 || strcmp(line, "replicate\n")) {
+			Close(fd);
+			continue;
+		}
+		r = Calloc(1, sizeof(Replica));
+		r->fd = fd;
+		if (getnameinfo((SA *)&addr, addrlen, host, NI_MAXHOST, port, NI_MAXSERV, NI_NUMERICSERV) == 0)
+			snprintf(r->name, sizeof(r->name), "%s:%s", host, port);
+		pthread_cond_init(&r->more, NULL);
+
+		stock_pause();								// no change is running:
+		pthread_mutex_lock(&repl_mutex);
+		r->cut = r->sent = wal_last();				// the rows hold every change
+		r->next = replicas;							// up to the cut
+		replicas = r;
+		pthread_mutex_unlock(&repl_mutex);
+		rows = stock_rows(&n);
+		stock_resume();
+
+		h.type = _repl_rows_;
+		h.count = n;
+		h.lsn = r->cut;
+		h.stamp = wall_ns();
+		if (send_all(fd, &h, sizeof(h)) < 0 || send_all(fd, rows, (size_t)n * sizeof(Item)) < 0)
+			r->dead = 1;							// (the sender cleans up)
+		Free(rows);
+		printf("Replica %s joined at LSN %llu with %u items\n", r->name,
+				(unsigned long long)r->cut, n);
+		Pthread_create(&tid, NULL, sender, r);
+	}
+
+	return NULL;
+}
+
+/* Thread routine of a replica's stream: the queued records, or a heartbeat
+   once the stream has been idle for REPL_BEAT msec */
+static void *sender(void *vargp) {
+	Replica *r = vargp;
+	WalRecord *batch = NULL;
+	size_t cap = 0;
+
+	Pthread_detach(pthread_self());
+	pthread_mutex_lock(&repl_mutex);
+	while (!r->dead) {
+		struct timespec deadline;
+		WalRecord *swap = r->queue;
+		size_t n = r->n, swap_size = r->size;
+		ReplHeader h;
+
+		if (n == 0) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += REPL_BEAT * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			if (pthread_cond_timedwait(&r->more, &repl_mutex, &deadline) == 0)
+				continue;							// (records, or dead)
+		}
+		r->queue = batch;							// the tap goes on with
+		r->size = cap;								// the other buffer
+		r->n = 0;
+		batch = swap;
+		cap = swap_size;
+		h.type = n ? _repl_log_ : _repl_beat_;
+		h.count = n;
+		h.lsn = (repl_last > r->cut) ? repl_last : r->cut;
+		pthread_mutex_unlock(&repl_mutex);
+
+		h.stamp = wall_ns();
+		if (send_all(r->fd, &h, sizeof(h)) < 0 || send_all(r->fd, batch, n * sizeof(WalRecord)) < 0) {
+			pthread_mutex_lock(&repl_mutex);
+			r->dead = 1;
+			break;
+		}
+		pthread_mutex_lock(&repl_mutex);
+		if (n > 0)
+			r->sent = batch[n - 1].lsn;
+	}
+
+	for (Replica **pp = &replicas; *pp; pp = &(*pp)->next)
+		if (*pp == r) {								// unlink it
+			*pp = r->next;
+			break;
+		}
+	pthread_mutex_unlock(&repl_mutex);
+	printf("Replica %s left at LSN %llu\n", r->name, (unsigned long long)r->sent);
+
+	Close(r->fd);
+	free(r->queue);
+	free(batch);
+	pthread_cond_destroy(&r->more);
+	Free(r);
+	return NULL;
+}
+
+/* Thread routine of a replica: apply the stream of the primary, until a
+   change fails here (the copy is no longer the primary's: it says so).
+   A lost stream is dialed again, and the catalog brought to the new cut */
+static void *applier(void *vargp) {
+	int fd = (long)vargp;
+	WalRecord *recs = NULL;
+	size_t size = 0;
+	ReplHeader h;
+
+	Pthread_detach(pthread_self());
+	rcu_register();									// the replay reads the catalog
+
+	while (1) {
+		uint32_t changed;
+		Item *rows;
+		int retry;
+
+		while (rio_readn(fd, &h, sizeof(h)) == sizeof(h)) {
+			if (h.type == _repl_log_) {
+				uint32_t failed;
+
+				if (h.count > size)
+					recs = Realloc(recs, (size = h.count) * sizeof(WalRecord));
+				if (rio_readn(fd, recs, h.count * sizeof(WalRecord)) != (ssize_t)(h.count * sizeof(WalRecord)))
+					break;
+				failed = stock_replay(recs, h.count);		// shards in parallel
+				__atomic_store_n(&repl_applied, recs[h.count - 1].lsn, __ATOMIC_RELEASE);
+				if (failed > 0) {
+					repl_diverged[0] = recs[0].lsn;
+					repl_diverged[1] = recs[h.count - 1].lsn;
+					__atomic_store_n(&repl_known, h.lsn, __ATOMIC_RELEASE);
+					__atomic_store_n(&repl_failed, failed, __ATOMIC_RELEASE);	// (for 'lag')
+					fprintf(stderr, "Diverged from the primary %s: %u changes of LSN %llu..%llu "
+							"failed, applying no more\n", repl_primary, failed,
+							(unsigned long long)recs[0].lsn, (unsigned long long)recs[h.count - 1].lsn);
+					break;
+				}
+			}
+			else if (h.type != _repl_beat_)
+				break;
+			__atomic_store_n(&repl_known, h.lsn, __ATOMIC_RELEASE);
+			__atomic_store_n(&repl_delay, wall_ns() - h.stamp, __ATOMIC_RELAXED);
+		}
+		Close(fd);
+		repl_connected = 0;
+		if (repl_failed > 0)						// (it stays where it stopped)
+			break;
+
+		fprintf(stderr, "Lost the primary %s at LSN %llu, serving the reads on and dialing again\n",
+				repl_primary, (unsigned long long)repl_applied);
+		for (retry = REPL_RETRY; (fd = dial(&h, &rows)) < 0; retry *= 2) {
+			if (retry > REPL_RETRY_MAX)
+				retry = REPL_RETRY_MAX;
+			usleep(retry * 1000);
+		}
+		changed = resync(rows, h.count);			// (the primary may have restarted
+		Free(rows);									// from its files, or failed over)
+		__atomic_store_n(&repl_applied, h.lsn, __ATOMIC_RELEASE);
+		__atomic_store_n(&repl_known, h.lsn, __ATOMIC_RELEASE);
+		repl_connected = 1;
+		printf("Rejoined the primary %s at LSN %llu, %u items differed\n", repl_primary,
+				(unsigned long long)h.lsn, changed);
+	}
+
+	free(recs);
+	return NULL;
+}
+
+/* Connect to the primary and ask for its stream: return the socket, the
+   header of the cut in 'h' and its rows (sorted by ID); -1 if it fails */
+static int dial(ReplHeader *h, Item **rows) {
+	struct timeval timeout = { REPL_TIMEOUT / 1000, REPL_TIMEOUT % 1000 * 1000 };
+	int fd = open_clientfd(repl_host, repl_port);
+
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));	// (heartbeats
+	if (send_all(fd, "replicate\n", 10) < 0							// keep it busy)
+			|| rio_readn(fd, h, sizeof(*h)) != sizeof(*h) || h->type != _repl_rows_) {
+		Close(fd);
+		return -1;
+	}
+	*rows = Malloc((size_t)h->count * sizeof(Item) + 1);
+	if (rio_readn(fd, *rows, (size_t)h->count * sizeof(Item)) != (ssize_t)(h->count * sizeof(Item))) {
+		Free(*rows);
+		Close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Bring the catalog to 'rows' (sorted by ID) with ordinary changes, so the
+   reads go on meanwhile; return the number of items which differed */
+static uint32_t resync(Item *rows, uint32_t n) {
+	uint32_t m, i = 0, j = 0, changed = 0;
+	Item *cur = stock_rows(&m);						// (only this thread writes)
+
+	while (i < m || j < n) {
+		if (j == n || (i < m && cur[i].ID < rows[j].ID))
+			stock_delist(cur[i++].ID);				// gone from the primary
+		else if (i == m || rows[j].ID < cur[i].ID) {
+			stock_list(rows[j].ID, rows[j].left_stock, rows[j].price);
+			j++;									// new on the primary
+		}
+		else {
+			Item *c = &cur[i++], *r = &rows[j++];
+
+			if (c->price != r->price) {				// (no change sets a price)
+				stock_delist(c->ID);
+				stock_list(r->ID, r->left_stock, r->price);
+			}
+			else if (c->left_stock < r->left_stock)
+				stock_sell(c->ID, r->left_stock - c->left_stock);
+			else if (c->left_stock > r->left_stock)
+				stock_buy(c->ID, c->left_stock - r->left_stock);
+			else
+				continue;
+		}
+		changed++;
+	}
+	Free(cur);
+	return changed;
+}
+
+/* Write the whole buffer without raising SIGPIPE; -1 if the peer is gone */
+static int send_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Return the wall-clock time in nanoseconds (shared by the processes) */
+static uint64_t wall_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/***      Subroutines for Replication End      ***/
+/************** End of the Program ***************/
@@ -0,0 +1,55 @@
+/**************************************************
+ * Title: SP-Project 2  -  Replication
+ * Summary: streams the write-ahead log of a primary
+ stockserver to read-only replicas over TCP. A new
+ replica gets a consistent cut of the catalog as
+ rows, then every durable group of the log after
+ the cut (by 'wal_tap'), and heartbeats while the
+ log is idle, so it knows how far it lags behind.
+ A replica applies the groups with stock_replay,
+ in the order of the primary's changes; one which
+ fails there means the copy diverged, so it stops
+ and 'lag' reports the error. A replica which loses
+ the stream dials again with backoff, and brings
+ its catalog to the rows of the new cut.
+**************************************************/
+#ifndef __REPL_H__
+#define __REPL_H__
+
+#include "csapp.h"
+#include "wal.h"
+#include <stdint.h>
+
+
+/* Preprocessor Directives */
+#define REPL_BEAT		100			/* msec between heartbeats of an idle stream */
+#define REPL_BACKLOG	(1 << 20)	/* most queued records before a replica is dropped */
+#define REPL_TIMEOUT	(20 * REPL_BEAT)	/* msec of silence after which the primary is lost */
+#define REPL_RETRY		100			/* msec before the first redial, doubled up to */
+#define REPL_RETRY_MAX	5000		/* this between the next ones */
+
+
+/* Types */
+typedef enum {						/* type of a message of the stream */
+	_repl_rows_ = 1, _repl_log_, _repl_beat_
+}repl_msg;
+
+typedef struct {					/* head of a message of the stream (host byte order) */
+	uint32_t type;					// repl_msg
+	uint32_t count;					// rows or records which follow
+	uint64_t lsn;					// rows: LSN of the cut, else last durable LSN
+	uint64_t stamp;					// clock of the primary (CLOCK_REALTIME nsec)
+}ReplHeader;
+
+
+/* Global Variables */
+extern int repl_replica;			/* this server is a read-only replica */
+extern int repl_listenfd;			/* listening socket of a primary (-1: none) */
+
+
+/* Replication routines */
+void repl_serve(char *port, int listenfd);
+void repl_follow(char *host, char *port);
+void repl_report(char *buf, size_t size);
+
+#endif /* __REPL_H__ */
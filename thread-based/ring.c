@@ -0,0 +1,250 @@
+/**************************************************
+ * Title: SP-Project 2  -  Lock-Free Ring Buffer
+ * Summary: implementation of 'ring.h'. The cell of
+ position p holds seq == p while it is free for the
+ producer of p, and seq == p + 1 once the item is
+ in it; the consumer of p hands the cell on to the
+ producer of the next lap with seq = p + size. A
+ run of cells in the expected state is claimed by
+ one CAS on 'tail' (or 'head'), which is a batch.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "ring.h"
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+
+/* Subroutines */
+static int try_insert(Ring *r, int *items, int n, double stamp);
+static int try_remove(Ring *r, int *items, double *stamps, int n);
+static int sleep_on(uint32_t *word, uint32_t old, double deadline);
+static void wake_on(uint32_t *word, int *waiters, int n);
+
+
+/**************** Implementation *****************/
+/***         Ring Buffer Routines              ***/
+/* Create an empty ring of at least 'n' cells */
+void ring_init(Ring *r, int n) {
+	uint64_t size = 1;
+
+	while (size < (uint64_t)n)
+		size <<= 1;								// (a position maps to a cell by a mask)
+	memset(r, 0, sizeof(Ring));
+	r->cells = Calloc(size, sizeof(RingCell));
+	r->mask = size - 1;
+	for (uint64_t i = 0; i < size; i++)
+		r->cells[i].seq = i;					// free for the first lap
+}
+
+/* Free the cells of the ring */
+void ring_deinit(Ring *r) {
+	Free(r->cells);
+}
+
+/* Insert one item, sleeping while the ring is full */
+void ring_insert(Ring *r, int item) {
+	ring_insert_batch(r, &item, 1);
+}
+
+/* Insert 'n' items in order, as many at once as there are free cells,
+   sleeping while the ring is full */
+void ring_insert_batch(Ring *r, int *items, int n) {
+	double stamp = ring_now();
+
+	while (n > 0) {
+		int k = try_insert(r, items, n, stamp);
+
+		if (k == 0) {								// full: sleep until a remove
+			uint32_t old;
+
+			__atomic_add_fetch(&r->full_waiters, 1, __ATOMIC_SEQ_CST);
+			old = __atomic_load_n(&r->removed, __ATOMIC_SEQ_CST);
+			if ((k = try_insert(r, items, n, stamp)) == 0)
+				sleep_on(&r->removed, old, 0);
+			__atomic_sub_fetch(&r->full_waiters, 1, __ATOMIC_RELAXED);
+			if (k == 0)
+				continue;
+		}
+		wake_on(&r->inserted, &r->empty_waiters, k);
+		items += k;
+		n -= k;
+	}
+}
+
+/* Remove one item and the time of its insertion ('stamp' may be NULL),
+   sleeping while the ring is empty; -1 if nothing comes within 'timeout'
+   seconds (< 0: wait forever, 0: don't wait) */
+int ring_remove(Ring *r, double timeout, double *stamp) {
+	double when;
+	int item;
+
+	if (ring_remove_batch(r, &item, &when, 1, timeout) == 0)
+		return -1;
+	if (stamp)
+		*stamp = when;
+	return item;
+}
+
+/* Remove up to 'n' items (at least one) and the times of their insertion,
+   sleeping while the ring is empty; return how many, 0 if nothing comes
+   within 'timeout' seconds (< 0: wait forever, 0: don't wait) */
+int ring_remove_batch(Ring *r, int *items, double *stamps, int n, double timeout) {
+	double deadline = timeout < 0 ? 0 : ring_now() + timeout;
+	int k;
+
+	while ((k = try_remove(r, items, stamps, n)) == 0) {	// empty: sleep until
+		uint32_t old;											// an insert
+		int awake;
+
+		if (timeout == 0)
+			return 0;
+
+		__atomic_add_fetch(&r->empty_waiters, 1, __ATOMIC_SEQ_CST);
+		old = __atomic_load_n(&r->inserted, __ATOMIC_SEQ_CST);
+		awake = (k = try_remove(r, items, stamps, n)) > 0 || sleep_on(&r->inserted, old, deadline);
+		__atomic_sub_fetch(&r->empty_waiters, 1, __ATOMIC_RELAXED);
+		if (k > 0)
+			break;
+		if (!awake)
+			return 0;
+	}
+	wake_on(&r->removed, &r->full_waiters, k);
+
+	return k;
+}
+
+/* Return the number of items in the ring, and how long (sec) the first
+   one has waited (0 if none) */
+int ring_length(Ring *r, double *age) {
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	RingCell *c = &r->cells[head & r->mask];
+	double stamp;
+
+	*age = 0;
+	if (tail <= head)
+		return 0;
+	__atomic_load(&c->stamp, &stamp, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) == head + 1)
+		*age = ring_now() - stamp;					// (a guess if it is taken meanwhile)
+	return (int)(tail - head);
+}
+
+/* Return the monotonic time in seconds */
+double ring_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/***         Ring Buffer Routines End          ***/
+
+
+
+/***     Subroutines for Claiming Cells        ***/
+/* Fill up to 'n' free cells at the tail; return how many (0: full) */
+static int try_insert(Ring *r, int *items, int n, double stamp) {
+	uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	while (1) {
+		int64_t dif = 0;
+		int k;
+
+		for (k = 0; k < n; k++) {					// the run of free cells
+			RingCell *c = &r->cells[(pos + k) & r->mask];
+
+			if ((dif = (int64_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + k))) != 0)
+				break;
+		}
+		if (k == 0 && dif < 0)
+			return 0;								// the last lap is still there
+		if (k == 0) {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);	// another producer
+			continue;											// took the cell
+		}
+		if (!__atomic_compare_exchange_n(&r->tail, &pos, pos + k, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;								// (pos is reloaded)
+
+		for (int j = 0; j < k; j++) {				// the cells are ours now
+			RingCell *c = &r->cells[(pos + j) & r->mask];
+
+			c->item = items[j];
+			__atomic_store(&c->stamp, &stamp, __ATOMIC_RELAXED);
+			__atomic_store_n(&c->seq, pos + j + 1, __ATOMIC_RELEASE);	// publish
+		}
+		return k;
+	}
+}
+
+/* Take up to 'n' filled cells at the head; return how many (0: empty) */
+static int try_remove(Ring *r, int *items, double *stamps, int n) {
+	uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	while (1) {
+		int64_t dif = 0;
+		int k;
+
+		for (k = 0; k < n; k++) {					// the run of filled cells
+			RingCell *c = &r->cells[(pos + k) & r->mask];
+
+			if ((dif = (int64_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + k + 1))) != 0)
+				break;
+		}
+		if (k == 0 && dif < 0)
+			return 0;								// not inserted yet
+		if (k == 0) {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&r->head, &pos, pos + k, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+
+		for (int j = 0; j < k; j++) {
+			RingCell *c = &r->cells[(pos + j) & r->mask];
+
+			items[j] = c->item;
+			__atomic_load(&c->stamp, &stamps[j], __ATOMIC_RELAXED);
+			__atomic_store_n(&c->seq, pos + j + r->mask + 1, __ATOMIC_RELEASE);	// next lap
+		}
+		return k;
+	}
+}
+
+/* Sleep until '*word' is no longer 'old', or until 'deadline' (0: never);
+   0 if the deadline has passed */
+static int sleep_on(uint32_t *word, uint32_t old, double deadline) {
+	struct timespec ts, *tsp = NULL;
+
+	if (deadline > 0) {
+		double left = deadline - ring_now();
+
+		if (left <= 0)
+			return 0;
+		ts.tv_sec = (time_t)left;
+		ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+		tsp = &ts;
+	}
+	if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, old, tsp, NULL, 0) < 0
+			&& errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+		unix_error("futex error");
+
+	return deadline == 0 || ring_now() < deadline;
+}
+
+/* Wake up to 'n' sleepers on '*word' after the ring has changed (a sleeper
+   counts itself in 'waiters' before it looks at the ring a last time, so
+   either it sees the change or the change sees it) */
+static void wake_on(uint32_t *word, int *waiters, int n) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) == 0)
+		return;										// nobody sleeps: no system call
+	__atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+/***   Subroutines for Claiming Cells End      ***/
+/************** End of the Program ***************/
@@ -0,0 +1,48 @@
+/**************************************************
+ * Title: SP-Project 2  -  Lock-Free Ring Buffer
+ * Summary: bounded multi-producer/multi-consumer
+ queue of descriptors with Vyukov's sequence
+ numbers: every cell tells which position may use
+ it next, so producers and consumers claim cells
+ with one compare-and-swap and never take a lock.
+ A side sleeps on a futex only when the ring is
+ full or empty. Insert and remove work on batches,
+ and every item carries the time of its insertion.
+**************************************************/
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+
+/* Types */
+typedef struct {					/* one cell of the ring */
+	uint64_t seq;					// position which may use the cell next
+	double stamp;					// time of insertion (ring_now)
+	int item;
+}RingCell;
+
+typedef struct {					/* the ring (fields on their own cache lines) */
+	RingCell *cells;
+	uint64_t mask;					// number of cells - 1 (a power of two)
+	uint64_t head __attribute__((aligned(64)));	// next position to remove
+	uint64_t tail __attribute__((aligned(64)));	// next position to insert
+	uint32_t inserted __attribute__((aligned(64)));	// futexes, bumped only while
+	uint32_t removed;				// someone sleeps on them
+	int empty_waiters;				// consumers asleep on 'inserted'
+	int full_waiters;				// producers asleep on 'removed'
+}Ring;
+
+
+/* Ring buffer routines */
+void ring_init(Ring *r, int n);
+void ring_deinit(Ring *r);
+void ring_insert(Ring *r, int item);
+void ring_insert_batch(Ring *r, int *items, int n);
+int ring_remove(Ring *r, double timeout, double *stamp);
+int ring_remove_batch(Ring *r, int *items, double *stamps, int n, double timeout);
+int ring_length(Ring *r, double *age);
+double ring_now(void);
+
+#endif /* __RING_H__ */
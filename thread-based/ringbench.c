@@ -0,0 +1,255 @@
+/**************************************************
+ * Title: SP-Project 2  -  Ring Buffer Benchmark
+ * Summary: hands items from producer threads to
+ consumer threads through the semaphore buffer the
+ server used before ('sbuf', kept here as the
+ reference) and through the lock-free ring of
+ 'ring.h', one at a time and in batches. Prints the
+ throughput and the handoff latency (insert to
+ remove) of every variant.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include "ring.h"
+
+
+/* Preprocessor Directives */
+#define PRODUCERS	1				/* default number of producers (the acceptor) */
+#define CONSUMERS	4				/* default number of consumers (workers) */
+#define ITEMS		1000000			/* default items of every producer */
+#define BATCH		32				/* default batch size */
+#define SLOTS		1024			/* size of the buffers */
+#define SAMPLE		8				/* latency of every SAMPLE-th item is kept */
+
+
+/* Types */
+typedef struct {					/* the semaphore buffer of the old server */
+	int *buf;
+	int n, front, rear;
+	sem_t mutex, slots, items;
+}sbuf_t;
+
+typedef enum {						/* the buffer under test */
+	_sbuf_, _ring_, _ring_batch_in_, _ring_batch_
+}variant;
+
+typedef struct {					/* per-consumer state */
+	pthread_t tid;
+	double *lat;					// sampled latencies (sec)
+	long n;
+}Consumer;
+
+
+/* Global Variables */
+int nproducers = PRODUCERS, nconsumers = CONSUMERS, nitems = ITEMS, batch = BATCH;
+variant which;						/* variant of the current run */
+sbuf_t sbuf;
+Ring ring;
+double *sent;						/* insertion time of every item */
+
+
+/* Subroutines */
+double run(variant v, double *p50, double *p99, double *p999);
+void *producer(void *vargp);
+void *consumer(void *vargp);
+void put(int *items, int n);
+int take(int *items, double *stamps);
+int cmp_double(const void *a, const void *b);
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+
+/**************** Implementation *****************/
+/* Main routine: run every variant and print a line for it */
+int main(int argc, char **argv) {
+	char *names[] = { "semaphores (sbuf)", "ring", "ring, batched insert",
+			"ring, batched both" };
+	int c;
+
+	while ((c = getopt(argc, argv, "p:c:n:b:")) != -1) {
+		switch (c) {
+		case 'p': nproducers = atoi(optarg); break;
+		case 'c': nconsumers = atoi(optarg); break;
+		case 'n': nitems = atoi(optarg); break;
+		case 'b': batch = atoi(optarg); break;
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc || nproducers < 1 || nconsumers < 1 || batch < 1) {
+		fprintf(stderr, "usage: %s [-p producers] [-c consumers] [-n items] [-b batch]\n",
+				argv[0]);
+		exit(0);
+	}
+	sent = Malloc((size_t)nproducers * nitems * sizeof(double));
+
+	printf("%d producers, %d consumers, %d items each, batches of %d\n", nproducers,
+			nconsumers, nitems, batch);
+	printf("%-22s %14s %10s %10s %10s\n", "buffer", "items/sec", "p50 us", "p99 us",
+			"p99.9 us");
+	for (variant v = _sbuf_; v <= _ring_batch_; v++) {
+		double p50, p99, p999, rate = run(v, &p50, &p99, &p999);
+
+		printf("%-22s %14.0f %10.2f %10.2f %10.2f\n", names[v], rate, p50 * 1e6,
+				p99 * 1e6, p999 * 1e6);
+	}
+	Free(sent);
+	exit(0);
+}
+
+/* Run one variant; return the items per second and the percentiles of
+   the handoff latency */
+double run(variant v, double *p50, double *p99, double *p999) {
+	pthread_t *tids = Malloc(nproducers * sizeof(pthread_t));
+	Consumer *cons = Calloc(nconsumers, sizeof(Consumer));
+	long cap = (long)nproducers * nitems / SAMPLE + 1, n = 0;
+	double begin, elapsed, *all;
+	int stop = -1;
+
+	which = v;
+	sbuf_init(&sbuf, SLOTS);
+	ring_init(&ring, SLOTS);
+	begin = ring_now();
+	for (int i = 0; i < nconsumers; i++) {
+		cons[i].lat = Malloc(cap * sizeof(double));
+		Pthread_create(&cons[i].tid, NULL, consumer, &cons[i]);
+	}
+	for (long i = 0; i < nproducers; i++)
+		Pthread_create(&tids[i], NULL, producer, (void *)i);
+	for (int i = 0; i < nproducers; i++)
+		Pthread_join(tids[i], NULL);
+	for (int i = 0; i < nconsumers; i++)
+		put(&stop, 1);							// one end mark for every consumer
+	for (int i = 0; i < nconsumers; i++)
+		Pthread_join(cons[i].tid, NULL);
+	elapsed = ring_now() - begin;
+
+	all = Malloc(cap * sizeof(double));			// percentiles of every sample
+	for (int i = 0; i < nconsumers; i++) {
+		memcpy(all + n, cons[i].lat, cons[i].n * sizeof(double));
+		n += cons[i].n;
+		Free(cons[i].lat);
+	}
+	qsort(all, n, sizeof(double), cmp_double);
+	*p50 = n ? all[(long)(n * 0.5)] : 0;
+	*p99 = n ? all[(long)(n * 0.99)] : 0;
+	*p999 = n ? all[(long)(n * 0.999)] : 0;
+
+	Free(all);
+	Free(cons);
+	Free(tids);
+	Free(sbuf.buf);
+	ring_deinit(&ring);
+	return (double)nproducers * nitems / elapsed;
+}
+
+/* Thread routine of the producers: insert 'nitems' items, in batches if
+   the variant says so */
+void *producer(void *vargp) {
+	int first = (long)vargp * nitems, step = which >= _ring_batch_in_ ? batch : 1;
+	int *items = Malloc(step * sizeof(int));
+
+	for (int i = 0; i < nitems; i += step) {
+		int k = nitems - i < step ? nitems - i : step;
+		double now = ring_now();
+
+		for (int j = 0; j < k; j++) {
+			items[j] = first + i + j;
+			sent[first + i + j] = now;
+		}
+		put(items, k);
+	}
+
+	Free(items);
+	return NULL;
+}
+
+/* Thread routine of the consumers: remove items until an end mark */
+void *consumer(void *vargp) {
+	Consumer *c = vargp;
+	int *items = Malloc(batch * sizeof(int));
+	double *stamps = Malloc(batch * sizeof(double));
+
+	while (1) {
+		int k = take(items, stamps);
+		double now = ring_now();
+
+		for (int j = 0; j < k; j++) {
+			if (items[j] < 0) {					// (the marks come last, so the rest
+				put(items + j + 1, k - j - 1);	// of a batch are marks of the others)
+				Free(stamps);
+				Free(items);
+				return NULL;
+			}
+			if (items[j] % SAMPLE == 0)
+				c->lat[c->n++] = now - sent[items[j]];
+		}
+	}
+}
+
+/* Insert 'n' items into the buffer under test */
+void put(int *items, int n) {
+	if (which == _sbuf_)
+		for (int j = 0; j < n; j++)
+			sbuf_insert(&sbuf, items[j]);
+	else
+		ring_insert_batch(&ring, items, n);
+}
+
+/* Remove items from the buffer under test (a batch if the variant says
+   so), return how many */
+int take(int *items, double *stamps) {
+	if (which == _sbuf_) {
+		items[0] = sbuf_remove(&sbuf);
+		return 1;
+	}
+	if (which == _ring_batch_)
+		return ring_remove_batch(&ring, items, stamps, batch, -1);
+	items[0] = ring_remove(&ring, -1, NULL);
+	return 1;
+}
+
+/* Comparison function of doubles for qsort */
+int cmp_double(const void *a, const void *b) {
+	double x = *(double *)a, y = *(double *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/**   Reference: the Semaphore Buffer (sbuf)    **/
+/* Create an empty buffer of 'n' slots */
+void sbuf_init(sbuf_t *sp, int n) {
+	sp->buf = Calloc(n, sizeof(int));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	Sem_init(&sp->mutex, 0, 1);
+	Sem_init(&sp->slots, 0, n);
+	Sem_init(&sp->items, 0, 0);
+}
+
+/* Insert an item at the rear */
+void sbuf_insert(sbuf_t *sp, int item) {
+	P(&sp->slots);
+	P(&sp->mutex);
+	sp->buf[(++sp->rear) % (sp->n)] = item;
+	V(&sp->mutex);
+	V(&sp->items);
+}
+
+/* Remove the item at the front */
+int sbuf_remove(sbuf_t *sp) {
+	int item;
+
+	P(&sp->items);
+	P(&sp->mutex);
+	item = sp->buf[(++sp->front) % (sp->n)];
+	V(&sp->mutex);
+	V(&sp->slots);
+
+	return item;
+}
+/**  Reference: the Semaphore Buffer (sbuf) End **/
+/************** End of the Program ***************/
@@ -0,0 +1,107 @@
+/**************************************************
+ * Title: SP-Project 2  -  Shard Map
+ * Summary: implementation of 'route.h'. The ranges
+ are sorted once at load, so the owner of an ID is
+ a binary search away.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "route.h"
+
+
+/* Subroutines */
+static int compare_range(const void *a, const void *b);
+
+
+/**************** Implementation *****************/
+/***          Shard Map Routines               ***/
+/* Read the map 'filename' (exits if it can't be read or ranges overlap) */
+ShardMap *route_load(char *filename) {
+	ShardMap *map = Calloc(1, sizeof(ShardMap));
+	char line[MAXLINE];
+	int capacity = 0;
+	FILE *fp;
+
+	if (!(fp = fopen(filename, "rt"))) {
+		fprintf(stderr, "The '%s' shard map does not exist.\n", filename);
+		exit(0);
+	}
+	while (Fgets(line, sizeof(line), fp)) {
+		Range r;
+
+		if (line[0] == '#' || sscanf(line, "%d %d %1024s %31s", &r.lo, &r.hi, r.host, r.port) != 4)
+			continue;						// comments and blank lines
+		if (map->n == capacity)
+			map->ranges = Realloc(map->ranges, (capacity = capacity ? 2 * capacity : 8) * sizeof(Range));
+		map->ranges[map->n++] = r;
+	}
+	Fclose(fp);
+
+	qsort(map->ranges, map->n, sizeof(Range), compare_range);
+	for (int i = 0; i < map->n; i++)
+		if (map->ranges[i].lo > map->ranges[i].hi
+				|| (i > 0 && map->ranges[i].lo <= map->ranges[i - 1].hi)) {
+			fprintf(stderr, "The '%s' shard map has overlapping ranges at %d.\n",
+					filename, map->ranges[i].lo);
+			exit(0);
+		}
+	if (map->n == 0) {
+		fprintf(stderr, "The '%s' shard map is empty.\n", filename);
+		exit(0);
+	}
+
+	return map;
+}
+
+/* Return the index of the range which holds 'id' (-1: nobody owns it) */
+int route_find(ShardMap *map, int id) {
+	int lo = 0, hi = map->n - 1;
+
+	while (lo <= hi) {						// binary search on the ranges
+		int mid = lo + (hi - lo) / 2;
+
+		if (id < map->ranges[mid].lo)
+			hi = mid - 1;
+		else if (id > map->ranges[mid].hi)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
+/* Return the index of the range of the server listening at 'port'
+   (-1 if none, or more than one) */
+int route_self(ShardMap *map, char *port) {
+	int self = -1;
+
+	for (int i = 0; i < map->n; i++)
+		if (!strcmp(map->ranges[i].port, port)) {
+			if (self >= 0)
+				return -1;
+			self = i;
+		}
+
+	return self;
+}
+
+/* Free a map */
+void route_free(ShardMap *map) {
+	Free(map->ranges);
+	Free(map);
+}
+/***         Shard Map Routines End            ***/
+
+
+
+/***         Subroutines for Shard Map         ***/
+/* Compare two ranges by their first ID (for qsort) */
+static int compare_range(const void *a, const void *b) {
+	int x = ((const Range *)a)->lo, y = ((const Range *)b)->lo;
+
+	return (x > y) - (x < y);
+}
+/***       Subroutines for Shard Map End       ***/
+/************** End of the Program ***************/
@@ -0,0 +1,36 @@
+/**************************************************
+ * Title: SP-Project 2  -  Shard Map
+ * Summary: the map of a cluster of stockservers, in
+ which every server owns one range of IDs. The map
+ is a text file shared by the servers, the routing
+ proxy and the clients: one 'lo hi host port' line
+ per server, ranges disjoint ('#' starts a comment).
+ A 'show' of the cluster is the concatenation of
+ the servers' in the order of their ranges.
+**************************************************/
+#ifndef __ROUTE_H__
+#define __ROUTE_H__
+
+#include "csapp.h"
+
+
+/* Types */
+typedef struct {					/* the range of IDs which one server owns */
+	int lo, hi;						// lo <= ID <= hi
+	char host[NI_MAXHOST];			// address of the server
+	char port[NI_MAXSERV];
+}Range;
+
+typedef struct {					/* every range of a cluster, sorted by 'lo' */
+	Range *ranges;
+	int n;
+}ShardMap;
+
+
+/* Shard map routines */
+ShardMap *route_load(char *filename);
+int route_find(ShardMap *map, int id);
+int route_self(ShardMap *map, char *port);
+void route_free(ShardMap *map);
+
+#endif /* __ROUTE_H__ */
@@ -0,0 +1,240 @@
+/**************************************************
+ * Title: SP-Project 2  -  Work-Stealing Scheduler
+ * Summary: implementation of 'sched.h'. A worker
+ looks at its own deque, then its inbox, then the
+ deques and inboxes of the others from a random
+ one on. With nothing anywhere it counts itself
+ idle, looks once more and sleeps on a semaphore,
+ which every submit or push posts while somebody
+ is idle.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "sched.h"
+
+
+/* Preprocessor Directives */
+#define EMPTY		(-1)			/* no task */
+#define ABORT		(-2)			/* lost a race for the task, try again */
+#define IDLE_WAIT	0.05			/* seconds an idle worker sleeps at most */
+
+
+/* Global Variables */
+SchedWorker *sched;					/* every worker */
+int sched_n;						/* number of workers */
+sched_fn sched_run;					/* runs one step of a task */
+void (*sched_start)(int);			/* called by every worker when it starts */
+int sched_idle;						/* workers about to sleep */
+sem_t sched_wakeup;					/* posted for idle workers */
+
+
+/* Subroutines */
+static void *worker(void *vargp);
+static int find_task(int w);
+static void notify(void);
+static void deque_push(Deque *d, int task);
+static int deque_take(Deque *d);
+static int deque_steal(Deque *d);
+
+
+/**************** Implementation *****************/
+/***          Scheduler Routines               ***/
+/* Start 'nworkers' workers with stacks of 'stack_kb' KB; 'run' runs the
+   steps of tasks, 'start' (if any) is called by every worker first with
+   its index */
+void sched_init(int nworkers, int stack_kb, sched_fn run, void (*start)(int worker)) {
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	sched_n = nworkers < 1 ? 1 : nworkers > SCHED_MAX ? SCHED_MAX : nworkers;
+	sched_run = run;
+	sched_start = start;
+	sched = Calloc(sched_n, sizeof(SchedWorker));
+	Sem_init(&sched_wakeup, 0, 0);
+	for (int w = 0; w < sched_n; w++) {
+		sched[w].deque.tasks = Calloc(SCHED_DEQUE, sizeof(int));
+		ring_init(&sched[w].inbox, SCHED_INBOX);
+		sched[w].rng = 2654435761u * (w + 1);
+	}
+
+	pthread_attr_init(&attr);
+	if ((size_t)stack_kb * 1024 >= PTHREAD_STACK_MIN)
+		pthread_attr_setstacksize(&attr, (size_t)stack_kb * 1024);
+	for (long w = 0; w < sched_n; w++)
+		Pthread_create(&tid, &attr, worker, (void *)w);
+	pthread_attr_destroy(&attr);
+}
+
+/* Hand 'task' to the inbox of worker 'home' (from any thread) */
+void sched_submit(int task, int home) {
+	ring_insert(&sched[(unsigned)home % sched_n].inbox, task);
+	notify();
+}
+
+/* Queue the next step of 'task' on the deque of the calling worker */
+void sched_push(int task, int worker) {
+	Deque *d = &sched[worker].deque;
+
+	if (d->bottom - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= SCHED_DEQUE) {
+		sched_run(task, worker);				// full: no queueing at all
+		return;
+	}
+	deque_push(d, task);
+	notify();
+}
+
+/* Return the number of workers */
+int sched_workers(void) {
+	return sched_n;
+}
+
+/* Write the counters of the workers into 'buf' */
+void sched_report(char *buf, size_t size) {
+	long ran = 0, stolen = 0, queued = 0;
+
+	for (int w = 0; w < sched_n; w++) {
+		double age;
+
+		ran += __atomic_load_n(&sched[w].ran, __ATOMIC_RELAXED);
+		stolen += __atomic_load_n(&sched[w].stolen, __ATOMIC_RELAXED);
+		queued += ring_length(&sched[w].inbox, &age);
+		queued += __atomic_load_n(&sched[w].deque.bottom, __ATOMIC_RELAXED)
+				- __atomic_load_n(&sched[w].deque.top, __ATOMIC_RELAXED);
+	}
+	snprintf(buf, size, "Work stealing: %d workers, %ld steps run (%ld stolen, %.1f%%), "
+			"%ld queued\n", sched_n, ran, stolen, ran ? 100.0 * stolen / ran : 0.0, queued);
+}
+/***          Scheduler Routines End           ***/
+
+
+
+/***        Subroutines for the Workers        ***/
+/* Thread routine of the workers: run tasks, find more, sleep if none */
+static void *worker(void *vargp) {
+	int w = (long)vargp, task;
+	SchedWorker *me = &sched[w];
+
+	Pthread_detach(pthread_self());
+	if (sched_start)
+		sched_start(w);
+
+	while (1) {
+		if ((task = find_task(w)) == EMPTY) {
+			__atomic_add_fetch(&sched_idle, 1, __ATOMIC_SEQ_CST);
+			if ((task = find_task(w)) == EMPTY) {	// (a notify sees us now)
+				struct timespec until;
+
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_nsec += (long)(IDLE_WAIT * 1e9);
+				until.tv_sec += until.tv_nsec / 1000000000;
+				until.tv_nsec %= 1000000000;
+				sem_timedwait(&sched_wakeup, &until);
+			}
+			__atomic_sub_fetch(&sched_idle, 1, __ATOMIC_SEQ_CST);
+			if (task == EMPTY)
+				continue;
+		}
+		__atomic_store_n(&me->ran, me->ran + 1, __ATOMIC_RELAXED);
+		sched_run(task, w);
+	}
+
+	return NULL;
+}
+
+/* Find a task for worker 'w': its deque (newest first), its inbox, then
+   the oldest task of another worker */
+static int find_task(int w) {
+	SchedWorker *me = &sched[w];
+	double stamp;
+	int task;
+
+	if ((task = deque_take(&me->deque)) != EMPTY)
+		return task;
+	if ((task = ring_remove(&me->inbox, 0, &stamp)) >= 0)
+		return task;
+
+	for (int tries = 0; tries < 2; tries++) {			// once more after lost races
+		int start = (me->rng = me->rng * 1103515245u + 12345u) >> 8, lost = 0;
+
+		for (int i = 0; i < sched_n; i++) {
+			int v = (start + i) % sched_n;
+
+			if (v == w)
+				continue;
+			if ((task = deque_steal(&sched[v].deque)) == ABORT)
+				lost = 1;
+			else if (task != EMPTY || (task = ring_remove(&sched[v].inbox, 0, &stamp)) >= 0) {
+				__atomic_store_n(&me->stolen, me->stolen + 1, __ATOMIC_RELAXED);
+				return task;
+			}
+		}
+		if (!lost)
+			break;
+	}
+
+	return EMPTY;
+}
+
+/* Wake an idle worker after new work has been queued */
+static void notify(void) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched_idle, __ATOMIC_SEQ_CST) > 0)
+		V(&sched_wakeup);
+}
+/***      Subroutines for the Workers End      ***/
+
+
+
+/***    Subroutines for 'Chase-Lev Deque'      ***/
+/* Push a task at the bottom (owner only) */
+static void deque_push(Deque *d, int task) {
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&d->tasks[b & (SCHED_DEQUE - 1)], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);		// the task before the new bottom
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* Take the newest task from the bottom (owner only) */
+static int deque_take(Deque *d) {
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1, t;
+	int task = EMPTY;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);		// thieves see the claim first
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		task = __atomic_load_n(&d->tasks[b & (SCHED_DEQUE - 1)], __ATOMIC_RELAXED);
+		if (t == b) {								// the last one: race the thieves
+			if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				task = EMPTY;
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);	// was empty
+
+	return task;
+}
+
+/* Steal the oldest task from the top (any thread); ABORT if another one
+   got it first */
+static int deque_steal(Deque *d) {
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE), b;
+	int task;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return EMPTY;
+	task = __atomic_load_n(&d->tasks[t & (SCHED_DEQUE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return ABORT;
+
+	return task;
+}
+/***  Subroutines for 'Chase-Lev Deque' End    ***/
+/************** End of the Program ***************/
@@ -0,0 +1,52 @@
+/**************************************************
+ * Title: SP-Project 2  -  Work-Stealing Scheduler
+ * Summary: a fixed set of worker threads, each with
+ its own deque of tasks (Chase-Lev) and an inbox
+ (the lock-free ring of 'ring.h'). A task is a small
+ integer (the descriptor of a connection whose next
+ step is due). Other threads submit a task to the
+ inbox of its home worker; a worker pushes the next
+ step of a task onto its own deque and pops it back
+ LIFO while it is hot in the cache. An idle worker
+ steals the oldest tasks of the others, so the work
+ queued behind a long task moves on.
+**************************************************/
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include "csapp.h"
+#include "ring.h"
+#include <stdint.h>
+
+
+/* Preprocessor Directives */
+#define SCHED_DEQUE		4096		/* tasks in a deque (a full one runs inline) */
+#define SCHED_INBOX		1024		/* tasks in an inbox */
+#define SCHED_MAX		256			/* most workers */
+
+
+/* Types */
+typedef void (*sched_fn)(int task, int worker);	/* runs one step of a task */
+
+typedef struct {					/* Chase-Lev deque: the owner works at the */
+	int64_t top __attribute__((aligned(64)));		// bottom, thieves take from the top
+	int64_t bottom __attribute__((aligned(64)));
+	int *tasks;
+}Deque;
+
+typedef struct {					/* per-worker state */
+	Deque deque;
+	Ring inbox;						// tasks submitted by other threads
+	long ran, stolen;				// tasks run / of them stolen from others
+	unsigned rng;					// picks the victims
+}SchedWorker;
+
+
+/* Scheduler routines */
+void sched_init(int nworkers, int stack_kb, sched_fn run, void (*start)(int worker));
+void sched_submit(int task, int home);
+void sched_push(int task, int worker);
+int sched_workers(void);
+void sched_report(char *buf, size_t size);
+
+#endif /* __SCHED_H__ */
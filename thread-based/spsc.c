@@ -0,0 +1,63 @@
+/**************************************************
+ * Title: SP-Project 2  -  Single-Producer Queue
+ * Summary: implementation of 'spsc.h'. The producer
+ writes a slot, then publishes it by a release store
+ of 'tail'; the consumer reads 'tail' with acquire,
+ takes the slot, then hands it back by a release
+ store of 'head'.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "spsc.h"
+
+
+/**************** Implementation *****************/
+/***          Queue Routines                   ***/
+/* Create an empty queue of at least 'n' slots */
+void spsc_init(Spsc *q, int n) {
+	uint64_t size = 1;
+
+	while (size < (uint64_t)n)
+		size <<= 1;
+	memset(q, 0, sizeof(Spsc));
+	q->slots = Calloc(size, sizeof(void *));
+	q->mask = size - 1;
+}
+
+/* Append 'p' (producer only); 0 if the queue is full */
+int spsc_push(Spsc *q, void *p) {
+	uint64_t tail = q->tail;
+
+	if (tail - q->head_seen > q->mask) {		// full as far as we know
+		q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail - q->head_seen > q->mask)
+			return 0;
+	}
+	q->slots[tail & q->mask] = p;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);	// publish
+	return 1;
+}
+
+/* Take the oldest pointer (consumer only); NULL if the queue is empty */
+void *spsc_pop(Spsc *q) {
+	uint64_t head = q->head;
+	void *p;
+
+	if (head == q->tail_seen) {					// empty as far as we know
+		q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head == q->tail_seen)
+			return NULL;
+	}
+	p = q->slots[head & q->mask];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);	// the slot is free
+	return p;
+}
+
+/* Return how many pointers surely fit (producer only) */
+int spsc_room(Spsc *q) {
+	q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	return (int)(q->mask + 1 - (q->tail - q->head_seen));
+}
+/***          Queue Routines End               ***/
+/************** End of the Program ***************/
@@ -0,0 +1,34 @@
+/**************************************************
+ * Title: SP-Project 2  -  Single-Producer Queue
+ * Summary: bounded queue of pointers between one
+ producer thread and one consumer thread. Each side
+ owns its index and keeps a copy of the other one,
+ which it reloads only when the queue looks full
+ (or empty), so a push or pop touches no shared
+ cache line most of the time and takes no lock.
+**************************************************/
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+
+/* Types */
+typedef struct {					/* the queue (each side on its own cache line) */
+	void **slots;
+	uint64_t mask;					// number of slots - 1 (a power of two)
+	uint64_t tail __attribute__((aligned(64)));	// producer: next slot to fill
+	uint64_t head_seen;				// and the head it saw last
+	uint64_t head __attribute__((aligned(64)));	// consumer: next slot to empty
+	uint64_t tail_seen;				// and the tail it saw last
+}Spsc;
+
+
+/* Queue routines */
+void spsc_init(Spsc *q, int n);
+int spsc_push(Spsc *q, void *p);
+void *spsc_pop(Spsc *q);
+int spsc_room(Spsc *q);
+
+#endif /* __SPSC_H__ */
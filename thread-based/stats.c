@@ -0,0 +1,185 @@
+/**************************************************
+ * Title: SP-Project 2  -  Request Latency Statistics
+ * Summary: implementation of 'stats.h'. Values are
+ nanoseconds: below 16 every value has a bucket of
+ its own, above that each power of two is split
+ into 16 buckets. A thread stores its counts with
+ plain (relaxed) stores, as nobody else writes its
+ set, and a report reads them the same way, so it
+ may miss a sample which is being recorded but
+ never sees a torn one.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "stats.h"
+#include <time.h>
+
+
+/* Types */
+typedef struct stat_set {			/* the histograms of one thread */
+	uint64_t count[STAT_KINDS][STAT_PHASES][STAT_BUCKETS];
+	uint64_t max[STAT_KINDS][STAT_PHASES];
+	int busy;						// a live thread owns it
+	struct stat_set *next;			// link of every set ever made
+}StatSet;
+
+
+/* Global Variables */
+char *stat_kind[STAT_KINDS] = { "show", "buy", "sell", "other", "error" };
+char *stat_phase[STAT_PHASES] = { "queue", "lock", "execute", "write" };
+StatSet *stat_sets;					/* every set, newest first */
+sem_t stat_mutex;					/* protects the list and 'busy' */
+pthread_key_t stat_key;				/* frees the set of a thread at its exit */
+pthread_once_t stat_once = PTHREAD_ONCE_INIT;
+__thread StatSet *my_set;			/* set of the calling thread */
+
+
+/* Subroutines */
+static void stat_init(void);
+static StatSet *set_take(void);
+static void set_release(void *set);
+static int bucket_of(uint64_t v);
+static uint64_t bucket_value(int b);
+static uint64_t percentile(uint64_t *count, uint64_t total, double q);
+
+
+/**************** Implementation *****************/
+/***          Statistics Routines              ***/
+/* Return the monotonic time in nanoseconds */
+uint64_t stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count the phases of a request in the set of the calling thread */
+void stats_record(StatSample *s) {
+	StatSet *set = my_set ? my_set : set_take();
+
+	for (int ph = 0; ph < STAT_PHASES; ph++) {
+		uint64_t v = s->phase[ph], *c = &set->count[s->kind][ph][bucket_of(v)];
+
+		__atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);		// (only we write it)
+		if (v > set->max[s->kind][ph])
+			__atomic_store_n(&set->max[s->kind][ph], v, __ATOMIC_RELAXED);
+	}
+}
+
+/* Write the percentiles of every phase of every kind which has requests
+   into 'buf'; return the length */
+size_t stats_report(char *buf, size_t size) {
+	uint64_t (*count)[STAT_PHASES][STAT_BUCKETS] = Calloc(STAT_KINDS, sizeof(*count));
+	uint64_t max[STAT_KINDS][STAT_PHASES] = {{0}};
+	size_t len;
+
+	pthread_once(&stat_once, stat_init);
+	P(&stat_mutex);
+	for (StatSet *set = stat_sets; set; set = set->next)		// sum the sets
+		for (int k = 0; k < STAT_KINDS; k++)
+			for (int ph = 0; ph < STAT_PHASES; ph++) {
+				uint64_t m = __atomic_load_n(&set->max[k][ph], __ATOMIC_RELAXED);
+
+				for (int b = 0; b < STAT_BUCKETS; b++)
+					count[k][ph][b] += __atomic_load_n(&set->count[k][ph][b], __ATOMIC_RELAXED);
+				if (m > max[k][ph])
+					max[k][ph] = m;
+			}
+	V(&stat_mutex);
+
+	len = snprintf(buf, size, "%-6s %-8s %10s %10s %10s %10s %10s %10s (usec)\n", "kind",
+			"phase", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (int k = 0; k < STAT_KINDS; k++)
+		for (int ph = 0; ph < STAT_PHASES && len < size; ph++) {
+			uint64_t *c = count[k][ph], total = 0, m = max[k][ph], p[4];
+			double q[4] = { 0.5, 0.9, 0.99, 0.999 };
+
+			for (int b = 0; b < STAT_BUCKETS; b++)
+				total += c[b];
+			if (total == 0)
+				continue;
+			for (int i = 0; i < 4; i++)
+				if ((p[i] = percentile(c, total, q[i])) > m)
+					p[i] = m;					// (the middle of its bucket may be past it)
+			len += snprintf(buf + len, size - len, "%-6s %-8s %10lu %10.1f %10.1f %10.1f "
+					"%10.1f %10.1f\n", stat_kind[k], stat_phase[ph], (unsigned long)total,
+					p[0] / 1e3, p[1] / 1e3, p[2] / 1e3, p[3] / 1e3, m / 1e3);
+		}
+	Free(count);
+
+	return len < size ? len : size - 1;
+}
+/***          Statistics Routines End          ***/
+
+
+
+/***      Subroutines for the Histograms       ***/
+/* Prepare the list of sets (once) */
+static void stat_init(void) {
+	Sem_init(&stat_mutex, 0, 1);
+	if (pthread_key_create(&stat_key, set_release) != 0)
+		app_error("pthread_key_create error");
+}
+
+/* Give the calling thread a set: a free one, or a new one */
+static StatSet *set_take(void) {
+	StatSet *set;
+
+	pthread_once(&stat_once, stat_init);
+	P(&stat_mutex);
+	for (set = stat_sets; set && set->busy; set = set->next)
+		;
+	if (set == NULL) {
+		set = Calloc(1, sizeof(StatSet));
+		set->next = stat_sets;
+		stat_sets = set;
+	}
+	set->busy = 1;
+	V(&stat_mutex);
+
+	pthread_setspecific(stat_key, set);			// (released at the thread's exit)
+	return my_set = set;
+}
+
+/* Hand the set of an exiting thread to the next one (its counts stay) */
+static void set_release(void *set) {
+	P(&stat_mutex);
+	((StatSet *)set)->busy = 0;
+	V(&stat_mutex);
+}
+
+/* Return the bucket of value 'v' */
+static int bucket_of(uint64_t v) {
+	int e;
+
+	if (v >= 1ULL << STAT_MAX_BITS)
+		v = (1ULL << STAT_MAX_BITS) - 1;
+	if (v < 1 << STAT_SUB_BITS)
+		return v;
+	e = 63 - __builtin_clzll(v);					// v is in [2^e, 2^(e+1))
+	return ((e - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+			+ ((v >> (e - STAT_SUB_BITS)) & ((1 << STAT_SUB_BITS) - 1));
+}
+
+/* Return the middle of the values of bucket 'b' */
+static uint64_t bucket_value(int b) {
+	int e = (b >> STAT_SUB_BITS) + STAT_SUB_BITS - 1, sub = b & ((1 << STAT_SUB_BITS) - 1);
+
+	if (b < 1 << STAT_SUB_BITS)
+		return b;
+	return ((uint64_t)((1 << STAT_SUB_BITS) + sub) << (e - STAT_SUB_BITS))
+			+ (1ULL << (e - STAT_SUB_BITS)) / 2;
+}
+
+/* Return the value below which a fraction 'q' of the 'total' samples is */
+static uint64_t percentile(uint64_t *count, uint64_t total, double q) {
+	uint64_t want = (uint64_t)(q * total + 0.999999), seen = 0;
+
+	for (int b = 0; b < STAT_BUCKETS; b++)
+		if ((seen += count[b]) >= want && count[b] > 0)
+			return bucket_value(b);
+	return 0;
+}
+/***    Subroutines for the Histograms End     ***/
+/************** End of the Program ***************/
@@ -0,0 +1,51 @@
+/**************************************************
+ * Title: SP-Project 2  -  Request Latency Statistics
+ * Summary: log-linear (HDR-style) histograms of the
+ time requests spend in each phase, by command:
+ waiting for a thread (queue), waiting for writer
+ locks (lock), running (execute) and sending the
+ reply (write). Every thread counts into a set of
+ its own, so recording is a few stores to memory
+ nobody else writes; a report sums the sets and
+ prints percentiles. A set outlives its thread and
+ is taken over by the next one, so nothing is lost.
+**************************************************/
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+
+/* Preprocessor Directives */
+#define STAT_SHOW		0			/* kinds of request */
+#define STAT_BUY		1
+#define STAT_SELL		2
+#define STAT_OTHER		3			/* list, delist, lag, pool, stats, exit */
+#define STAT_ERROR		4
+#define STAT_KINDS		5
+
+#define STAT_QUEUE		0			/* phases of a request */
+#define STAT_LOCK		1
+#define STAT_EXECUTE	2
+#define STAT_WRITE		3
+#define STAT_PHASES		4
+
+#define STAT_SUB_BITS	4			/* 16 buckets per power of two (6% wide) */
+#define STAT_MAX_BITS	40			/* longer than 2^40 nsec (18 min) is clamped */
+#define STAT_BUCKETS	((STAT_MAX_BITS - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+
+
+/* Types */
+typedef struct {					/* phases of one request (nsec) */
+	int kind;						// STAT_SHOW, ...
+	uint64_t phase[STAT_PHASES];	// STAT_QUEUE, ...
+}StatSample;
+
+
+/* Statistics routines */
+uint64_t stats_now(void);
+void stats_record(StatSample *s);
+size_t stats_report(char *buf, size_t size);
+
+#endif /* __STATS_H__ */
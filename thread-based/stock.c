@@ -0,0 +1,1974 @@
+/**************************************************
+ * Title: SP-Project 2  -  Sharded Stock Store
+ * Summary: implementation of 'stock.h'. Items are
+ partitioned by ID hash into shards, so writers of
+ different shards never share a lock, a slab or a
+ tree. Whole-catalog scans ('show', stock_store) are
+ split by shard among the caller and helper threads,
+ and so is loading: the text is parsed in parts, the
+ rows are sorted per shard, and every tree is built
+ balanced from its sorted rows in linear time.
+ Every change is appended to the write-ahead log,
+ and checkpoints are written by a forked child from
+ a copy-on-write image of the store, as binary
+ snapshots which are mapped and bulk-loaded.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "stock.h"
+#include "wal.h"
+#include <time.h>
+#include <stddef.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+
+/* Preprocessor Directives */
+#define CKPT_DONE	42				/* exit status of a successful checkpoint child
+									   (csapp wrappers exit with 0 on errors) */
+
+
+/* Types */
+typedef struct {					/* whole-catalog job shared by caller and helpers */
+	void (*fn)(int, void *);		// per-shard routine
+	void *arg;
+	int next;						// next shard to take
+	int done;						// number of shards finished
+	int refcnt;						// number of participants holding the job
+	sem_t finished;					// posted when the last shard is finished
+}ScanJob;
+
+typedef struct {					/* per-shard output of a whole-catalog scan */
+	char *buf;
+	size_t len, size;
+	int *id;						// 'show': ID of every line, in order,
+	uint32_t *end;					// and the offset past it
+	uint32_t lines;
+	int lo, hi;						// 'show': range of the IDs formatted
+}ScanPart;
+
+typedef struct {					/* parallel load of a catalog (nshards parts) */
+	char *text;						// text of the file, or NULL if rows are given
+	size_t len;
+	Item **parsed;					// rows of each part of the input
+	uint32_t *nparsed;
+	uint32_t *counts;				// rows of part i for shard s at [i * nshards + s]
+	Item **rows;					// rows of each shard
+	uint32_t *nrows;
+	int sorted;						// input rows are sorted by ID already
+	int dup;						// an ID is listed twice (and which one)
+	int dup_id;
+}LoadJob;
+
+typedef struct {					/* parallel replay of logged changes */
+	WalRecord *recs;				// records in LSN order
+	size_t *order;					// indexes of the records, grouped by shard
+	size_t *start;					// records of shard s at order[start[s]..start[s+1])
+	uint32_t failed;				// changes which failed again
+}ReplayJob;
+
+typedef struct epoch_slot {			/* per-thread state for epoch-based reclamation */
+	unsigned long epoch;			// epoch observed at read_lock (0 if quiescent)
+	int changing;					// inside a change (buy/sell/list/delist)
+	int used;						// owned by a live thread (else reusable)
+	struct epoch_slot *next;
+}EpochSlot;
+
+
+/* Global Variables */
+int stock_combining = 1;			/* apply buy/sell by flat combining */
+int stock_owned = 0;				/* one thread writes each shard (by the caller) */
+int stock_sequenced = 0;			/* buy/sell applied by the sequencer thread */
+int stock_lo = INT_MIN;				/* a text file imports only these IDs */
+int stock_hi = INT_MAX;				/* (the range of a server in a cluster) */
+__thread uint64_t stock_waited;		/* nsec the caller has waited for writers */
+void *(*stock_alloc)(size_t, int);	/* item memory of a shard (NULL: malloc) */
+void (*stock_free)(void *, size_t);	/* and its release (NULL: free) */
+Shard *shards;						/* every shard of the store */
+int nshards, shard_bits;			/* number of shards (and its log2) */
+__thread Shard *writer;				/* shard whose catalog the caller is updating */
+
+ScanJob *scan_queue[NSCANNERS];		/* jobs waiting for helper threads */
+int scan_front, scan_rear;
+sem_t scan_mutex, scan_slots, scan_items;
+
+EpochSlot *epoch_slots;				/* list of every registered reader thread */
+unsigned long global_epoch = 1;		/* advanced by every grace period */
+__thread EpochSlot *my_slot;		/* slot of the calling thread */
+
+int writers_paused;					/* new changes wait while this is nonzero */
+sem_t ckpt_mutex;					/* one checkpoint (or store) at a time */
+
+SeqSlot *seq_ring;					/* buy/sell posted to the sequencer */
+uint64_t seq_claim __attribute__((aligned(64)));	/* next position of a poster */
+uint32_t seq_bell __attribute__((aligned(64)));	/* futex of the sleeping sequencer, */
+int seq_idle;						/* which sets this before it sleeps */
+pthread_once_t seq_once = PTHREAD_ONCE_INIT;
+
+
+/* Subroutines for the shards */
+static uint32_t hash_id(int id);
+static Shard *shard_of(int id);
+static Stripe *stripe_of(Shard *sh, int id);
+static void shard_format(int i, void *arg);
+static char *catalog_format(int lo, int hi, size_t *len, size_t slack, int parallel);
+static ScanPart *scan_parts(int lo, int hi);
+static uint32_t order_search(Shard *sh, Catalog *cat, int id);
+static char *merge_parts(ScanPart *parts, int first, int step, size_t *len, size_t slack);
+static void publish(Shard *sh, Catalog *old, Catalog *new_cat);
+static stock_result trade(int id, int delta);
+static void lock_wait(sem_t *s);
+
+
+/* Subroutines for 'Flat Combining' */
+static stock_result combine(Stripe *st, FCRecord *req);
+static void apply(FCRecord *rec);
+
+
+/* Subroutines for the Sequencer */
+static stock_result sequence(int id, int delta);
+static void seq_start(void);
+static void *sequencer(void *vargp);
+static void seq_apply(SeqSlot *s);
+static void seq_wait(SeqSlot *s, uint32_t want);
+static void seq_set(SeqSlot *s, uint32_t state);
+
+
+/* Subroutines for whole-catalog scans */
+static void scan_run(void (*fn)(int, void *), void *arg);
+static void scan_work(ScanJob *job);
+static void scan_put(ScanJob *job);
+static void *scanner(void *vargp);
+
+
+/* Subroutines for 'Sequence Lock' */
+static void read_item(ItemChunk *c, uint32_t i, int *left_stock, int *price);
+static void write_begin(ItemChunk *c, uint32_t i);
+static void write_end(ItemChunk *c, uint32_t i);
+
+
+/* Subroutines for Decimal Formatting */
+static char *format_int(char *dst, int v);
+static char *format_digits(char *dst, uint32_t u, int width);
+
+
+/* Subroutines for Checkpoints */
+static void change_begin(void);
+static void change_end(void);
+static void pause_writers(void);
+static void resume_writers(void);
+static int write_file(char *filename, void *head, size_t hlen, void *buf, size_t len);
+static double now(void);
+static uint64_t nsec(void);
+
+
+/* Subroutines for binary snapshots and replay */
+static void shard_rows(int i, void *arg);
+static Item *catalog_rows(uint32_t *n, int parallel);
+static int write_snapshot(char *filename, Item *rows, uint32_t n, uint64_t lsn);
+static char *snap_verify(SnapHeader *hdr, size_t size);
+static uint64_t snap_checksum(const void *buf, size_t len);
+static void replay_shard(int i, void *arg);
+
+
+/* Subroutines for loading */
+static void load_catalog(char *filename, char *text, size_t len, Item *rows, uint32_t n);
+static void load_parse(int i, void *arg);
+static void load_scatter(int i, void *arg);
+static void load_build(int i, void *arg);
+static char *line_start(LoadJob *job, int i);
+static char *parse_int(char *p, char *end, int *v);
+static void sort_rows(Item *rows, uint32_t n);
+
+
+/* Subroutines for 'Read-Copy-Update' of the catalog */
+static void retire(void *ptr, void (*dtor)(void *));
+static void reclaim(Shard *sh);
+
+
+/* Subroutines for the item slab */
+static void slab_init(Slab *sp, int shard);
+static uint32_t slab_alloc(Slab *sp);
+static void slab_release(void *slot);
+static ItemChunk *slab_chunk(Slab *sp, uint32_t idx);
+
+
+/* Subroutines for the AVL Tree */
+static Node* InsertTree(Node*, int, uint32_t);
+static Node* BuildTree(Item *rows, uint32_t *items, uint32_t lo, uint32_t hi);
+static Node* DeleteTree(Node* node, int id);
+static Node* SearchTree(Node* node, int id);
+static void ClearTree(Node* node);
+static Node* OwnNode(Node *node);
+static Node* Rebalance(Node *node);
+static Node* SingleRotateLeft(Node *nodeB);
+static Node* SingleRotateRight(Node *nodeA);
+static Node* DoubleRotateLeft(Node *node);
+static Node* DoubleRotateRight(Node *node);
+static int GetHeight(Node *node);
+static int GetGreater(int, int);
+
+
+/**************** Implementation *****************/
+/***             Store Routines                ***/
+/* Create 'nshards' empty shards (power of two) and the scan helpers */
+void stock_init(int n) {
+	static int scanners_started;
+	pthread_t tid;
+
+	for (nshards = 1, shard_bits = 0; nshards < n; nshards <<= 1)
+		shard_bits++;						// round up to a power of two
+
+	if ((shards = aligned_alloc(64, nshards * sizeof(Shard))) == NULL)
+		unix_error("aligned_alloc error");	// stripes sit on their own cache lines
+	memset(shards, 0, nshards * sizeof(Shard));
+	for (int i = 0; i < nshards; i++) {
+		shards[i].catalog = Calloc(1, sizeof(Catalog));
+		shards[i].catalog->order = Malloc(sizeof(uint32_t));
+		slab_init(&shards[i].slab, i);
+		Sem_init(&shards[i].admin, 0, 1);
+		for (int j = 0; j < NSTRIPES; j++)
+			Sem_init(&shards[i].stripe[j].w, 0, 1);
+	}
+	Sem_init(&ckpt_mutex, 0, 1);
+
+	if (scanners_started++)					// helpers survive stock_clear
+		return;
+	Sem_init(&scan_mutex, 0, 1);
+	Sem_init(&scan_slots, 0, NSCANNERS);
+	Sem_init(&scan_items, 0, 0);
+	for (int i = 0; i < NSCANNERS; i++)
+		Pthread_create(&tid, NULL, scanner, NULL);
+}
+
+/* Read 'filename' and construct the AVL tree of every shard,
+   return the LSN of the last change which the file holds */
+uint64_t stock_load(char *filename) {
+	unsigned long long lsn = 0;
+	struct stat st;
+	char *text = NULL;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "The '%s' file does not exist.\n", filename);
+		exit(0);
+	}
+	Fstat(fd, &st);
+	if (st.st_size > 0) {
+		text = Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		madvise(text, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	if (st.st_size > 5 && !memcmp(text, "#lsn ", 5))	// header of a stored file
+		for (char *p = text + 5; p < text + st.st_size && isdigit(*p); p++)
+			lsn = lsn * 10 + (*p - '0');
+	load_catalog(filename, text, st.st_size, NULL, 0);
+
+	if (text != NULL)
+		Munmap(text, st.st_size);
+	Close(fd);
+	return lsn;
+}
+
+/* Map a binary snapshot and load its sorted rows in one pass, without
+   parsing; set 'lsn' to its last change. Return -1 (and load nothing)
+   if the snapshot is damaged */
+int stock_load_snapshot(char *filename, uint64_t *lsn) {
+	struct stat st;
+	SnapHeader *hdr;
+	char *err = NULL;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "The '%s' file does not exist.\n", filename);
+		exit(0);
+	}
+	Fstat(fd, &st);
+	if (st.st_size < (off_t)sizeof(SnapHeader)) {
+		fprintf(stderr, "The '%s' snapshot is damaged (truncated header).\n", filename);
+		Close(fd);
+		return -1;
+	}
+
+	hdr = Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	madvise(hdr, st.st_size, MADV_SEQUENTIAL);	// one pass, read ahead aggressively
+	if ((err = snap_verify(hdr, st.st_size)) != NULL)
+		fprintf(stderr, "The '%s' snapshot is damaged (%s).\n", filename, err);
+	else {
+		load_catalog(filename, NULL, 0, (Item *)(hdr + 1), hdr->count);	// (no copy of the file)
+		*lsn = hdr->lsn;
+	}
+
+	Munmap(hdr, st.st_size);
+	Close(fd);
+	return err ? -1 : 0;
+}
+
+/* Store the catalog into 'filename' (same format as 'show', after a header) */
+void stock_store(char *filename) {
+	char header[64];
+	uint64_t lsn;
+	size_t len;
+	char *buf;
+	int hlen;
+
+	P(&ckpt_mutex);						// wait for a running checkpoint
+	pause_writers();					// every logged change, and no other one
+	lsn = wal_last();
+	buf = catalog_format(INT_MIN, INT_MAX, &len, 0, stock_size() >= SCAN_MIN);
+	resume_writers();
+
+	hlen = snprintf(header, sizeof(header), "#lsn %llu\n", (unsigned long long)lsn);
+	if (write_file(filename, header, hlen, buf, len) < 0) {
+		fprintf(stderr, "File open error occurs in Store Routine.\n");
+		exit(0);
+	}
+	Free(buf);
+	V(&ckpt_mutex);
+}
+
+/* Store the catalog into a binary snapshot 'filename' */
+void stock_store_snapshot(char *filename) {
+	uint64_t lsn;
+	uint32_t n;
+	Item *rows;
+
+	P(&ckpt_mutex);
+	pause_writers();
+	lsn = wal_last();
+	rows = catalog_rows(&n, stock_size() >= SCAN_MIN);
+	resume_writers();
+
+	if (write_snapshot(filename, rows, n, lsn) < 0) {
+		fprintf(stderr, "File open error occurs in Store Routine.\n");
+		exit(0);
+	}
+	Free(rows);
+	V(&ckpt_mutex);
+}
+
+/* Return every item as rows sorted by ID (a consistent cut if the caller
+   holds the writers by stock_pause) */
+Item *stock_rows(uint32_t *n) {
+	return catalog_rows(n, stock_size() >= SCAN_MIN);
+}
+
+/* Load rows sorted by ID into the empty store ('source' names them in errors) */
+void stock_load_rows(char *source, Item *rows, uint32_t n) {
+	load_catalog(source, NULL, 0, rows, n);
+}
+
+/* Apply logged changes in LSN order (after loading, before serving);
+   shards replay in parallel. Return the number of changes which failed */
+uint32_t stock_replay(WalRecord *recs, size_t n) {
+	ReplayJob job;
+
+	job.recs = recs;
+	job.order = Malloc(n * sizeof(size_t) + 1);
+	job.start = Calloc(nshards + 1, sizeof(size_t));
+	job.failed = 0;
+
+	for (size_t j = 0; j < n; j++)				// records of shard s go to
+		job.start[shard_of(recs[j].id) - shards + 1]++;	// order[start[s]..start[s+1])
+	for (int s = 0; s < nshards; s++)
+		job.start[s + 1] += job.start[s];
+	for (size_t j = 0; j < n; j++)
+		job.order[job.start[shard_of(recs[j].id) - shards]++] = j;
+	for (int s = nshards; s > 0; s--)			// (filling moved every start
+		job.start[s] = job.start[s - 1];		// to the next shard's)
+	job.start[0] = 0;
+
+	scan_run(replay_shard, &job);
+
+	Free(job.order);
+	Free(job.start);
+	return job.failed;
+}
+
+/* Write a binary snapshot into 'filename' from a forked child while the
+   parent keeps serving; writers are paused only around fork() */
+Checkpoint stock_checkpoint(char *filename) {
+	Checkpoint ck = { 0, 0, 0, 0, 0 };
+	double start = now();
+	int status;
+	pid_t pid;
+
+	P(&ckpt_mutex);
+	pause_writers();					// a cut between two changes
+	ck.lsn = wal_last();
+	ck.items = stock_size();
+	wal_rotate();						// changes after the cut go to a new log
+
+	if ((pid = Fork()) == 0) {			// the child sees a copy-on-write image,
+		uint32_t n;						// no writer, and no other thread
+		Item *rows = catalog_rows(&n, 0);
+
+		_exit(write_snapshot(filename, rows, n, ck.lsn) < 0 ? 1 : CKPT_DONE);
+	}
+	resume_writers();
+	ck.pause = now() - start;
+
+	if (waitpid(pid, &status, 0) < 0)
+		unix_error("Waitpid error");
+	ck.duration = now() - start;
+	if ((ck.ok = WIFEXITED(status) && WEXITSTATUS(status) == CKPT_DONE))
+		wal_drop_old();					// the file holds those changes now
+	V(&ckpt_mutex);
+
+	return ck;
+}
+
+/* Hold every change until stock_resume (pauses nest) */
+void stock_pause(void) {
+	pause_writers();
+}
+
+/* Let the changes held by stock_pause go on */
+void stock_resume(void) {
+	resume_writers();
+}
+
+/* Free every shard (no reader may be active) */
+void stock_clear(void) {
+	for (int i = 0; i < nshards; i++) {
+		Slab *sp = &shards[i].slab;
+
+		ClearTree(shards[i].catalog->root);
+		Free(shards[i].catalog->order);
+		Free(shards[i].catalog);
+		for (uint32_t c = 0; c < sp->nchunks; c++)
+			if (stock_free)
+				stock_free(sp->chunks[c], sizeof(ItemChunk));
+			else
+				free(sp->chunks[c]);
+		Free(sp->chunks);
+		free(sp->free);
+	}
+	free(shards);
+	shards = NULL;
+}
+
+/* Buy 'amount' of item 'id' (routine of 'Writer 1') */
+stock_result stock_buy(int id, int amount) {
+	return trade(id, -amount);
+}
+
+/* Sell 'amount' of item 'id' (routine of 'Writer 2') */
+stock_result stock_sell(int id, int amount) {
+	return trade(id, amount);
+}
+
+/* Add a new item while readers keep going */
+stock_result stock_list(int id, int amount, int price) {
+	Shard *sh = shard_of(id);
+	Catalog *old, *new_cat;
+	uint32_t idx, pos;
+	ItemChunk *c;
+	uint64_t lsn;
+
+	change_begin();
+	lock_wait(&sh->admin);				// only one writer of the catalog at a time
+	writer = sh;
+	old = sh->catalog;
+	if (SearchTree(old->root, id) != NULL) {
+		V(&sh->admin);
+		change_end();
+		return _exists_;
+	}
+
+	idx = slab_alloc(&sh->slab);
+	c = slab_chunk(&sh->slab, idx);
+	c->ID[SLAB_SLOT(idx)] = id;
+	c->left_stock[SLAB_SLOT(idx)] = amount;
+	c->price[SLAB_SLOT(idx)] = price;
+	c->seq[SLAB_SLOT(idx)] = 0;
+
+	pos = order_search(sh, old, id);			// (the position in the index)
+
+	new_cat = Malloc(sizeof(Catalog));
+	new_cat->size = old->size + 1;
+	new_cat->order = Malloc(new_cat->size * sizeof(uint32_t));
+	memcpy(new_cat->order, old->order, pos * sizeof(uint32_t));
+	new_cat->order[pos] = idx;					// keep the ID order
+	memcpy(new_cat->order + pos + 1, old->order + pos, (old->size - pos) * sizeof(uint32_t));
+
+	sh->tree_gen++;						// copy the search path, never mutate in place
+	new_cat->root = InsertTree(old->root, id, idx);
+
+	lsn = wal_append(_wal_list_, id, amount, price);	// logged before trades see it
+	publish(sh, old, new_cat);
+	V(&sh->admin);
+	change_end();
+	wal_wait(lsn);
+
+	return _ok_;
+}
+
+/* Remove an item while readers keep going */
+stock_result stock_delist(int id) {
+	Shard *sh = shard_of(id);
+	Catalog *old, *new_cat;
+	Node *node;
+	uint32_t j = 0;
+	uint64_t lsn;
+
+	change_begin();
+	lock_wait(&sh->admin);
+	writer = sh;
+	old = sh->catalog;
+	if ((node = SearchTree(old->root, id)) == NULL) {
+		V(&sh->admin);
+		change_end();
+		return _no_item_;
+	}
+
+	new_cat = Malloc(sizeof(Catalog));
+	new_cat->size = old->size - 1;
+	new_cat->order = Malloc(old->size * sizeof(uint32_t));
+	for (uint32_t i = 0; i < old->size; i++)
+		if (old->order[i] != node->item)		// drop it from the index
+			new_cat->order[j++] = old->order[i];
+
+	sh->tree_gen++;
+	retire((void *)(uintptr_t)node->item, slab_release);	// buyers may still hold it
+	new_cat->root = DeleteTree(old->root, id);
+
+	publish(sh, old, new_cat);			// waits for the trades which found it,
+	lsn = wal_append(_wal_delist_, id, 0, 0);	// so their records come first
+	V(&sh->admin);
+	change_end();
+	wal_wait(lsn);
+
+	return _ok_;
+}
+
+/* Format every item as 'ID left_stock price' lines (routine of 'Reader') */
+char *stock_show(size_t *len, size_t slack) {
+	return catalog_format(INT_MIN, INT_MAX, len, slack, stock_size() >= SCAN_MIN);
+}
+
+/* Format the items with IDs lo..hi as 'show' does; each shard walks only
+   its run of the ID-ordered index, found by binary search */
+char *stock_show_range(int lo, int hi, size_t *len, size_t slack) {
+	return catalog_format(lo, hi, len, slack, stock_size() >= SCAN_MIN);
+}
+
+/* Format the items (IDs lo..hi) of the shards i with i mod 'parts' ==
+   'part', the share of one owner when each owns some shards (see
+   stock_shard) */
+char *stock_show_part(int part, int parts, int lo, int hi, size_t *len) {
+	ScanPart *p = scan_parts(lo, hi);
+	char *buf;
+
+	for (int i = part; i < nshards; i += parts)
+		shard_format(i, p);
+	buf = merge_parts(p, part, parts, len, 0);	// in ID order, as 'show'
+
+	Free(p);
+	return buf;
+}
+
+/* Merge 'n' texts of 'show' lines, each sorted by ID, into one sorted by
+   ID, with 'slack' spare bytes (the texts stay with the caller) */
+char *stock_merge(char **text, size_t *lens, int n, size_t *len, size_t slack) {
+	size_t *pos = Calloc(n + 1, sizeof(size_t)), total = 0, off = 0;
+	long *head = Malloc((n + 1) * sizeof(long));
+	char *buf;
+
+	for (int i = 0; i < n; i++) {				// ID of the first line of each
+		total += lens[i];
+		head[i] = lens[i] > 0 ? strtol(text[i], NULL, 10) : LONG_MAX;
+	}
+	buf = Malloc(total + slack + 1);
+	while (off < total) {
+		int from = 0;
+		char *line, *end;
+
+		for (int i = 1; i < n; i++)				// smallest head of the texts
+			if (head[i] < head[from])
+				from = i;
+		line = text[from] + pos[from];
+		if ((end = memchr(line, '\n', lens[from] - pos[from])) == NULL)
+			end = text[from] + lens[from] - 1;	// (a last line without '\n')
+		memcpy(buf + off, line, end + 1 - line);
+		off += end + 1 - line;
+		pos[from] += end + 1 - line;
+		head[from] = pos[from] < lens[from] ? strtol(text[from] + pos[from], NULL, 10) : LONG_MAX;
+	}
+
+	Free(pos);
+	Free(head);
+	*len = total;
+	return buf;
+}
+
+/* Return the index of the shard which owns item 'id' */
+int stock_shard(int id) {
+	return shard_of(id) - shards;
+}
+
+/* Return the number of shards */
+int stock_shards(void) {
+	return nshards;
+}
+
+/* Return the number of listed items */
+uint32_t stock_size(void) {
+	uint32_t size = 0;
+
+	for (int i = 0; i < nshards; i++)
+		size += __atomic_load_n(&shards[i].catalog, __ATOMIC_ACQUIRE)->size;
+	return size;
+}
+/***           Store Routines End              ***/
+
+
+
+/***        Subroutines for the Shards         ***/
+/* Fibonacci hashing of an ID (the high bits are the well mixed ones) */
+static uint32_t hash_id(int id) {
+	return (uint32_t)id * 2654435761u;
+}
+
+/* Return the shard which owns item 'id' */
+static Shard *shard_of(int id) {
+	return &shards[shard_bits ? hash_id(id) >> (32 - shard_bits) : 0];
+}
+
+/* Return the stripe of writers of item 'id' */
+static Stripe *stripe_of(Shard *sh, int id) {
+	return &sh->stripe[(hash_id(id) >> 8) & (NSTRIPES - 1)];
+}
+
+/* Add 'delta' to the left_stock of item 'id' (never below zero) */
+static stock_result trade(int id, int delta) {
+	Shard *sh = shard_of(id);
+	FCRecord rec;
+	Stripe *st;
+	Node *node;
+
+	if (stock_sequenced)
+		return sequence(id, delta);		// applied by the sequencer thread
+	change_begin();
+	rcu_read_lock();
+	node = SearchTree(__atomic_load_n(&sh->catalog, __ATOMIC_ACQUIRE)->root, id);
+	if (node == NULL) {					// the item is not (or no longer) listed
+		rcu_read_unlock();
+		change_end();
+		return _no_item_;
+	}
+
+	rec.chunk = slab_chunk(&sh->slab, node->item);
+	rec.slot = SLAB_SLOT(node->item);
+	rec.id = id;
+	rec.delta = delta;
+	st = stripe_of(sh, id);
+	if (stock_owned)
+		apply(&rec);					// we are the only writer of the shard
+	else if (stock_combining) {
+		uint64_t start = nsec();
+
+		rec.result = combine(st, &rec);			// the item stays alive until
+		stock_waited += nsec() - start;			// the combiner is done with it
+	}
+	else {
+		lock_wait(&st->w);				// mutual exclusion for the stripe of the item
+		apply(&rec);					// only one writer can access at one time
+		V(&st->w);
+	}
+	rcu_read_unlock();					// (logged by apply, in the order applied)
+	change_end();
+	wal_wait(rec.lsn);
+
+	return rec.result;
+}
+
+/* P(s), adding the time it blocks (if it does) to 'stock_waited' */
+static void lock_wait(sem_t *s) {
+	uint64_t start;
+
+	if (sem_trywait(s) == 0)
+		return;							// (free: no clock is read)
+	start = nsec();
+	P(s);
+	stock_waited += nsec() - start;
+}
+
+/* Format the items of shard 'i' (IDs parts[i].lo..hi) into parts[i] (lock-free) */
+static void shard_format(int i, void *arg) {
+	ScanPart *part = &((ScanPart *)arg)[i];
+	Shard *sh = &shards[i];
+	uint32_t first, last;
+	Catalog *cat;
+
+	rcu_read_lock();							// the catalog can't be freed under us
+	cat = __atomic_load_n(&sh->catalog, __ATOMIC_ACQUIRE);
+	first = (part->lo == INT_MIN) ? 0 : order_search(sh, cat, part->lo);
+	last = (part->hi == INT_MAX) ? cat->size : order_search(sh, cat, part->hi + 1);
+	if (last < first)
+		last = first;							// (lo > hi)
+	part->size = (size_t)(last - first) * 24 + 64;
+	part->buf = Malloc(part->size);
+	part->id = Malloc((last - first) * sizeof(int) + 1);
+	part->end = Malloc((last - first) * sizeof(uint32_t) + 1);
+	part->lines = last - first;
+	for (uint32_t j = first; j < last; j++) {	// sequential walk in ID order
+		uint32_t idx = cat->order[j];
+		ItemChunk *c = slab_chunk(&sh->slab, idx);
+		int left_stock, price;
+		char *p;
+
+		read_item(c, SLAB_SLOT(idx), &left_stock, &price);	// lock-free snapshot
+
+		if (part->len + 3 * 12 > part->size)	// room for the longest line
+			part->buf = Realloc(part->buf, part->size *= 2);
+		p = format_int(part->buf + part->len, c->ID[SLAB_SLOT(idx)]);
+		*p++ = ' ';
+		p = format_int(p, left_stock);			// transform integer into string
+		*p++ = ' ';
+		p = format_int(p, price);
+		*p++ = '\n';
+		part->len = p - part->buf;
+		part->id[j - first] = c->ID[SLAB_SLOT(idx)];
+		part->end[j - first] = part->len;
+	}
+	rcu_read_unlock();
+}
+
+/* Format the IDs lo..hi of every shard, by the scan helpers too if
+   'parallel' ('slack' spare bytes) */
+static char *catalog_format(int lo, int hi, size_t *len, size_t slack, int parallel) {
+	ScanPart *parts = scan_parts(lo, hi);
+	char *buf;
+
+	if (parallel)
+		scan_run(shard_format, parts);			// shards are formatted in parallel
+	else
+		for (int i = 0; i < nshards; i++)
+			shard_format(i, parts);
+
+	buf = merge_parts(parts, 0, 1, len, slack);	// (shards hash the IDs)
+
+	Free(parts);
+	return buf;
+}
+
+/* Allocate the parts of a scan of the IDs lo..hi */
+static ScanPart *scan_parts(int lo, int hi) {
+	ScanPart *parts = Calloc(nshards, sizeof(ScanPart));
+
+	for (int i = 0; i < nshards; i++) {
+		parts[i].lo = lo;
+		parts[i].hi = hi;
+	}
+	return parts;
+}
+
+/* Return the position in the index of 'cat' of the first ID >= 'id' */
+static uint32_t order_search(Shard *sh, Catalog *cat, int id) {
+	uint32_t pos = 0, hi = cat->size;
+
+	while (pos < hi) {							// binary search
+		uint32_t mid = (pos + hi) / 2, k = cat->order[mid];
+
+		if (slab_chunk(&sh->slab, k)->ID[SLAB_SLOT(k)] < id)
+			pos = mid + 1;
+		else
+			hi = mid;
+	}
+	return pos;
+}
+
+/* Merge the lines of parts[first], parts[first + step], ... (each sorted
+   by ID) into one text sorted by ID, with 'slack' spare bytes; the parts
+   are freed */
+static char *merge_parts(ScanPart *parts, int first, int step, size_t *len, size_t slack) {
+	int *from = Malloc(nshards * sizeof(int)), *head = Malloc(nshards * sizeof(int)), n = 0;
+	uint32_t *next = Calloc(nshards, sizeof(uint32_t));
+	size_t total = 0, off = 0;
+	char *buf;
+
+	for (int i = first; i < nshards; i += step)
+		if (parts[i].lines > 0) {
+			head[n] = parts[i].id[0];
+			from[n++] = i;
+			total += parts[i].len;
+		}
+	buf = Malloc(total + slack + 1);
+	while (n > 0) {
+		int k = 0;
+		ScanPart *p;
+		uint32_t start;
+
+		for (int j = 1; j < n; j++)				// smallest head of the parts
+			if (head[j] < head[k])
+				k = j;
+		p = &parts[from[k]];
+		start = next[k] ? p->end[next[k] - 1] : 0;
+		memcpy(buf + off, p->buf + start, p->end[next[k]] - start);
+		off += p->end[next[k]] - start;
+		if (++next[k] < p->lines)
+			head[k] = p->id[next[k]];
+		else {									// drained: drop it
+			n--;
+			from[k] = from[n];
+			next[k] = next[n];
+			head[k] = head[n];
+		}
+	}
+
+	for (int i = first; i < nshards; i += step) {
+		Free(parts[i].buf);
+		Free(parts[i].id);
+		Free(parts[i].end);
+	}
+	Free(from);
+	Free(head);
+	Free(next);
+	*len = total;
+	return buf;
+}
+
+/* Publish a new catalog of a shard, then free the old one after a grace period */
+static void publish(Shard *sh, Catalog *old, Catalog *new_cat) {
+	__atomic_store_n(&sh->catalog, new_cat, __ATOMIC_RELEASE);	// publish!
+	retire(old->order, free);
+	retire(old, free);
+	reclaim(sh);						// wait for old readers, then free
+}
+/***      Subroutines for the Shards End       ***/
+
+
+
+/***     Subroutines for 'Flat Combining'      ***/
+/* Post a buy/sell to the stripe and wait until some combiner applies it */
+static stock_result combine(Stripe *st, FCRecord *req) {
+	FCRecord rec = *req;
+	int spins = 0;
+
+	rec.done = 0;
+	rec.next = __atomic_load_n(&st->pub, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&st->pub, &rec.next, &rec, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;										// publish the request
+
+	while (!__atomic_load_n(&rec.done, __ATOMIC_ACQUIRE)) {
+		if (!__atomic_load_n(&st->lock, __ATOMIC_RELAXED) &&
+				!__atomic_exchange_n(&st->lock, 1, __ATOMIC_ACQUIRE)) {
+			int passes = 0;					// we are the combiner now
+
+			do {
+				FCRecord *batch = __atomic_exchange_n(&st->pub, NULL, __ATOMIC_ACQUIRE);
+				FCRecord *order = NULL;
+
+				while (batch) {				// reverse into arrival order
+					FCRecord *next = batch->next;
+
+					batch->next = order;
+					order = batch;
+					batch = next;
+				}
+				while (order) {				// apply the whole batch
+					FCRecord *next = order->next;	// (order dies once done)
+
+					apply(order);
+					__atomic_store_n(&order->done, 1, __ATOMIC_RELEASE);
+					order = next;
+				}
+			} while (!__atomic_load_n(&rec.done, __ATOMIC_RELAXED) || (++passes < FC_PASSES
+					&& __atomic_load_n(&st->pub, __ATOMIC_RELAXED) != NULL));
+
+			__atomic_store_n(&st->lock, 0, __ATOMIC_RELEASE);
+			break;
+		}
+
+		if (++spins > FC_SPINS)				// let the combiner run
+			sched_yield();
+	}
+
+	req->lsn = rec.lsn;
+	return rec.result;
+}
+
+/* Apply a buy/sell and log it (caller holds the stripe, so the records
+   of an item are in the order it changed: a buy may need the sell before) */
+static void apply(FCRecord *rec) {
+	ItemChunk *c = rec->chunk;
+	uint32_t i = rec->slot;
+
+	rec->lsn = 0;
+	if (c->left_stock[i] + rec->delta < 0)
+		rec->result = _not_enough_;
+	else {
+		write_begin(c, i);					// readers will retry from now on
+		__atomic_store_n(&c->left_stock[i], c->left_stock[i] + rec->delta, __ATOMIC_RELAXED);
+		write_end(c, i);					// update the left_stock
+		rec->result = _ok_;
+		rec->lsn = wal_append(rec->delta < 0 ? _wal_buy_ : _wal_sell_, rec->id,
+				abs(rec->delta), 0);
+	}
+}
+/***   Subroutines for 'Flat Combining' End    ***/
+
+
+
+/***       Subroutines for the Sequencer       ***/
+/* Post a buy/sell to the ring and wait until the sequencer has applied
+   it (positions are claimed in order; the sequencer applies them so) */
+static stock_result sequence(int id, int delta) {
+	uint64_t pos;
+	uint32_t p;
+	SeqSlot *s;
+	stock_result result;
+	uint64_t lsn, start;
+
+	pthread_once(&seq_once, seq_start);
+	change_begin();						// (a checkpoint waits for the whole trade)
+	start = nsec();
+	pos = __atomic_fetch_add(&seq_claim, 1, __ATOMIC_RELAXED);
+	s = &seq_ring[pos & (SEQ_SIZE - 1)];
+	p = (uint32_t)pos;
+
+	seq_wait(s, p);						// the poster of the last lap is gone
+	s->id = id;
+	s->delta = delta;
+	__atomic_store_n(&s->seq, p + 1, __ATOMIC_SEQ_CST);	// posted
+	if (__atomic_load_n(&seq_idle, __ATOMIC_SEQ_CST)) {	// (it sees the post, or we see
+		__atomic_add_fetch(&seq_bell, 1, __ATOMIC_SEQ_CST);	// that it sleeps)
+		syscall(SYS_futex, &seq_bell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+
+	seq_wait(s, p + 2);					// applied
+	stock_waited += nsec() - start;
+	result = s->result;
+	lsn = s->lsn;
+	seq_set(s, p + SEQ_SIZE);			// free for the next lap
+	change_end();
+	wal_wait(lsn);
+
+	return result;
+}
+
+/* Allocate the ring and start the sequencer (once) */
+static void seq_start(void) {
+	pthread_t tid;
+
+	if ((seq_ring = aligned_alloc(64, SEQ_SIZE * sizeof(SeqSlot))) == NULL)
+		unix_error("aligned_alloc error");
+	memset(seq_ring, 0, SEQ_SIZE * sizeof(SeqSlot));
+	for (uint32_t i = 0; i < SEQ_SIZE; i++)
+		seq_ring[i].seq = i;					// free for the first lap
+	Pthread_create(&tid, NULL, sequencer, NULL);
+}
+
+/* Thread routine of the sequencer: apply the posted trades in position
+   order, a run of them per read-side critical section */
+static void *sequencer(void *vargp) {
+	uint64_t pos = 0;
+	int spins = 0;
+
+	Pthread_detach(pthread_self());
+	rcu_register();
+	while (1) {
+		int n = 0;
+
+		while (n < SEQ_BATCH && __atomic_load_n(&seq_ring[(pos + n) & (SEQ_SIZE - 1)].seq,
+				__ATOMIC_ACQUIRE) == (uint32_t)(pos + n) + 1)
+			n++;								// the run of posted slots
+		if (n == 0) {							// nothing yet: poll, then sleep on the bell
+			uint32_t bell;
+
+			if (++spins < FC_SPINS)
+				continue;
+			__atomic_store_n(&seq_idle, 1, __ATOMIC_SEQ_CST);
+			bell = __atomic_load_n(&seq_bell, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&seq_ring[pos & (SEQ_SIZE - 1)].seq, __ATOMIC_SEQ_CST)
+					!= (uint32_t)pos + 1)
+				syscall(SYS_futex, &seq_bell, FUTEX_WAIT_PRIVATE, bell, NULL, NULL, 0);
+			__atomic_store_n(&seq_idle, 0, __ATOMIC_RELAXED);
+			spins = 0;
+			continue;
+		}
+		spins = 0;
+
+		rcu_read_lock();						// (no item is freed meanwhile)
+		for (int i = 0; i < n; i++)
+			seq_apply(&seq_ring[(pos + i) & (SEQ_SIZE - 1)]);
+		rcu_read_unlock();
+		for (int i = 0; i < n; i++)
+			seq_set(&seq_ring[(pos + i) & (SEQ_SIZE - 1)], (uint32_t)(pos + i) + 2);
+		pos += n;
+	}
+
+	return NULL;
+}
+
+/* Apply one posted trade (the sequencer is the only writer of left_stock,
+   so it takes no lock); apply logs it in the order of the ring */
+static void seq_apply(SeqSlot *s) {
+	Node *node = SearchTree(__atomic_load_n(&shard_of(s->id)->catalog,
+			__ATOMIC_ACQUIRE)->root, s->id);
+	FCRecord rec;
+
+	s->lsn = 0;
+	if (node == NULL) {
+		s->result = _no_item_;
+		return;
+	}
+	rec.chunk = slab_chunk(&shard_of(s->id)->slab, node->item);
+	rec.slot = SLAB_SLOT(node->item);
+	rec.id = s->id;
+	rec.delta = s->delta;
+	apply(&rec);
+	s->result = rec.result;
+	s->lsn = rec.lsn;
+}
+
+/* Wait until the state of slot 's' is 'want': poll, then sleep on it */
+static void seq_wait(SeqSlot *s, uint32_t want) {
+	uint32_t state;
+
+	for (int spins = 0; spins < FC_SPINS; spins++)
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == want)
+			return;
+
+	__atomic_add_fetch(&s->waiting, 1, __ATOMIC_SEQ_CST);
+	while ((state = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST)) != want)
+		syscall(SYS_futex, &s->seq, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+	__atomic_sub_fetch(&s->waiting, 1, __ATOMIC_RELAXED);
+}
+
+/* Move slot 's' to 'state' and wake whoever sleeps on it */
+static void seq_set(SeqSlot *s, uint32_t state) {
+	__atomic_store_n(&s->seq, state, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &s->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+/***     Subroutines for the Sequencer End     ***/
+
+
+
+/***   Subroutines for Whole-Catalog Scans     ***/
+/* Run fn(i, arg) for every shard i, helped by idle scanner threads */
+static void scan_run(void (*fn)(int, void *), void *arg) {
+	ScanJob *job = Malloc(sizeof(ScanJob));
+	int helpers = 0;
+
+	job->fn = fn;
+	job->arg = arg;
+	job->next = job->done = 0;
+	job->refcnt = 1;
+	Sem_init(&job->finished, 0, 0);
+
+	while (helpers < NSCANNERS && sem_trywait(&scan_slots) == 0) {
+		__atomic_add_fetch(&job->refcnt, 1, __ATOMIC_RELAXED);
+		P(&scan_mutex);						// hand the job to a helper
+		scan_queue[(++scan_rear) % NSCANNERS] = job;
+		V(&scan_mutex);
+		V(&scan_items);
+		helpers++;
+	}
+
+	scan_work(job);							// the caller takes shards as well
+	P(&job->finished);						// wait for shards taken by helpers
+	scan_put(job);
+}
+
+/* Take shards of a job until none is left */
+static void scan_work(ScanJob *job) {
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_ACQ_REL)) < nshards) {
+		job->fn(i, job->arg);
+		if (__atomic_add_fetch(&job->done, 1, __ATOMIC_ACQ_REL) == nshards)
+			V(&job->finished);
+	}
+}
+
+/* Drop a reference to a job, the last participant frees it */
+static void scan_put(ScanJob *job) {
+	if (__atomic_sub_fetch(&job->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		sem_destroy(&job->finished);
+		Free(job);
+	}
+}
+
+/* Thread routine of the scan helpers */
+static void *scanner(void *vargp) {
+	Pthread_detach(pthread_self());
+	rcu_register();							// helpers read the catalog too
+
+	while (1) {
+		ScanJob *job;
+
+		P(&scan_items);
+		P(&scan_mutex);
+		job = scan_queue[(++scan_front) % NSCANNERS];
+		V(&scan_mutex);
+		V(&scan_slots);
+
+		scan_work(job);						// (the job may be over already)
+		scan_put(job);
+	}
+
+	return NULL;
+}
+/*** Subroutines for Whole-Catalog Scans End   ***/
+
+
+
+/***      Subroutines for 'Sequence Lock'      ***/
+/* Read a consistent (left_stock, price) pair without blocking any writer */
+static void read_item(ItemChunk *c, uint32_t i, int *left_stock, int *price) {
+	unsigned seq1, seq2;
+
+	do {
+		while ((seq1 = __atomic_load_n(&c->seq[i], __ATOMIC_ACQUIRE)) & 1)
+			;								// a writer is in progress, wait for it
+		*left_stock = __atomic_load_n(&c->left_stock[i], __ATOMIC_RELAXED);
+		*price = __atomic_load_n(&c->price[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&c->seq[i], __ATOMIC_RELAXED);
+	} while (seq1 != seq2);					// retry if a writer slipped in
+}
+
+/* Mark the start of an update (caller holds the stripe of the item) */
+static void write_begin(ItemChunk *c, uint32_t i) {
+	__atomic_store_n(&c->seq[i], c->seq[i] + 1, __ATOMIC_RELAXED);	// odd
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Mark the end of an update, publishing the new values to readers */
+static void write_end(ItemChunk *c, uint32_t i) {
+	__atomic_store_n(&c->seq[i], c->seq[i] + 1, __ATOMIC_RELEASE);	// even
+}
+/***    Subroutines for 'Sequence Lock' End    ***/
+
+
+
+/***     Subroutines for Decimal Formatting    ***/
+/* Write 'v' in decimal at 'dst' and return the end (no '\0', 11 bytes at most) */
+static char *format_int(char *dst, int v) {
+	uint32_t u = (uint32_t)v;
+
+	if (v < 0) {
+		*dst++ = '-';
+		u = 0u - u;
+	}
+	if (u >= 100000000) {					// 9 or 10 digits: 1-2 leading ones
+		uint32_t hi = u / 100000000;		// and then exactly 8 more
+
+		if (hi >= 10)
+			*dst++ = '0' + hi / 10;
+		*dst++ = '0' + hi % 10;
+		return format_digits(dst, u % 100000000, 8);
+	}
+	return format_digits(dst, u, 0);
+}
+
+/* Convert u < 10^8 into 8 digits at once inside one 64-bit word (SWAR),
+   then write the last 'width' of them (0: drop the leading zeros) */
+static char *format_digits(char *dst, uint32_t u, int width) {
+	uint64_t x = (u / 10000) | ((uint64_t)(u % 10000) << 32);	// 4 + 4 digits
+	uint64_t y;
+	char digits[8];
+
+	y = ((x * 10486) >> 20) & 0x0000007F0000007FULL;	// x / 100 in every half
+	x = y | ((x - y * 100) << 16);						// 2 + 2 + 2 + 2 digits
+	y = ((x * 103) >> 10) & 0x000F000F000F000FULL;		// x / 10 in every quarter
+	x = y | ((x - y * 10) << 8);						// one digit per byte, the
+														// most significant one first
+	if (width == 0)
+		width = x ? 8 - __builtin_ctzll(x) / 8 : 1;		// leading zeros are low bytes
+	x |= 0x3030303030303030ULL;							// into ASCII
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	memcpy(digits, &x, 8);
+	memcpy(dst, digits + 8 - width, width);
+
+	return dst + width;
+}
+/***  Subroutines for Decimal Formatting End   ***/
+
+
+
+/***         Subroutines for Checkpoints       ***/
+/* Enter a change, after a checkpoint which is pausing writers */
+static void change_begin(void) {
+	while (1) {
+		uint64_t start;
+
+		__atomic_store_n(&my_slot->changing, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&writers_paused, __ATOMIC_SEQ_CST))
+			return;						// (the pauser sees us, or we see it)
+
+		start = nsec();
+		__atomic_store_n(&my_slot->changing, 0, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&writers_paused, __ATOMIC_ACQUIRE))
+			sched_yield();
+		stock_waited += nsec() - start;
+	}
+}
+
+/* Leave a change (its record is in the log by now) */
+static void change_end(void) {
+	__atomic_store_n(&my_slot->changing, 0, __ATOMIC_RELEASE);
+}
+
+/* Hold new changes and wait until the running ones are done */
+static void pause_writers(void) {
+	__atomic_add_fetch(&writers_paused, 1, __ATOMIC_SEQ_CST);
+	for (EpochSlot *s = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE); s; s = s->next)
+		while (__atomic_load_n(&s->changing, __ATOMIC_SEQ_CST))
+			sched_yield();
+}
+
+/* Let the held changes go on */
+static void resume_writers(void) {
+	__atomic_sub_fetch(&writers_paused, 1, __ATOMIC_RELEASE);
+}
+
+/* Write 'head' and 'buf' into a new file, then put it in place of
+   'filename' by rename (never exits, so a forked child may call it) */
+static int write_file(char *filename, void *head, size_t hlen, void *buf, size_t len) {
+	char tmp[MAXLINE], dir[MAXLINE];
+	char *slash;
+	int fd, ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", filename, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	ok = rio_writen(fd, head, hlen) == (ssize_t)hlen && rio_writen(fd, buf, len) == (ssize_t)len
+		&& fsync(fd) == 0;
+	if (close(fd) < 0 || !ok || rename(tmp, filename) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	strncpy(dir, filename, sizeof(dir) - 1);	// make the rename durable too
+	dir[sizeof(dir) - 1] = '\0';
+	if ((slash = strrchr(dir, '/')) != NULL)
+		*(slash == dir ? slash + 1 : slash) = '\0';
+	else
+		strcpy(dir, ".");
+	if ((fd = open(dir, O_RDONLY)) < 0)
+		return -1;
+	ok = fsync(fd) == 0;
+	close(fd);
+
+	return ok ? 0 : -1;
+}
+
+/* Return the monotonic time in seconds */
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Return the monotonic time in nanoseconds */
+static uint64_t nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/***       Subroutines for Checkpoints End     ***/
+
+
+/***   Subroutines for Snapshots and Replay    ***/
+/* Copy the items of shard 'i' as rows in ID order (scan routine) */
+static void shard_rows(int i, void *arg) {
+	ScanPart *part = &((ScanPart *)arg)[i];
+	Shard *sh = &shards[i];
+	Catalog *cat;
+	Item *rows;
+
+	rcu_read_lock();
+	cat = __atomic_load_n(&sh->catalog, __ATOMIC_ACQUIRE);
+	part->len = (size_t)cat->size * sizeof(Item);
+	rows = Malloc(part->len + 1);
+	for (uint32_t j = 0; j < cat->size; j++) {
+		uint32_t idx = cat->order[j];
+		ItemChunk *c = slab_chunk(&sh->slab, idx);
+
+		rows[j].ID = c->ID[SLAB_SLOT(idx)];
+		read_item(c, SLAB_SLOT(idx), &rows[j].left_stock, &rows[j].price);
+	}
+	rcu_read_unlock();
+	part->buf = (char *)rows;
+}
+
+/* Return every item as rows sorted by ID (merge of the sorted shards) */
+static Item *catalog_rows(uint32_t *n, int parallel) {
+	ScanPart *parts = Calloc(nshards, sizeof(ScanPart));
+	uint32_t *next = Calloc(nshards, sizeof(uint32_t));
+	uint32_t total = 0;
+	Item *rows;
+
+	if (parallel)
+		scan_run(shard_rows, parts);
+	else
+		for (int i = 0; i < nshards; i++)
+			shard_rows(i, parts);
+
+	for (int i = 0; i < nshards; i++)
+		total += parts[i].len / sizeof(Item);
+	rows = Malloc((size_t)total * sizeof(Item) + 1);
+	for (uint32_t k = 0; k < total; k++) {
+		Item *min = NULL;
+		int from = 0;
+
+		for (int i = 0; i < nshards; i++) {		// smallest head of the shards
+			Item *head = (Item *)parts[i].buf + next[i];
+
+			if (next[i] < parts[i].len / sizeof(Item) && (!min || head->ID < min->ID)) {
+				min = head;
+				from = i;
+			}
+		}
+		rows[k] = *min;
+		next[from]++;
+	}
+
+	for (int i = 0; i < nshards; i++)
+		Free(parts[i].buf);
+	Free(parts);
+	Free(next);
+	*n = total;
+	return rows;
+}
+
+/* Write header and rows of a binary snapshot (never exits) */
+static int write_snapshot(char *filename, Item *rows, uint32_t n, uint64_t lsn) {
+	SnapHeader hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAP_VERSION;
+	hdr.item_size = sizeof(Item);
+	hdr.count = n;
+	hdr.lsn = lsn;
+	hdr.data_check = snap_checksum(rows, (size_t)n * sizeof(Item));
+	hdr.header_check = snap_checksum(&hdr, offsetof(SnapHeader, header_check));
+
+	return write_file(filename, &hdr, sizeof(hdr), rows, (size_t)n * sizeof(Item));
+}
+
+/* Return why a mapped snapshot of 'size' bytes can't be loaded, or NULL */
+static char *snap_verify(SnapHeader *hdr, size_t size) {
+	Item *rows = (Item *)(hdr + 1);
+
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)))
+		return "not a snapshot";
+	if (hdr->header_check != snap_checksum(hdr, offsetof(SnapHeader, header_check)))
+		return "header checksum";
+	if (hdr->version != SNAP_VERSION || hdr->item_size != sizeof(Item))
+		return "unknown version";
+	if (hdr->count > UINT32_MAX || size != sizeof(SnapHeader) + hdr->count * sizeof(Item))
+		return "truncated";
+	if (hdr->data_check != snap_checksum(rows, hdr->count * sizeof(Item)))
+		return "data checksum";
+	for (uint64_t i = 1; i < hdr->count; i++)
+		if (rows[i - 1].ID >= rows[i].ID)
+			return "unsorted";
+
+	return NULL;
+}
+
+/* Fletcher-64 checksum over the 32-bit words of 'buf' */
+static uint64_t snap_checksum(const void *buf, size_t len) {
+	const uint32_t *w = buf;
+	size_t n = len / sizeof(uint32_t);
+	uint64_t a = 0, b = 0;
+
+	while (n > 0) {
+		size_t block = n < 4096 ? n : 4096;	// sums can't overflow within a block
+
+		n -= block;
+		while (block--) {
+			a += *w++;
+			b += a;
+		}
+		a %= 0xFFFFFFFFu;
+		b %= 0xFFFFFFFFu;
+	}
+
+	return (b << 32) | a;
+}
+
+/* Apply the records of shard 'i' in LSN order (a change touches one item,
+   so shards commute) */
+static void replay_shard(int i, void *arg) {
+	ReplayJob *job = arg;
+	uint32_t failed = 0;
+
+	for (size_t j = job->start[i]; j < job->start[i + 1]; j++) {
+		WalRecord *r = &job->recs[job->order[j]];
+		stock_result res = _ok_;
+
+		switch (r->op) {
+		case _wal_buy_: res = stock_buy(r->id, r->amount); break;
+		case _wal_sell_: res = stock_sell(r->id, r->amount); break;
+		case _wal_list_: res = stock_list(r->id, r->amount, r->price); break;
+		case _wal_delist_: res = stock_delist(r->id); break;
+		}
+		failed += (res != _ok_);
+	}
+	__atomic_add_fetch(&job->failed, failed, __ATOMIC_RELAXED);
+}
+/*** Subroutines for Snapshots and Replay End  ***/
+
+
+/***        Subroutines for Bulk Loading       ***/
+/* Load text (or rows) into the empty shards (no reader yet): parse the
+   parts, scatter the rows by shard, then sort and build every shard */
+static void load_catalog(char *filename, char *text, size_t len, Item *rows, uint32_t n) {
+	LoadJob job;
+	uint32_t *total;
+
+	memset(&job, 0, sizeof(job));
+	job.text = text;
+	job.len = len;
+	job.sorted = (text == NULL);
+	job.parsed = Calloc(nshards, sizeof(Item *));
+	job.nparsed = Calloc(nshards, sizeof(uint32_t));
+	job.counts = Calloc((size_t)nshards * nshards, sizeof(uint32_t));
+	job.rows = Calloc(nshards, sizeof(Item *));
+	job.nrows = total = Calloc(nshards, sizeof(uint32_t));
+	if (text == NULL)
+		for (int i = 0; i < nshards; i++) {		// split the given rows evenly
+			job.parsed[i] = rows + (uint64_t)n * i / nshards;
+			job.nparsed[i] = (uint64_t)n * (i + 1) / nshards - (uint64_t)n * i / nshards;
+		}
+
+	scan_run(load_parse, &job);					// counts of every (part, shard)
+
+	for (int s = 0; s < nshards; s++)			// counts into offsets
+		for (int i = 0; i < nshards; i++) {
+			uint32_t c = job.counts[i * nshards + s];
+
+			job.counts[i * nshards + s] = total[s];
+			total[s] += c;
+		}
+	for (int s = 0; s < nshards; s++)
+		job.rows[s] = Malloc((size_t)total[s] * sizeof(Item) + 1);
+
+	scan_run(load_scatter, &job);				// parts keep their order in a shard
+	if (text != NULL)
+		for (int i = 0; i < nshards; i++)
+			Free(job.parsed[i]);
+	scan_run(load_build, &job);
+
+	if (job.dup) {
+		fprintf(stderr, "The '%s' file lists the ID %d twice.\n", filename, job.dup_id);
+		exit(0);
+	}
+	for (int i = 0; i < nshards; i++)
+		reclaim(&shards[i]);				// no reader yet, frees old directories
+	Free(job.parsed);
+	Free(job.nparsed);
+	Free(job.counts);
+	Free(job.rows);
+	Free(job.nrows);
+}
+
+/* Parse part 'i' of the text into rows and count them by shard (scan routine) */
+static void load_parse(int i, void *arg) {
+	LoadJob *job = arg;
+	uint32_t *counts = &job->counts[i * nshards];
+
+	if (job->text != NULL) {
+		char *p = line_start(job, i), *end = line_start(job, i + 1);
+		uint32_t n = 0, capacity = (end - p) / 16 + 16;
+		Item *rows = Malloc(capacity * sizeof(Item));
+
+		while (p < end) {
+			char *eol = memchr(p, '\n', end - p), *q;
+			Item r;
+
+			if (eol == NULL)
+				eol = end;
+			if (*p != '#' && (q = parse_int(p, eol, &r.ID)) != NULL	// skip header
+					&& (q = parse_int(q, eol, &r.left_stock)) != NULL	// and blank lines
+					&& parse_int(q, eol, &r.price) != NULL
+					&& r.ID >= stock_lo && r.ID <= stock_hi) {
+				if (n == capacity)
+					rows = Realloc(rows, (capacity *= 2) * sizeof(Item));
+				rows[n++] = r;
+			}
+			p = eol + 1;
+		}
+		job->parsed[i] = rows;
+		job->nparsed[i] = n;
+	}
+
+	for (uint32_t j = 0; j < job->nparsed[i]; j++)
+		counts[shard_of(job->parsed[i][j].ID) - shards]++;
+}
+
+/* Copy the rows of part 'i' to their shards, at the offsets of the part */
+static void load_scatter(int i, void *arg) {
+	LoadJob *job = arg;
+	uint32_t *next = &job->counts[i * nshards];
+
+	for (uint32_t j = 0; j < job->nparsed[i]; j++) {
+		Item *r = &job->parsed[i][j];
+		int s = shard_of(r->ID) - shards;
+
+		job->rows[s][next[s]++] = *r;
+	}
+}
+
+/* Sort the rows of shard 'i', fill its slab and index in ID order, and
+   build its tree balanced (scan routine) */
+static void load_build(int i, void *arg) {
+	LoadJob *job = arg;
+	Shard *sh = &shards[i];
+	Catalog *cat = sh->catalog;
+	Item *rows = job->rows[i];
+	uint32_t n = job->nrows[i];
+
+	writer = sh;
+	if (!job->sorted)
+		sort_rows(rows, n);
+	for (uint32_t j = 1; j < n; j++)
+		if (rows[j - 1].ID == rows[j].ID) {
+			job->dup_id = rows[j].ID;		// (any one of them is reported)
+			__atomic_store_n(&job->dup, 1, __ATOMIC_RELEASE);
+			Free(rows);
+			return;
+		}
+
+	cat->order = Realloc(cat->order, GetGreater(n, 1) * sizeof(uint32_t));
+	for (uint32_t j = 0; j < n; j++) {			// slab and index in ID order,
+		uint32_t idx = slab_alloc(&sh->slab);	// so scans are sequential
+		ItemChunk *c = slab_chunk(&sh->slab, idx);
+
+		c->ID[SLAB_SLOT(idx)] = rows[j].ID;
+		c->left_stock[SLAB_SLOT(idx)] = rows[j].left_stock;
+		c->price[SLAB_SLOT(idx)] = rows[j].price;
+		c->seq[SLAB_SLOT(idx)] = 0;				// even: no writer in progress
+		cat->order[j] = idx;
+	}
+	cat->size = n;
+	cat->root = BuildTree(rows, cat->order, 0, n);
+
+	Free(rows);
+}
+
+/* Return the first line of part 'i' of the text (parts split at line ends) */
+static char *line_start(LoadJob *job, int i) {
+	size_t off = job->len * i / nshards;
+	char *nl;
+
+	if (off == 0)
+		return job->text;
+	if ((nl = memchr(job->text + off - 1, '\n', job->len - off + 1)) == NULL)
+		return job->text + job->len;		// the line which crosses 'off' is
+	return nl + 1;							// taken by the part before
+}
+
+/* Parse a decimal integer after blanks at 'p' (before 'end'); return the
+   end of it, or NULL if there is none */
+static char *parse_int(char *p, char *end, int *v) {
+	uint32_t u = 0;
+	int neg;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if ((neg = (p < end && *p == '-')))
+		p++;
+	if (p == end || (unsigned)(*p - '0') > 9)
+		return NULL;
+	while (p < end && (unsigned)(*p - '0') <= 9)
+		u = u * 10 + (*p++ - '0');
+
+	*v = neg ? (int)(0u - u) : (int)u;
+	return p;
+}
+
+/* Sort rows by ID: LSD radix sort, 11 bits per pass (stable, O(n)) */
+static void sort_rows(Item *rows, uint32_t n) {
+	Item *tmp, *src = rows, *dst;
+
+	if (n < 2)
+		return;
+	dst = tmp = Malloc((size_t)n * sizeof(Item));
+	for (int shift = 0; shift < 32; shift += 11) {
+		uint32_t count[1 << 11] = { 0 }, sum = 0;
+		Item *swap;
+
+		for (uint32_t j = 0; j < n; j++)		// keys are IDs with the sign flipped
+			count[(((uint32_t)src[j].ID ^ 0x80000000u) >> shift) & 2047]++;
+		if (count[(((uint32_t)src[0].ID ^ 0x80000000u) >> shift) & 2047] == n)
+			continue;							// every key has the same digit
+		for (int d = 0; d < (1 << 11); d++) {
+			uint32_t c = count[d];
+
+			count[d] = sum;
+			sum += c;
+		}
+		for (uint32_t j = 0; j < n; j++)
+			dst[count[(((uint32_t)src[j].ID ^ 0x80000000u) >> shift) & 2047]++] = src[j];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != rows)
+		memcpy(rows, src, (size_t)n * sizeof(Item));
+	Free(tmp);
+}
+/***      Subroutines for Bulk Loading End     ***/
+
+
+
+/*** Subroutines for 'Read-Copy-Update' (RCU) ***/
+/* Register the calling thread as a reader of the catalog */
+void rcu_register(void) {
+	EpochSlot *slot;
+
+	for (slot = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+		int unused = 0;							// a slot left by a thread which
+												// has exited
+		if (__atomic_compare_exchange_n(&slot->used, &unused, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			my_slot = slot;
+			return;
+		}
+	}
+
+	slot = Calloc(1, sizeof(EpochSlot));
+	slot->used = 1;
+	slot->next = __atomic_load_n(&epoch_slots, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&epoch_slots, &slot->next, slot, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;										// lock-free push onto the slot list
+	my_slot = slot;
+}
+
+/* Give up the slot of the calling thread, which is about to exit */
+void rcu_unregister(void) {
+	__atomic_store_n(&my_slot->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&my_slot->used, 0, __ATOMIC_RELEASE);
+	my_slot = NULL;
+}
+
+/* Enter a read-side critical section (never blocks) */
+void rcu_read_lock(void) {
+	__atomic_store_n(&my_slot->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);					// announce before loading a catalog
+}
+
+/* Leave a read-side critical section */
+void rcu_read_unlock(void) {
+	__atomic_store_n(&my_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Wait until every reader which could see an old catalog has left */
+void synchronize_rcu(void) {
+	unsigned long epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+	for (EpochSlot *s = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE); s; s = s->next) {
+		unsigned long e;
+
+		while ((e = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST)) && e < epoch)
+			sched_yield();						// reader is still in an older epoch
+	}
+}
+
+/* Defer freeing of 'ptr' until the end of the next grace period */
+static void retire(void *ptr, void (*dtor)(void *)) {
+	Retired *r = Malloc(sizeof(Retired));
+
+	r->ptr = ptr;
+	r->dtor = dtor;
+	r->next = writer->retired;
+	writer->retired = r;
+}
+
+/* Free everything retired so far by the writer of a shard */
+static void reclaim(Shard *sh) {
+	if (sh->retired == NULL)
+		return;
+	synchronize_rcu();
+
+	writer = sh;								// (slab_release needs the shard)
+	while (sh->retired) {
+		Retired *r = sh->retired;
+
+		sh->retired = r->next;
+		r->dtor(r->ptr);
+		Free(r);
+	}
+}
+/*** Subroutines for 'Read-Copy-Update' End   ***/
+
+
+
+/***        Subroutines for the Item Slab      ***/
+/* Initialize an empty slab of 'shard' (chunks are allocated on demand) */
+static void slab_init(Slab *sp, int shard) {
+	sp->shard = shard;
+	sp->nchunks = 16;
+	sp->chunks = Calloc(sp->nchunks, sizeof(ItemChunk *));
+	sp->used = sp->nfree = sp->free_cap = 0;
+	sp->free = NULL;
+}
+
+/* Hand out a slot for a new item (called by the catalog writer) */
+static uint32_t slab_alloc(Slab *sp) {
+	uint32_t idx, chunk;
+
+	if (sp->nfree > 0)							// reuse a delisted slot first
+		return sp->free[--sp->nfree];
+
+	if (sp->used == UINT32_MAX)
+		app_error("Item slab is full");
+	idx = sp->used++;
+	chunk = idx >> SLAB_SHIFT;
+
+	if (chunk == sp->nchunks) {					// grow the chunk directory
+		ItemChunk **chunks = Calloc(2 * sp->nchunks, sizeof(ItemChunk *));
+
+		memcpy(chunks, sp->chunks, sp->nchunks * sizeof(ItemChunk *));
+		retire(sp->chunks, free);				// readers may still use the old one
+		__atomic_store_n(&sp->chunks, chunks, __ATOMIC_RELEASE);
+		sp->nchunks *= 2;
+	}
+	if (sp->chunks[chunk] == NULL)
+		__atomic_store_n(&sp->chunks[chunk], stock_alloc ? stock_alloc(sizeof(ItemChunk),
+				sp->shard) : Malloc(sizeof(ItemChunk)), __ATOMIC_RELEASE);
+
+	return idx;
+}
+
+/* Destructor for delisted items, the slot goes back to the free stack */
+static void slab_release(void *slot) {
+	Slab *sp = &writer->slab;
+
+	if (sp->nfree == sp->free_cap) {
+		sp->free_cap = GetGreater(16, 2 * sp->free_cap);
+		sp->free = Realloc(sp->free, sp->free_cap * sizeof(uint32_t));
+	}
+	sp->free[sp->nfree++] = (uint32_t)(uintptr_t)slot;
+}
+
+/* Translate a slab index into the chunk holding the item (row: SLAB_SLOT) */
+static ItemChunk *slab_chunk(Slab *sp, uint32_t idx) {
+	ItemChunk **chunks = __atomic_load_n(&sp->chunks, __ATOMIC_ACQUIRE);
+
+	return chunks[idx >> SLAB_SHIFT];
+}
+/***      Subroutines for the Item Slab End    ***/
+
+
+
+/***        Subroutines for the AVL Tree       ***/
+/* Build a perfectly balanced tree of sorted 'rows' [lo, hi) in O(n) */
+static Node* BuildTree(Item *rows, uint32_t *items, uint32_t lo, uint32_t hi) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	Node *node;
+
+	if (lo >= hi)
+		return NULL;
+
+	node = (Node*)Malloc(sizeof(Node));
+	node->ID = rows[mid].ID;
+	node->item = items[mid];
+	node->gen = writer->tree_gen;
+	node->left = BuildTree(rows, items, lo, mid);		// halves differ by one node
+	node->right = BuildTree(rows, items, mid + 1, hi);	// at most, so it is AVL
+	node->height = GetGreater(GetHeight(node->left), GetHeight(node->right)) + 1;
+	return node;
+}
+
+/* Node insertion routine of AVL tree (copies the search path) */
+static Node* InsertTree(Node* node, int id, uint32_t item) {
+	Node* new_node;
+
+	if (node == NULL) {								// if recursion met NULL,
+		new_node = (Node*)Malloc(sizeof(Node));		// create new node!
+		new_node->ID = id;
+		new_node->item = item;
+		new_node->height = 0;
+		new_node->gen = writer->tree_gen;
+		new_node->left = new_node->right = NULL;	// initialization routine
+		return new_node;
+	}
+
+	node = OwnNode(node);							// never touch a published node
+	if (id > node->ID) {
+		node->right = InsertTree(node->right, id, item);
+
+		if ((GetHeight(node->right) - GetHeight(node->left)) == 2) {
+			if (id > node->right->ID)
+				node = SingleRotateRight(node);
+			else
+				node = DoubleRotateRight(node);
+		}											// insertion algorithm of AVL tree
+	}
+	else if (id < node->ID) {
+		node->left = InsertTree(node->left, id, item);
+
+		if ((GetHeight(node->left) - GetHeight(node->right)) == 2) {
+			if (id < node->left->ID)
+				node = SingleRotateLeft(node);
+			else
+				node = DoubleRotateLeft(node);
+		}
+	}
+	else unix_error("Stock list in stock.txt has something wrong!\n");
+
+	node->height = GetGreater(GetHeight(node->left), GetHeight(node->right)) + 1;
+	// coordinates heights!
+	return node;
+}
+
+/* Node deletion routine of AVL tree (copies the search path) */
+static Node* DeleteTree(Node* node, int id) {
+	if (node == NULL)
+		return NULL;
+
+	node = OwnNode(node);
+	if (id > node->ID)
+		node->right = DeleteTree(node->right, id);
+	else if (id < node->ID)
+		node->left = DeleteTree(node->left, id);
+	else if (node->left == NULL || node->right == NULL) {
+		Node *child = (node->left != NULL) ? node->left : node->right;
+
+		Free(node);							// fresh copy, no reader has seen it
+		return child;
+	}
+	else {									// replace with the successor's item
+		Node *succ = node->right;
+
+		while (succ->left != NULL)
+			succ = succ->left;
+		node->ID = succ->ID;
+		node->item = succ->item;
+		node->right = DeleteTree(node->right, succ->ID);
+	}
+
+	return Rebalance(node);
+}
+
+/* Inorder traversal for searching some items */
+static Node* SearchTree(Node* node, int id) {
+	while (node != NULL) {					// lock-free: nodes are never mutated
+		if (node->ID == id)					// once they are published
+			return node;
+		node = (node->ID > id) ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+/* Inorder traversal for freeing AVL tree */
+static void ClearTree(Node* node) {
+	if (node != NULL) {
+		ClearTree(node->left);
+		ClearTree(node->right);
+		Free(node);
+	}
+}
+
+/* Return a private copy of a node for the running tree update */
+static Node* OwnNode(Node *node) {
+	Node *copy;
+
+	if (node->gen == writer->tree_gen)				// created by this update already
+		return node;
+
+	copy = (Node*)Malloc(sizeof(Node));
+	*copy = *node;
+	copy->gen = writer->tree_gen;
+	retire(node, free);						// readers may still be walking it
+	return copy;
+}
+
+/* Restore the AVL property of a node after deletion */
+static Node* Rebalance(Node *node) {
+	if ((GetHeight(node->left) - GetHeight(node->right)) == 2) {
+		if (GetHeight(node->left->left) >= GetHeight(node->left->right))
+			node = SingleRotateLeft(node);
+		else
+			node = DoubleRotateLeft(node);
+	}
+	else if ((GetHeight(node->right) - GetHeight(node->left)) == 2) {
+		if (GetHeight(node->right->right) >= GetHeight(node->right->left))
+			node = SingleRotateRight(node);
+		else
+			node = DoubleRotateRight(node);
+	}
+
+	node->height = GetGreater(GetHeight(node->left), GetHeight(node->right)) + 1;
+	return node;
+}
+
+/* Left single rotation */
+static Node* SingleRotateLeft(Node *nodeB) {
+	Node* nodeA = NULL;
+
+	nodeB = OwnNode(nodeB);
+	nodeA = OwnNode(nodeB->left);
+	nodeB->left = nodeA->right;		// rotating process
+	nodeA->right = nodeB;
+
+	nodeB->height = GetGreater(GetHeight(nodeB->left), GetHeight(nodeB->right)) + 1;
+	nodeA->height = GetGreater(GetHeight(nodeA->left), GetHeight(nodeB)) + 1;
+
+	return nodeA;
+}
+
+/* Right single rotation */
+static Node* SingleRotateRight(Node *nodeA) {
+	Node* nodeB = NULL;
+
+	nodeA = OwnNode(nodeA);
+	nodeB = OwnNode(nodeA->right);
+	nodeA->right = nodeB->left;		// rotating process
+	nodeB->left = nodeA;
+
+	nodeA->height = GetGreater(GetHeight(nodeA->left), GetHeight(nodeA->right)) + 1;
+	nodeB->height = GetGreater(GetHeight(nodeB->right), GetHeight(nodeA)) + 1;
+
+	return nodeB;
+}
+
+/* Left double rotation */
+static Node* DoubleRotateLeft(Node *node) {
+	node = OwnNode(node);
+	node->left = SingleRotateRight(node->left);
+
+	return SingleRotateLeft(node);
+}
+
+/* Right double rotation */
+static Node* DoubleRotateRight(Node *node) {
+	node = OwnNode(node);
+	node->right = SingleRotateLeft(node->right);
+
+	return SingleRotateRight(node);
+}
+
+/* Return the height of input node */
+static int GetHeight(Node *node) {
+	if (node == NULL)
+		return -1;					// -1 for comparison and addition
+	return node->height;
+}
+
+/* Return greater one between two heights */
+static int GetGreater(int heightA, int heightB) {
+	return (heightA > heightB) ? heightA : heightB;
+}
+
+/***      Subroutines for the AVL Tree End     ***/
+/************** End of the Program ***************/
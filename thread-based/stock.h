@@ -0,0 +1,191 @@
+/**************************************************
+ * Title: SP-Project 2  -  Sharded Stock Store
+ * Summary: stock items of the 'Thread-Based Concurrent
+ Stock Server', partitioned by ID hash into shards.
+ Each shard owns its AVL tree (index), its item slab
+ (ID/left_stock/price columns, apart from the index)
+ and a stripe of writer locks, where
+ buy/sell may be applied in batches by 'flat
+ combining', or, with 'stock_sequenced', posted to
+ a ring which one sequencer thread applies in order
+ without any lock (it is then the only producer of
+ their log records).
+ Readers never lock: the tree is updated by RCU and
+ the items are read with sequence locks.
+ Changes are logged by 'wal.h'; a checkpoint is a
+ binary snapshot (SnapHeader, then fixed-width rows
+ sorted by ID) which is mapped at startup, and the
+ text file ('ID left_stock price' lines after a
+ '#lsn N' header) is kept for import and export.
+ After a crash, the changes logged after the loaded
+ file are replayed by stock_replay.
+**************************************************/
+#ifndef __STOCK_H__
+#define __STOCK_H__
+
+#include "csapp.h"
+#include "wal.h"
+#include <stdint.h>
+
+
+/* Preprocessor Directives */
+#define NSHARDS		16				/* default number of shards (power of two) */
+#define NSTRIPES	64				/* writer locks per shard (power of two) */
+#define NSCANNERS	4				/* helper threads for whole-catalog scans */
+#define SCAN_MIN	65536			/* catalogs smaller than this are scanned serially */
+#define FC_SPINS	64				/* polls of a waiting poster before it yields */
+#define FC_PASSES	4				/* most batches one combiner applies */
+#define SEQ_SIZE	1024			/* slots of the sequencer's ring (power of two) */
+#define SEQ_BATCH	64				/* most trades the sequencer applies at once */
+#define SLAB_SHIFT	12				/* log2 of number of items per slab chunk */
+#define SLAB_CHUNK	(1 << SLAB_SHIFT)
+#define SLAB_SLOT(idx)	((idx) & (SLAB_CHUNK - 1))	/* row of a slab index in its chunk */
+#define SNAP_MAGIC	"STOCKSNP"		/* first bytes of a binary snapshot */
+#define SNAP_VERSION	1			/* layout of the rows and of the header */
+
+
+/* Types */
+typedef struct item {				/* one stock item as a row (loading, snapshots) */
+	int ID;							// ID, left_stock, price : attributes of stock item
+	int left_stock;
+	int price;
+}Item;
+
+typedef struct {					/* SLAB_CHUNK items as parallel columns, so a */
+	int ID[SLAB_CHUNK];				// scan only loads the fields it uses
+	int left_stock[SLAB_CHUNK];		// (address is stable while listed)
+	int price[SLAB_CHUNK];
+	unsigned seq[SLAB_CHUNK];		// sequence counters (odd while a writer is active)
+}ItemChunk;
+
+typedef struct node {				/* node structure of AVL tree */
+	int ID;							// key of the node (copy of the item's ID)
+	uint32_t item;					// slab index of the item which this node indexes
+	int height;						// balance factor of node (for AVL operations)
+	unsigned long gen;				// tree update which created this node
+	struct node *right;				// left and right link of node
+	struct node *left;
+}Node;
+
+typedef struct {					/* snapshot of a shard's catalog (published by RCU) */
+	Node *root;						// root of AVL tree
+	uint32_t *order;				// slab indexes sorted by ID for 'show', etc
+	uint32_t size;					// number of listed items
+}Catalog;
+
+typedef struct {					/* growable slab of items (32-bit indexes) */
+	ItemChunk **chunks;				// chunk directory (replaced by RCU when it grows)
+	uint32_t nchunks;				// capacity of the chunk directory
+	uint32_t used;					// number of slots ever handed out
+	uint32_t *free;					// stack of recycled slots
+	uint32_t nfree, free_cap;
+	int shard;						// index of the owning shard (for stock_alloc)
+}Slab;
+
+typedef struct fc_record {			/* a buy/sell posted to a stripe (flat combining) */
+	ItemChunk *chunk;				// chunk and row of the item to update
+	uint32_t slot;
+	int id;							// (for its log record)
+	int delta;						// +amount for sell, -amount for buy
+	int done;						// set by the combiner after applying
+	int result;						// stock_result of the operation
+	uint64_t lsn;					// and the log record of the change
+	struct fc_record *next;			// link of the publication list
+}FCRecord;
+
+typedef struct {					/* a buy/sell posted to the sequencer */
+	uint32_t seq;					// for position p: p free, p + 1 posted, p + 2 applied
+	int waiting;					// threads asleep on 'seq'
+	int id, delta;					// +amount for sell, -amount for buy
+	int result;						// stock_result, set by the sequencer
+	uint64_t lsn;					// and the log record of the change
+} __attribute__((aligned(64))) SeqSlot;
+
+typedef struct {					/* writers of the items hashing to one stripe */
+	sem_t w;						// semaphore (when combining is disabled)
+	int lock;						// combiner lock
+	FCRecord *pub;					// publication list of pending buy/sell
+} __attribute__((aligned(64))) Stripe;
+
+typedef struct retired {			/* memory waiting for the end of a grace period */
+	void *ptr;
+	void (*dtor)(void *);
+	struct retired *next;
+}Retired;
+
+typedef struct {					/* one partition of the catalog */
+	Catalog *catalog;				// current catalog of this shard
+	Slab slab;						// storage of the items of this shard
+	sem_t admin;					// serializes writers of the catalog (list/delist)
+	unsigned long tree_gen;			// generation of the running tree update
+	Retired *retired;				// memory retired by the running update
+	Stripe stripe[NSTRIPES];		// mutual exclusion among writers of items
+}Shard;
+
+typedef enum {						/* result of a store operation */
+	_ok_, _not_enough_, _no_item_, _exists_
+}stock_result;
+
+typedef struct {					/* header of a binary snapshot (host byte order) */
+	char magic[8];					// SNAP_MAGIC
+	uint32_t version;				// SNAP_VERSION
+	uint32_t item_size;				// width of a row, sizeof(Item)
+	uint64_t count;					// number of rows which follow, sorted by ID
+	uint64_t lsn;					// last change which the snapshot holds
+	uint64_t data_check;			// Fletcher-64 of the rows
+	uint64_t header_check;			// Fletcher-64 of the fields above
+}SnapHeader;
+
+typedef struct {					/* report of a background checkpoint */
+	uint64_t lsn;					// last change in the checkpoint
+	uint32_t items;					// number of items in the checkpoint
+	double pause;					// writers were paused for (sec)
+	double duration;				// until the file was in place (sec)
+	int ok;							// the file was written and renamed
+}Checkpoint;
+
+
+/* Global Variables */
+extern int stock_combining;			/* apply buy/sell by flat combining (default 1) */
+extern int stock_owned;				/* one thread writes each shard: no locks (default 0) */
+extern int stock_sequenced;			/* buy/sell applied by the sequencer (default 0) */
+extern __thread uint64_t stock_waited;	/* nsec the caller has waited for writers so far */
+extern int stock_lo, stock_hi;		/* a text file imports only the IDs in this range */
+extern void *(*stock_alloc)(size_t size, int shard);	/* item memory (NULL: malloc), */
+extern void (*stock_free)(void *ptr, size_t size);	/* freed by this (NULL: free) */
+
+
+/* Store routines (shards are chosen by ID hash) */
+void stock_init(int nshards);
+uint64_t stock_load(char *filename);
+int stock_load_snapshot(char *filename, uint64_t *lsn);
+void stock_store(char *filename);
+void stock_store_snapshot(char *filename);
+Item *stock_rows(uint32_t *n);
+void stock_load_rows(char *source, Item *rows, uint32_t n);
+uint32_t stock_replay(WalRecord *recs, size_t n);
+Checkpoint stock_checkpoint(char *filename);
+void stock_pause(void);
+void stock_resume(void);
+void stock_clear(void);
+stock_result stock_buy(int id, int amount);
+stock_result stock_sell(int id, int amount);
+stock_result stock_list(int id, int amount, int price);
+stock_result stock_delist(int id);
+char *stock_show(size_t *len, size_t slack);
+char *stock_show_range(int lo, int hi, size_t *len, size_t slack);
+char *stock_show_part(int part, int parts, int lo, int hi, size_t *len);
+char *stock_merge(char **text, size_t *lens, int n, size_t *len, size_t slack);
+int stock_shard(int id);
+int stock_shards(void);
+uint32_t stock_size(void);
+
+
+/* Read-Copy-Update (every thread reading the store must register) */
+void rcu_register(void);
+void rcu_unregister(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+
+#endif /* __STOCK_H__ */
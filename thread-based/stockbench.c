@@ -0,0 +1,382 @@
+/**************************************************
+ * Title: SP-Project 2  -  Stock Store Benchmark
+ * Summary: in-process benchmark of the sharded stock
+ store ('stock.c'). Worker threads buy and sell
+ random items for a fixed time, and the throughput
+ is reported for every worker count.
+   scaling : uniform/Zipf IDs, 1 shard vs NSHARDS
+   hotkey  : 80% of trades on HOT_IDS items, plain
+             semaphores vs flat combining
+   scan    : 'show', stock_store, a binary snapshot
+             and a forked checkpoint of the catalog
+   load    : startup from 'stock.txt' vs from a
+             mapped binary snapshot, and recovery
+             (snapshot + replay of logged trades)
+   wal     : no log vs group commit vs strict acks
+             (throughput and commit latency)
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include "stock.h"
+#include "wal.h"
+#include <time.h>
+
+
+/* Preprocessor Directives */
+#define MAX_WORKERS	64				/* largest number of worker threads */
+#define ZIPF_S		0.99			/* exponent of the skewed distribution */
+#define HOT_IDS		4				/* number of hot items of 'hotkey' */
+#define HOT_PCT		80				/* percentage of trades on the hot items */
+#define SCAN_ROUNDS	5				/* repetitions of every scan ('scan') */
+
+
+/* Types */
+typedef struct {					/* per-worker state */
+	pthread_t tid;
+	unsigned long long rng;			// state of xorshift generator
+	long ops;						// number of finished operations
+	char pad[64];					// keep workers off each other's cache line
+}Worker;
+
+
+typedef enum {						/* distribution of item IDs */
+	_uniform_, _zipf_, _hot_
+}distribution;
+
+
+/* Global Variables */
+int nitems = 1000000;				/* catalog size */
+double seconds = 0.5;				/* duration of one run */
+distribution dist;					/* distribution of the running benchmark */
+double *zipf_cdf;					/* cumulative distribution of '_zipf_' */
+volatile int running;				/* cleared by main to stop the workers */
+
+
+/* Subroutines */
+void bench_scaling(void);
+void bench_hotkey(void);
+void bench_scan(void);
+void bench_wal(void);
+void bench_load(void);
+void make_catalog(int nshards);
+void make_zipf(void);
+int next_id(Worker *w);
+double run(int nworkers);
+void *worker(void *vargp);
+double now(void);
+
+
+/**************** Implementation *****************/
+/* Main routine: run the selected benchmarks */
+int main(int argc, char **argv) {
+	char *which = "all";
+	int c;
+
+	while ((c = getopt(argc, argv, "n:t:b:")) != -1) {
+		switch (c) {
+		case 'n': nitems = atoi(optarg); break;
+		case 't': seconds = atof(optarg); break;
+		case 'b': which = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-n items] [-t seconds] [-b scaling|hotkey|scan|wal|load|all]\n",
+					argv[0]);
+			exit(0);
+		}
+	}
+
+	if (!strcmp(which, "scaling") || !strcmp(which, "all"))
+		bench_scaling();
+	if (!strcmp(which, "hotkey") || !strcmp(which, "all"))
+		bench_hotkey();
+	if (!strcmp(which, "scan") || !strcmp(which, "all"))
+		bench_scan();
+	if (!strcmp(which, "wal") || !strcmp(which, "all"))
+		bench_wal();
+	if (!strcmp(which, "load") || !strcmp(which, "all"))
+		bench_load();
+
+	exit(0);
+}
+
+/* Scaling of the shards: 1 shard vs NSHARDS, uniform vs Zipf IDs */
+void bench_scaling(void) {
+	int shard_counts[] = { 1, NSHARDS };
+
+	printf("[scaling]\n%-7s %-8s %7s %12s\n", "shards", "ids", "workers", "Mops/s");
+	for (int s = 0; s < 2; s++) {
+		make_catalog(shard_counts[s]);
+		for (dist = _uniform_; dist <= _zipf_; dist++) {
+			if (dist == _zipf_)
+				make_zipf();
+			for (int n = 1; n <= MAX_WORKERS; n *= 2)
+				printf("%-7d %-8s %7d %12.2f\n", shard_counts[s],
+						dist == _zipf_ ? "zipf" : "uniform", n, run(n) / 1e6);
+		}
+		Free(zipf_cdf);
+		zipf_cdf = NULL;
+		stock_clear();
+	}
+}
+
+/* Hot items: plain stripe semaphores vs flat combining */
+void bench_hotkey(void) {
+	printf("[hotkey] %d%% of trades on %d items\n%-10s %7s %12s\n",
+			HOT_PCT, HOT_IDS, "writers", "workers", "Mops/s");
+	make_catalog(NSHARDS);
+	dist = _hot_;
+	for (int mode = 0; mode < 2; mode++) {
+		stock_combining = mode;
+		for (int n = 1; n <= MAX_WORKERS; n *= 2)
+			printf("%-10s %7d %12.2f\n", mode ? "combining" : "semaphore", n, run(n) / 1e6);
+	}
+	stock_combining = 1;
+	stock_clear();
+}
+
+/* Whole-catalog scans: format for 'show', and store into a file */
+void bench_scan(void) {
+	char filename[] = "/tmp/stockbench.XXXXXX";
+	double start, show_time, store_time, snap_time;
+	size_t len = 0;
+	Checkpoint ck;
+
+	Close(mkstemp(filename));
+	make_catalog(NSHARDS);
+	rcu_register();
+
+	start = now();
+	for (int r = 0; r < SCAN_ROUNDS; r++)
+		Free(stock_show(&len, 0));
+	show_time = (now() - start) / SCAN_ROUNDS;
+
+	start = now();
+	for (int r = 0; r < SCAN_ROUNDS; r++)
+		stock_store(filename);
+	store_time = (now() - start) / SCAN_ROUNDS;
+
+	start = now();
+	for (int r = 0; r < SCAN_ROUNDS; r++)
+		stock_store_snapshot(filename);
+	snap_time = (now() - start) / SCAN_ROUNDS;
+	ck = stock_checkpoint(filename);
+
+	printf("[scan] %d items, %zu bytes\n%-7s %12s %12s %12s\n", nitems, len,
+			"scan", "ms", "Mitems/s", "MB/s");
+	printf("%-7s %12.2f %12.2f %12.2f\n", "show", show_time * 1e3,
+			nitems / show_time / 1e6, len / show_time / 1e6);
+	printf("%-7s %12.2f %12.2f %12.2f\n", "store", store_time * 1e3,
+			nitems / store_time / 1e6, len / store_time / 1e6);
+	printf("%-7s %12.2f %12.2f\n", "snap", snap_time * 1e3, nitems / snap_time / 1e6);
+	printf("%-7s %12.2f %12.2f %12s  (writers paused %.3f ms)\n", "ckpt",
+			ck.duration * 1e3, nitems / ck.duration / 1e6, "", ck.pause * 1e3);
+
+	unlink(filename);
+	stock_clear();
+}
+
+/* Durability: trades without a log, with group commit, and with strict acks */
+void bench_wal(void) {
+	char filename[] = "/tmp/stockbench.wal.XXXXXX";
+	char *modes[] = { "off", "group", "strict" };
+
+	Close(mkstemp(filename));
+	printf("[wal] interval %d usec, batch %d\n%-7s %7s %12s %10s %10s %10s\n",
+			wal_interval, wal_batch, "log", "workers", "kops/s", "p50 usec",
+			"p99 usec", "p99.9 usec");
+	make_catalog(NSHARDS);
+	dist = _uniform_;
+	for (int mode = 0; mode < 3; mode++) {
+		for (int n = 1; n <= MAX_WORKERS; n *= 2) {
+			double ops;
+
+			wal_strict = (mode == 2);
+			if (mode > 0)
+				wal_open(filename, 0);
+			ops = run(n);
+			wal_close();				// flushes the rest of the log
+			printf("%-7s %7d %12.1f %10ld %10ld %10ld\n", modes[mode], n, ops / 1e3,
+					wal_latency(0.5), wal_latency(0.99), wal_latency(0.999));
+			truncate(filename, 0);
+		}
+	}
+	wal_strict = 0;
+
+	unlink(filename);
+	stock_clear();
+}
+
+/* Startup: parse and sort 'stock.txt' vs map a sorted binary snapshot,
+   and recovery from the snapshot and a log of trades */
+void bench_load(void) {
+	char text[] = "/tmp/stockbench.XXXXXX", snap[] = "/tmp/stockbench.snap.XXXXXX";
+	char log[] = "/tmp/stockbench.wal.XXXXXX";
+	double start, text_time, snap_time, recover_time;
+	struct stat text_st, snap_st, log_st;
+	WalRecord *recs;
+	uint64_t lsn;
+	size_t n;
+
+	Close(mkstemp(text));
+	Close(mkstemp(snap));
+	Close(mkstemp(log));
+	make_catalog(NSHARDS);
+	rcu_register();
+	stock_store(text);
+	stock_store_snapshot(snap);
+	stock_clear();
+	stat(text, &text_st);
+	stat(snap, &snap_st);
+
+	text_time = snap_time = 0;
+	for (int r = 0; r < SCAN_ROUNDS; r++) {
+		start = now();
+		stock_init(NSHARDS);
+		stock_load(text);
+		text_time += now() - start;
+		stock_clear();
+
+		start = now();
+		stock_init(NSHARDS);
+		stock_load_snapshot(snap, &lsn);
+		snap_time += now() - start;
+		stock_clear();
+	}
+	text_time /= SCAN_ROUNDS;
+	snap_time /= SCAN_ROUNDS;
+
+	stock_init(NSHARDS);					// log trades after the snapshot
+	stock_load_snapshot(snap, &lsn);
+	wal_open(log, lsn);
+	dist = _uniform_;
+	run(8);
+	wal_close();
+	stock_clear();
+	stat(log, &log_st);
+
+	start = now();
+	stock_init(NSHARDS);
+	stock_load_snapshot(snap, &lsn);
+	recs = wal_recover(log, lsn, &n);
+	stock_replay(recs, n);
+	recover_time = now() - start;
+	Free(recs);
+	stock_clear();
+
+	printf("[load] %d items\n%-9s %12s %12s %12s\n", nitems, "file", "bytes", "ms", "Mitems/s");
+	printf("%-9s %12lld %12.2f %12.2f\n", "text", (long long)text_st.st_size,
+			text_time * 1e3, nitems / text_time / 1e6);
+	printf("%-9s %12lld %12.2f %12.2f\n", "snapshot", (long long)snap_st.st_size,
+			snap_time * 1e3, nitems / snap_time / 1e6);
+	printf("%-9s %12lld %12.2f %12.2f  (+%zu logged trades)\n", "recovery",
+			(long long)(snap_st.st_size + log_st.st_size), recover_time * 1e3,
+			nitems / recover_time / 1e6, n);
+
+	unlink(text);
+	unlink(snap);
+	unlink(log);
+}
+
+/* Build a catalog of IDs 1..nitems through the normal loader */
+void make_catalog(int nshards) {
+	char filename[] = "/tmp/stockbench.XXXXXX";
+	int fd = mkstemp(filename);
+	FILE *fp = Fdopen(fd, "w");
+
+	for (int id = 1; id <= nitems; id++)
+		fprintf(fp, "%d %d %d\n", id, 1000000, id % 10000);
+	Fclose(fp);
+
+	stock_init(nshards);
+	stock_load(filename);
+	unlink(filename);
+}
+
+/* Precompute the Zipf distribution over the ranks of items */
+void make_zipf(void) {
+	double sum = 0;
+
+	zipf_cdf = Malloc(nitems * sizeof(double));
+	for (int i = 0; i < nitems; i++)
+		zipf_cdf[i] = (sum += 1.0 / pow(i + 1, ZIPF_S));
+	for (int i = 0; i < nitems; i++)
+		zipf_cdf[i] /= sum;
+}
+
+/* Draw the next item ID of a worker */
+int next_id(Worker *w) {
+	unsigned long long x = w->rng;
+	int lo = 0, hi = nitems - 1;
+	double u;
+
+	x ^= x << 13; x ^= x >> 7; x ^= x << 17;	// xorshift64
+	w->rng = x;
+	if (dist == _uniform_)
+		return (int)(x % nitems) + 1;
+	if (dist == _hot_)
+		return ((x >> 32) % 100 < HOT_PCT) ? (int)(x % HOT_IDS) + 1 : (int)(x % nitems) + 1;
+
+	u = (x >> 11) * (1.0 / 9007199254740992.0);
+	while (lo < hi) {							// binary search for the rank
+		int mid = (lo + hi) / 2;
+
+		if (zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (int)((lo * 2654435761ULL) % nitems) + 1;	// scatter the hot ranks
+}
+
+/* Run 'nworkers' workers for 'seconds' and return operations per second */
+double run(int nworkers) {
+	Worker *workers = Calloc(nworkers, sizeof(Worker));
+	double start, elapsed;
+	long ops = 0;
+
+	running = 1;
+	for (int i = 0; i < nworkers; i++) {
+		workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		Pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+	}
+
+	start = now();
+	usleep((useconds_t)(seconds * 1e6));
+	running = 0;
+	for (int i = 0; i < nworkers; i++) {
+		Pthread_join(workers[i].tid, NULL);
+		ops += workers[i].ops;
+	}
+	elapsed = now() - start;
+
+	Free(workers);
+	return ops / elapsed;
+}
+
+/* Thread routine of the workers: alternate buy and sell */
+void *worker(void *vargp) {
+	Worker *w = vargp;
+
+	rcu_register();
+	while (running) {
+		int id = next_id(w);
+
+		if (w->ops & 1)
+			stock_sell(id, 1);
+		else
+			stock_buy(id, 1);
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+/* Return the current time in seconds */
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/************** End of the Program ***************/
@@ -24,7 +24,11 @@ int main(int argc, char **argv)
 		Rio_writen(clientfd, buf, strlen(buf));
 		Rio_readnb(&rio, buf, MAXLINE);
 		if (!strcmp(buf, "exit")) break;
-		Fputs(buf, stdout);
+		Fwrite(buf, 1, strnlen(buf, MAXLINE), stdout);
+		while (buf[MAXLINE - 1] != '\0') {		// a full frame is continued
+			Rio_readnb(&rio, buf, MAXLINE);		// (large 'show' replies)
+			Fwrite(buf, 1, strnlen(buf, MAXLINE), stdout);
+		}
 	}
 	Close(clientfd); //line:netp:echoclient:close
 	exit(0);
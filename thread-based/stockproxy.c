@@ -0,0 +1,217 @@
+/**************************************************
+ * Title: SP-Project 2  -  Routing Proxy
+ * Summary: the front door of a cluster of
+ stockservers, each of which owns a range of IDs of
+ a shard map ('route.h'). Clients speak the usual
+ protocol to the proxy: buy/sell/list/delist go to
+ the owner of the ID, and 'show' ('lag', 'pool') to
+ every server at once, whose replies are merged in
+ the order of their ranges. A thread serves each
+ client over its own connections to the servers.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "csapp.h"
+#include "route.h"
+
+
+/* Types */
+typedef struct {					/* connection of a client thread to one server */
+	int fd;							// -1 until the first request for this server
+	rio_t rio;
+}Upstream;
+
+typedef struct {					/* a reply of several frames, being collected */
+	char *buf;
+	size_t len, size;
+}Reply;
+
+
+/* Global Variables */
+ShardMap *map;						/* the ranges of the cluster */
+
+char no_item_msg[MAXLINE] = "No such stock\n";
+char range_error_msg[MAXLINE] = "Not in the range of any server\n";
+char down_msg[MAXLINE] = "Server of this range is down\n";
+char error_msg[MAXLINE] = "Invalid Command\n";
+char exit_msg[MAXLINE] = "exit";	/* global strings (padded to MAXLINE) for service */
+
+
+/* Subroutines */
+void *thread(void *vargp);
+int route(int connfd, Upstream *up, char *buf, int id, int is_list);
+int fan_out(int connfd, Upstream *up, char *buf, int prefix);
+int forward(Upstream *u, Range *r, char *buf, Reply *reply);
+void append(Reply *reply, char *data, size_t len);
+int write_frames(int connfd, char *buf, size_t len);
+
+
+/**************** Implementation *****************/
+/* Main routine: accept clients and spawn a thread for each */
+int main(int argc, char **argv) {
+	int listenfd, *connfdp;
+	socklen_t clientlen;
+	struct sockaddr_storage clientaddr;
+	pthread_t tid;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <shardmap> <port>\n", argv[0]);
+		exit(0);
+	}
+	map = route_load(argv[1]);
+	Signal(SIGPIPE, SIG_IGN);				// a server or a client may go away
+
+	listenfd = Open_listenfd(argv[2]);
+	while (1) {
+		clientlen = sizeof(struct sockaddr_storage);
+		connfdp = Malloc(sizeof(int));
+		*connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+		Pthread_create(&tid, NULL, thread, connfdp);
+	}
+}
+
+/* Thread routine: serve one client until it leaves */
+void *thread(void *vargp) {
+	int connfd = *(int *)vargp, n, id, ok = 1;
+	Upstream *up = Malloc(map->n * sizeof(Upstream));
+	char buf[MAXLINE], argument[10];
+	rio_t rio;
+
+	Pthread_detach(pthread_self());
+	Free(vargp);
+	for (int i = 0; i < map->n; i++)
+		up[i].fd = -1;							// connect on demand
+
+	Rio_readinitb(&rio, connfd);
+	while (ok && (n = rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+		argument[0] = '\0';
+		id = 0;
+		sscanf(buf, "%9s %d", argument, &id);
+
+		if (!strcmp(argument, "buy") || !strcmp(argument, "sell")
+				|| !strcmp(argument, "list") || !strcmp(argument, "delist"))
+			ok = route(connfd, up, buf, id, !strcmp(argument, "list"));
+		else if (!strcmp(argument, "show"))
+			ok = fan_out(connfd, up, buf, 0);	// lines of every range, in order
+		else if (!strcmp(argument, "lag") || !strcmp(argument, "pool"))
+			ok = fan_out(connfd, up, buf, 1);		// the state of every server
+		else if (!strcmp(argument, "exit"))
+			ok = rio_writen(connfd, exit_msg, MAXLINE) == MAXLINE;
+		else
+			ok = rio_writen(connfd, error_msg, MAXLINE) == MAXLINE;
+	}
+
+	for (int i = 0; i < map->n; i++)
+		if (up[i].fd >= 0)
+			Close(up[i].fd);
+	Free(up);
+	Close(connfd);
+	return NULL;
+}
+
+/* Send a request on an item to the owner of 'id' and pass its reply back;
+   0 if the client is gone */
+int route(int connfd, Upstream *up, char *buf, int id, int is_list) {
+	int i = route_find(map, id);
+	Reply reply = { NULL, 0, 0 };
+	int ok;
+
+	if (i < 0)									// nobody owns it
+		return rio_writen(connfd, is_list ? range_error_msg : no_item_msg, MAXLINE) == MAXLINE;
+	if (forward(&up[i], &map->ranges[i], buf, &reply) < 0)
+		return rio_writen(connfd, down_msg, MAXLINE) == MAXLINE;
+
+	ok = write_frames(connfd, reply.buf, reply.len);
+	Free(reply.buf);
+	return ok;
+}
+
+/* Send a request to every server and merge the replies in the order of
+   the ranges ('prefix': name the server before its reply); 0 if the
+   client is gone */
+int fan_out(int connfd, Upstream *up, char *buf, int prefix) {
+	Reply reply = { NULL, 0, 0 };
+	int ok;
+
+	for (int i = 0; i < map->n; i++) {			// every server works at once,
+		Range *r = &map->ranges[i];				// replies are read in order
+
+		if (up[i].fd < 0 && (up[i].fd = open_clientfd(r->host, r->port)) >= 0)
+			Rio_readinitb(&up[i].rio, up[i].fd);
+		if (up[i].fd >= 0 && rio_writen(up[i].fd, buf, strlen(buf)) < 0) {
+			Close(up[i].fd);
+			up[i].fd = -1;
+		}
+	}
+	for (int i = 0; i < map->n; i++) {
+		Range *r = &map->ranges[i];
+		size_t start = reply.len;
+		char name[MAXLINE];
+
+		if (prefix)
+			append(&reply, name, snprintf(name, sizeof(name), "%s:%s: ", r->host, r->port));
+		if (forward(&up[i], r, NULL, &reply) < 0) {
+			reply.len = start;					// (a 'show' misses the range)
+			if (prefix)
+				append(&reply, name, snprintf(name, sizeof(name), "%s:%s: down\n", r->host, r->port));
+		}
+	}
+
+	if (reply.buf == NULL)
+		append(&reply, "", 0);
+	ok = write_frames(connfd, reply.buf, reply.len);
+	Free(reply.buf);
+	return ok;
+}
+
+/* Send 'buf' (unless NULL: it is sent already) to the server of range 'r',
+   and append its reply without the framing; -1 if the server is down */
+int forward(Upstream *u, Range *r, char *buf, Reply *reply) {
+	char frame[MAXLINE];
+	size_t len;
+
+	if (u->fd < 0 && buf != NULL && (u->fd = open_clientfd(r->host, r->port)) >= 0)
+		Rio_readinitb(&u->rio, u->fd);
+	if (u->fd < 0 || (buf != NULL && rio_writen(u->fd, buf, strlen(buf)) < 0))
+		goto down;
+
+	do {
+		if (rio_readnb(&u->rio, frame, MAXLINE) != MAXLINE)
+			goto down;
+		len = strnlen(frame, MAXLINE);				// a full frame is continued
+		append(reply, frame, len);
+	} while (frame[MAXLINE - 1] != '\0');
+
+	return 0;
+
+down:
+	if (u->fd >= 0)
+		Close(u->fd);								// connect again next time
+	u->fd = -1;
+	return -1;
+}
+
+/* Append 'len' bytes to a reply */
+void append(Reply *reply, char *data, size_t len) {
+	if (reply->len + len + 1 > reply->size)
+		reply->buf = Realloc(reply->buf, reply->size = 2 * (reply->len + len) + MAXLINE);
+	memcpy(reply->buf + reply->len, data, len);
+	reply->len += len;
+}
+
+/* Send a reply as MAXLINE-sized frames, a full frame means 'to be continued'
+   (0 if the client is gone) */
+int write_frames(int connfd, char *buf, size_t len) {
+	size_t total = (len / MAXLINE + 1) * MAXLINE;	// at least one '\0' at the end
+	char frame[MAXLINE];
+	size_t off;
+
+	for (off = 0; off + MAXLINE <= len; off += MAXLINE)	// full frames as they are
+		if (rio_writen(connfd, buf + off, MAXLINE) != MAXLINE)
+			return 0;
+	memset(frame, 0, MAXLINE);
+	memcpy(frame, buf + off, len - off);
+	return off + MAXLINE == total && rio_writen(connfd, frame, MAXLINE) == MAXLINE;
+}
+/************** End of the Program ***************/
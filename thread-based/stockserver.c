@@ -3,8 +3,12 @@
  * Summary: 'Thread-Based Concurrent Stock Server'
  for studying the concepts of network programming,
  thread programming, synchronization, semaphore, P-
- -roducer/Consumer Problem, First Readers/Writers
- Problem, etc.
+ -roducer/Consumer Problem, Readers/Writers Problem
+ with sequence locks, write-ahead logging, crash
+ recovery, hot upgrades, replication, clusters of
+ ID ranges, coroutines, shared-nothing cores, a
+ single-writer sequencer of trades, latency
+ statistics, an asynchronous binary log, etc.
  *  |Date              |Author             |Version
 	|2022-05-21        |Park Junhyeok      |1.0.0
 **************************************************/
@@ -12,128 +16,401 @@
 /****************** Declaration ******************/
 /* Headers */
 #include "csapp.h"
+#include "stock.h"
+#include "wal.h"
+#include "repl.h"
+#include "route.h"
+#include "ring.h"
+#include "sched.h"
+#include "affinity.h"
+#include "coro.h"
+#include "spsc.h"
+#include "stats.h"
+#include "logger.h"
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 
 /* Preprocessor Directives */
-#define MAX_ITEM	1000000			/* size of pointer array */
-#define SBUFSIZE	1000			/* size of shared buffer */
-#define NTHREADS	1000			/* number of worker threads */
+#define SBUFSIZE	1024			/* size of shared buffer */
+#define ACCEPT_BATCH	64			/* most connections handed to workers at once */
+#define REACTOR_EVENTS	256			/* most readiness events taken at once */
+#define NTHREADS	1000			/* most worker threads */
+#define POOL_MIN	8				/* default least worker threads */
+#define POOL_STACK	256				/* default stack size of a worker (KB) */
+#define POOL_TICK	5				/* msec between looks at the shared buffer */
+#define POOL_DELAY	2.0				/* queueing delay (msec) which grows the pool */
+#define POOL_IDLE	10				/* seconds before an idle worker retires */
+#define CKPT_INTERVAL	60			/* default seconds between checkpoints */
+#define UPGRADE_SOCK	"stock.sock"	/* control socket of hot upgrades */
+#define UPGRADE_TAG		8			/* bytes of the tag which heads a message */
+#define UPGRADE_FDS		250			/* most descriptors in one message */
+#define PART_QUEUE	1024			/* requests in flight from one core to another */
+#define PART_LOCAL	(-1)			/* served by the core of the connection */
+#define PART_ALL	(-2)			/* gathered from every core ('show') */
+#define PLACE_ACCEPTOR	(-1)		/* roles of pinned threads (workers: index) */
+#define PLACE_REACTOR	(-2)
+#define STATS_REPLY	4096			/* room for the text of a 'stats' reply */
 
 
 /* Types */
-typedef struct item {				/* node structure of AVL tree */
-	int ID;							// ID, left_stock, price : attributes of stock item
-	int left_stock;
-	int price;
-	int height;						// balance factor of node (for AVL operations)
-	int readcnt;					// number of Readers who access the node
-	sem_t mutex, w;					// semaphores for 'First Readers-Writers Problem'
-	struct item *right;				// left and right link of node
-	struct item *left;
-}Item;
-
-typedef struct {					/* structure for 'Producer-Consumer Problem' */
-	int *buf;	 					// shared buffer pointer
-	int n; 							// maximum number of slots
-	int front; 						// buf[(front+1)%n] (pointing the first item)
-	int rear; 						// buf[rear%n] (pointing the last item)
-	sem_t mutex; 					// provides mutual exclusion for accessing buffer
-	sem_t slots; 					// number of available slots
-	sem_t items; 					// number of available items
-} sbuf_t;
+typedef struct {					/* adaptive pool of worker threads */
+	int size, peak;					// workers alive now / at most so far
+	int min, max;					// bounds of the size
+	long started, retired;			// workers started / retired so far
+	char used[NTHREADS];			// slots of the live workers
+	pthread_attr_t attr;			// (small stacks)
+	sem_t mutex;					// protects the fields above
+	long delay, delay_max;			// queueing delay (usec): moving average and
+} pool_t;							// longest (atomic, set by the workers)
+
+typedef struct {					/* reply of a request (MAXLINE-sized frames) */
+	char *buf;
+	size_t len;						// a multiple of MAXLINE
+	int owned;						// 'buf' is freed once it is sent
+} reply_t;
+
+typedef enum {						/* next step of a connection (work stealing) */
+	_parse_, _execute_, _write_
+} conn_step;
+
+typedef struct {					/* connection served by work-stealing tasks */
+	int fd;
+	int home;						// worker which ran it last (a warm cache)
+	conn_step step;					// run by whichever worker holds the task
+	int len;						// bytes read and not served yet,
+	char in[MAXLINE];				// at most one request line
+	char line[MAXLINE];				// the request being served
+	reply_t reply;					// and its reply
+	StatSample stat;				// phases of the request so far
+	uint64_t pushed;				// when its task was queued
+} Conn;
+
+typedef struct {					/* request served by the core owning its items */
+	struct co_conn *conn;			// connection waiting for the reply
+	int to;							// core which serves it
+	int part;						// 'show': the items of this core (else -1)
+	char *line;						// the request
+	reply_t reply;					// set by the core which serves it
+} PartMsg;
+
+typedef struct co_conn {			/* connection served by a coroutine */
+	Coro co;						// (first: the loop knows only this part)
+	int eof;						// the client has shut its side
+	int len;						// bytes read and not served yet,
+	char in[MAXLINE];				// at most one request line
+	char line[MAXLINE];				// the request being served
+	reply_t reply;					// and its reply,
+	size_t sent;					// of which so many bytes are sent
+	StatSample stat;				// phases of the request
+	PartMsg msg, *parts;			// requests to other cores (shared-nothing):
+	int nparts, posted, pending;	// all, posted so far, not replied yet
+} CoConn;
 
 typedef enum {						/* enumeration for choosing the type of service */
-	_show_, _buy_, _sell_, _exit_, _error_
+	_show_, _buy_, _sell_, _list_, _delist_, _lag_, _pool_, _stats_, _readonly_, _exit_, _error_
 }command;
 
 
 /* Global Variables */
-Item *root = NULL;					/* root of AVL tree */
-Item *print[MAX_ITEM];				/* pointer array for 'show' routine, etc */
-int print_size;						/* size of pointer array */
-
-sbuf_t sbuf;						/* shared buffer for 'Producer-Consumer Problem */
-
-char buy_success_msg[] = "[buy] success\n";
-char buy_error_msg[] = "Not enough left stock\n";
-char sell_success_msg[] = "[sell] success\n";
-char error_msg[] = "Invalid Command\n";
-char exit_msg[] = "exit";			/* these are global strings for providing service */
-
-
-/* Subroutines for the AVL Tree */
-Item* InsertTree(Item*, int, int, int);
-Item* SearchTree(Item* node, int id);
-void ClearTree(Item* node);
-Item* SingleRotateLeft(Item *nodeB);
-Item* SingleRotateRight(Item *nodeA);
-Item* DoubleRotateLeft(Item *node);
-Item* DoubleRotateRight(Item *node);
-int GetHeight(Item *node);
-int GetGreater(int, int);
-
-
-/* Subroutines for 'Producer-Consumer Problem' */
-void sbuf_init(sbuf_t *sp, int n);
-void sbuf_deinit(sbuf_t *sp);
-void sbuf_insert(sbuf_t *sp, int item);
-int sbuf_remove(sbuf_t *sp);
+Ring sbuf;							/* shared buffer for 'Producer-Consumer Problem' */
+pool_t pool;						/* worker threads (consumers) */
+int steal_workers = 0;				/* workers of the work-stealing mode (0: off) */
+Conn **conns;						/* connection of every descriptor (that mode) */
+int conn_max;						/* size of 'conns' */
+int epfd;							/* readiness of idle connections (that mode) */
+int coro_loops = 0;					/* event loops of the coroutine mode (0: off) */
+CoLoop *loops;						/* every loop of that mode */
+int partitions = 0;					/* cores of the shared-nothing mode (0: off) */
+Spsc *part_req, *part_rep;			/* requests / replies from core i to core j */
+									/* (at [i * partitions + j]) */
+long *part_sent;					/* requests every core sent to the others */
+int placed = 0;						/* threads pinned to CPUs (-A) */
+int place_first;					/* first CPU (in the allowed list) of workers */
+int ckpt_interval = CKPT_INTERVAL;	/* seconds between checkpoints (0: never) */
+sem_t ckpt_hold;					/* held while a new server loads the files */
+
+int upgrade_pipe[2];				/* upgrader -> main thread: a handoff's socket */
+sem_t upgrade_failed;				/* main thread -> upgrader: the handoff failed */
+sem_t conn_mutex;					/* protects the connection table below */
+int conn_active[NTHREADS];			/* connection of every worker (-1: none) */
+int conn_accepted, conn_done;		/* connections accepted / closed or kept */
+int draining;						/* a handoff serves no more connections */
+int drain_pipe[2] = {-1, -1};		/* readable once draining (wakes the workers) */
+int *kept, nkept;					/* connections between two requests, which */
+									/* go to the new server */
+int kept_repl = -1;					/* replication socket taken from the old server */
+
+char buy_success_msg[MAXLINE] = "[buy] success\n";
+char buy_error_msg[MAXLINE] = "Not enough left stock\n";
+char sell_success_msg[MAXLINE] = "[sell] success\n";
+char list_success_msg[MAXLINE] = "[list] success\n";
+char list_error_msg[MAXLINE] = "Stock already listed\n";
+char delist_success_msg[MAXLINE] = "[delist] success\n";
+char no_item_msg[MAXLINE] = "No such stock\n";
+char error_msg[MAXLINE] = "Invalid Command\n";
+char readonly_msg[MAXLINE] = "Read-only replica\n";
+char range_error_msg[MAXLINE] = "Not in the range of this server\n";
+char exit_msg[MAXLINE] = "exit";	/* global strings (padded to MAXLINE) for service */
+
+
+/* Subroutines for the Worker Pool */
+void pool_init(int min, int max, int stack_kb);
+int pool_grow(int n);
+int pool_retire(int w);
+void pool_delay(double stamp);
+void *pool_manager(void *vargp);
+void pool_report(char *buf, size_t size);
 
 
 /* Subroutines for Service of Stock Server */
-command what_command(char *buf, int *id, int *amount);
-void service(int connfd, char *buf, int n);
-void show_routine(int connfd);
-void buy_routine(int connfd, int id, int amount);
-void sell_routine(int connfd, int id, int amount);
-void exit_routine(int connfd);
-void error_routine(int connfd);
-void stock_load(void);
-void stock_store(void);
+command what_command(char *buf, int *id, int *amount, int *price);
+void service(int connfd, char *buf, int n, uint64_t queued);
+reply_t execute(char *buf, StatSample *s);
+reply_t message(char *msg);
+void send_reply(int connfd, reply_t *reply);
+int take_line(char *in, int *len, char *line, int eof);
+reply_t show_routine(int lo, int hi);
+void show_range(char *buf, int *lo, int *hi);
+size_t frames(char *buf, size_t len);
+reply_t buy_routine(int id, int amount);
+reply_t sell_routine(int id, int amount);
+reply_t list_routine(int id, int amount, int price);
+reply_t delist_routine(int id);
+reply_t lag_routine(void);
+reply_t pool_routine(void);
+reply_t stats_routine(void);
+reply_t exit_routine(void);
 void *thread(void *vargp);
+void *checkpointer(void *vargp);
+uint64_t recover(int ctl, int *listenfd);
+int snapshot_newer(char *snapshot, char *text);
 void sigint_handler(int sig);
 
 
+/* Subroutines for Work Stealing */
+void steal_init(int workers, int stack_kb);
+void steal_open(int connfd);
+void *reactor(void *vargp);
+void step(int fd, int w);
+int parse_step(Conn *c);
+void steal_close(Conn *c);
+
+
+/* Subroutines for Coroutines */
+void coro_init(int n);
+void coro_open(int connfd);
+void *coro_loop(void *vargp);
+void conn_open(CoLoop *loop, int connfd);
+int conn_coro(Coro *co);
+void conn_close(Coro *co);
+void coro_report(char *buf, size_t size);
+
+
+/* Subroutines for Shared-Nothing Cores */
+void part_init(int n);
+int part_route(CoConn *c);
+int part_post(CoConn *c);
+int part_poll(CoLoop *loop);
+reply_t part_reply(CoConn *c);
+
+
+/* Subroutines for Placement */
+void place_init(void);
+int place_cpu(int role);
+void place_pin(int role);
+void *place_alloc(size_t size, int shard);
+void steal_start(int w);
+
+
+/* Subroutines for Hot Upgrade */
+int upgrade_listen(void);
+int upgrade_connect(void);
+int upgrade_take(int ctl);
+void *upgrader(void *vargp);
+void handoff(int ctl, int listenfd);
+int conn_begin(int w, int connfd);
+int conn_wait(int w, rio_t *rp);
+void conn_end(int w);
+int send_msg(int sock, char *tag, void *data, size_t len, int *fds, int nfds);
+ssize_t recv_msg(int sock, char *tag, void *data, size_t size, int *fds, int *nfds);
+
+
 /**************** Implementation *****************/
 /**   Subroutines for Service of Stock Server   **/
 /* Main thread (Master/Producer thread of 'Producer-Consumer Problem') */
 int main(int argc, char **argv) {
-	int listenfd, connfd;
+	int listenfd, connfd, ctl = -1, batch[ACCEPT_BATCH], n;
 	socklen_t clientlen;
 	struct sockaddr_storage clientaddr;
-	char client_hostname[MAXLINE], client_port[MAXLINE];
 	pthread_t tid;
-
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	sigset_t mask, prev;
+	char *repl_port = NULL, *primary = NULL, *colon = NULL, *mapfile = NULL;
+	int pool_min = POOL_MIN, pool_max = NTHREADS, stack_kb = POOL_STACK;
+	uint64_t lsn;
+	int c;
+
+	while ((c = getopt(argc, argv, "Si:n:c:uR:r:M:w:k:W:C:P:AQL:")) != -1) {
+		switch (c) {
+		case 'S': wal_strict = 1; break;			// acknowledge durable trades only
+		case 'i': wal_interval = atoi(optarg); break;	// group commit interval (usec)
+		case 'n': wal_batch = atoi(optarg); break;	// group commit batch size
+		case 'c': ckpt_interval = atoi(optarg); break;	// checkpoint interval (sec)
+		case 'u': ctl = 0; break;					// take over the running server
+		case 'R': repl_port = optarg; break;		// serve replicas at this port
+		case 'r': primary = optarg; break;			// be a replica of host:port
+		case 'M': mapfile = optarg; break;			// own a range of this shard map
+		case 'w': sscanf(optarg, "%d:%d", &pool_min, &pool_max); break;	// workers
+		case 'k': stack_kb = atoi(optarg); break;	// stack size of a worker (KB)
+		case 'W': steal_workers = atoi(optarg); break;	// tasks on work-stealing workers
+		case 'C': coro_loops = atoi(optarg); break;	// connections as coroutines
+		case 'P': partitions = atoi(optarg); break;	// cores which own the items
+		case 'A': placed = 1; break;				// pin threads, items on shard nodes
+		case 'Q': stock_sequenced = 1; break;		// buy/sell applied by one sequencer
+		case 'L': log_level = atoi(optarg); break;	// least level logged (0: debug)
+		default: optind = argc + 1; break;
+		}
+	}
+	if (optind != argc - 1 || (primary && (!(colon = strrchr(primary, ':')) || repl_port))) {
+		fprintf(stderr, "usage: %s [-S] [-i usec] [-n batch] [-c sec] [-u] [-R port | -r host:port] "
+				"[-M shardmap] [-w min:max | -W workers | -C loops | -P cores] [-k stack KB] [-A] [-Q] [-L level] <port>\n", argv[0]);
 		exit(0);
 	}
-	stock_load();							// load the 'stock.txt', and construct tree
+	if (mapfile) {								// the range at our port
+		ShardMap *map = route_load(mapfile);
+		int self = route_self(map, argv[optind]);
+
+		if (self < 0) {
+			fprintf(stderr, "The '%s' shard map has no single range at port %s.\n",
+					mapfile, argv[optind]);
+			exit(0);
+		}
+		stock_lo = map->ranges[self].lo;
+		stock_hi = map->ranges[self].hi;
+		route_free(map);
+	}
+
+	Sigemptyset(&mask);						// only the main thread takes SIGINT,
+	Sigaddset(&mask, SIGINT);				// so the handler never interrupts
+	Sigprocmask(SIG_BLOCK, &mask, &prev);	// a thread holding a lock
+
+	log_init(LOG_FILE, log_level);			// events into 'stock.log'
+
+	kept = Malloc((SBUFSIZE + NTHREADS) * sizeof(int));
+	if (placed)
+		place_init();						// (before any item is allocated)
+	if (ctl == 0 && !primary)
+		ctl = upgrade_connect();			// the old server serves on meanwhile
+	stock_init(partitions > NSHARDS ? partitions : NSHARDS);	// (a shard or more per core)
+	rcu_register();							// (SIGINT handler reads the store)
+	if (primary) {
+		*colon = '\0';
+		ctl = -1;
+		repl_follow(primary, colon + 1);	// a read-only copy of the primary
+	}
+	else {
+		lsn = recover(ctl, &listenfd);		// load the files and replay the log,
+		wal_open("stock.wal", lsn);			// then log every change from now on
+	}
+	if (repl_port)
+		repl_serve(repl_port, kept_repl);
+	else if (kept_repl >= 0)
+		Close(kept_repl);
 	Signal(SIGINT, sigint_handler);			// install the SIGINT handler
 
-	listenfd = Open_listenfd(argv[1]);
-	sbuf_init(&sbuf, SBUFSIZE);
+	if (ctl < 0)
+		listenfd = Open_listenfd(argv[optind]);
+	log_event(LOG_START, atoi(argv[optind]), 0, 0);
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);	// accept till empty
+	ring_init(&sbuf, SBUFSIZE);
+	Sem_init(&conn_mutex, 0, 1);
+	Sem_init(&ckpt_hold, 0, 1);
+	Sem_init(&upgrade_failed, 0, 0);
 	for (int i = 0; i < NTHREADS; i++)
-		Pthread_create(&tid, NULL, thread, NULL);  	// spawn worker threads (consumer)
+		conn_active[i] = -1;
+	if (steal_workers > 0) {				// requests as tasks on a fixed set of
+		steal_init(steal_workers, stack_kb);	// workers which steal from each other
+		for (int i = 0; i < nkept; i++)
+			steal_open(kept[i]);
+	}
+	else if (coro_loops > 0 || partitions > 0) {	// a coroutine per connection on
+		if (partitions > 0)					// a few event loops, which may own
+			part_init(partitions);			// the items of some shards each
+		else
+			coro_init(coro_loops);
+		for (int i = 0; i < nkept; i++)
+			coro_open(kept[i]);
+	}
+	else {
+		pool_init(pool_min, pool_max, stack_kb);	// spawn a few worker threads (consumer),
+		Pthread_create(&tid, NULL, pool_manager, NULL);	// and more while clients wait
+		ring_insert_batch(&sbuf, kept, nkept);	// taken over from the old server
+	}
+	conn_accepted = nkept;
+	nkept = 0;
+	if (ckpt_interval > 0 && !primary)
+		Pthread_create(&tid, NULL, checkpointer, NULL);
+	if (pipe(upgrade_pipe) < 0)
+		unix_error("pipe error");
+	if (!primary && !steal_workers && !coro_loops) {	// (a replica owns no files, and
+		if (pipe(drain_pipe) < 0)			// a connection between two tasks or in a
+			unix_error("pipe error");		// coroutine can't be handed over)
+		Pthread_create(&tid, NULL, upgrader, (void *)(long)upgrade_listen());
+	}
+	if (placed)								// last, so the helper threads which
+		place_pin(PLACE_ACCEPTOR);			// we started don't inherit our CPU
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
 
 	while (1) {
-		clientlen = sizeof(struct sockaddr_storage);
-		connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-		Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-		printf("Connected to (%s, %s)\n", client_hostname, client_port);
-		sbuf_insert(&sbuf, connfd);
+		struct pollfd fds[2] = {{listenfd, POLLIN, 0}, {upgrade_pipe[0], POLLIN, 0}};
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("poll error");
+		}
+		if (fds[1].revents & POLLIN) {			// a new server takes over
+			if (read(upgrade_pipe[0], &ctl, sizeof(ctl)) == sizeof(ctl))
+				handoff(ctl, listenfd);			// (returns if it failed)
+			continue;
+		}
+
+		for (n = 0; n < ACCEPT_BATCH; n++) {	// every waiting connection
+			clientlen = sizeof(struct sockaddr_storage);
+			if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+						|| errno == ECONNABORTED)
+					break;
+				unix_error("Accept error");
+			}
+			log_connect(connfd, &clientaddr);	// (no name lookup, no stdout lock)
+			batch[n] = connfd;
+		}
+		conn_accepted += n;
+		if (steal_workers > 0)
+			for (int i = 0; i < n; i++)
+				steal_open(batch[i]);			// served when it has a request
+		else if (coro_loops > 0)
+			for (int i = 0; i < n; i++)
+				coro_open(batch[i]);
+		else
+			ring_insert_batch(&sbuf, batch, n);	// handed to the workers at once
 	}
 
 	exit(0);
 }
 
 /* Get and analyze the requests of clients */
-command what_command(char *buf, int *id, int *amount) {
+command what_command(char *buf, int *id, int *amount, int *price) {
 	char argument[10];
 	if (buf[0] == '\n')
 		return _error_;
 
-	sscanf(buf, "%s %d %d", argument, id, amount);
+	sscanf(buf, "%9s %d %d %d", argument, id, amount, price);
 
 	if (!strcmp(argument, "show"))
 		return _show_;
@@ -143,161 +420,344 @@ command what_command(char *buf, int *id, int *amount) {
 		return _buy_;
 	if (!strcmp(argument, "sell"))
 		return _sell_;
+	if (!strcmp(argument, "list"))				// admin commands for the catalog
+		return _list_;
+	if (!strcmp(argument, "delist"))
+		return _delist_;
+	if (!strcmp(argument, "lag"))				// state of replication
+		return _lag_;
+	if (!strcmp(argument, "pool"))				// state of the worker pool
+		return _pool_;
+	if (!strcmp(argument, "stats"))				// latency of the requests
+		return _stats_;
 	return _error_;
 }
 
-/* Choose task based on the type of request */
-void service(int connfd, char *buf, int n) {
-	int id, amount;
+/* Choose task based on the type of request, and send its reply (it has
+   waited 'queued' nsec for a thread) */
+void service(int connfd, char *buf, int n, uint64_t queued) {
+	StatSample stat = { 0, { queued } };
+	reply_t reply = execute(buf, &stat);
+	uint64_t start = stats_now();
+
+	send_reply(connfd, &reply);		// write routine is not under any exclusion
+	stat.phase[STAT_WRITE] = stats_now() - start;
+	stats_record(&stat);
+}
+
+/* Run a request and return its reply; its kind and the time it took
+   (waiting for writer locks, and the rest) go to 's' */
+reply_t execute(char *buf, StatSample *s) {
+	uint64_t start = stats_now(), waited = stock_waited;
+	int id, amount, price;
+	command cmd = what_command(buf, &id, &amount, &price);	// call by reference
+	reply_t reply;
+
+	if (repl_replica && cmd >= _buy_ && cmd <= _delist_)
+		cmd = _readonly_;							// only the primary's log changes it
+	switch (cmd) {
+	case _show_: show_range(buf, &id, &amount); reply = show_routine(id, amount); break;
+	case _buy_: reply = buy_routine(id, amount); break;
+	case _sell_: reply = sell_routine(id, amount); break;
+	case _list_: reply = list_routine(id, amount, price); break;
+	case _delist_: reply = delist_routine(id); break;
+	case _lag_: reply = lag_routine(); break;
+	case _pool_: reply = pool_routine(); break;
+	case _stats_: reply = stats_routine(); break;
+	case _readonly_: reply = message(readonly_msg); break;
+	case _exit_: reply = exit_routine(); break;
+	default: reply = message(error_msg); break;	// just send the 'error msg'
+	}
 
-	switch (what_command(buf, &id, &amount)) {		// call by reference for id, amount
-	case _show_: show_routine(connfd); break;
-	case _buy_: buy_routine(connfd, id, amount); break;
-	case _sell_: sell_routine(connfd, id, amount); break;
-	case _exit_: exit_routine(connfd); break;
-	case _error_: error_routine(connfd); break;
+	switch (cmd) {
+	case _show_: s->kind = STAT_SHOW; break;
+	case _buy_: s->kind = STAT_BUY; break;
+	case _sell_: s->kind = STAT_SELL; break;
+	case _readonly_: case _error_: s->kind = STAT_ERROR; break;
+	default: s->kind = STAT_OTHER; break;
 	}
+	s->phase[STAT_LOCK] = stock_waited - waited;
+	s->phase[STAT_EXECUTE] = stats_now() - start - s->phase[STAT_LOCK];
+	return reply;
 }
 
-/* Routine for 'show' service (routine of 'Reader') */
-void show_routine(int connfd) {
-	char printbuf[MAXLINE] = "";
+/* A reply of one of the global strings (padded to MAXLINE) */
+reply_t message(char *msg) {
+	reply_t reply = { msg, MAXLINE, 0 };
 
-	for (int i = 0; i < print_size; i++) {
-		char s1[128], s2[128], s3[128];
+	return reply;
+}
 
-		P(&(print[i]->mutex));				// mutual exclusion for the present item
-		(print[i]->readcnt)++;				// increment the number of readers
-		if (print[i]->readcnt == 1)			// if there's at least one reader, then
-			P(&(print[i]->w));				// blocking every writer!
-		V(&(print[i]->mutex));
+/* Send a reply (and free it if it is not a global string) */
+void send_reply(int connfd, reply_t *reply) {
+	Rio_writen(connfd, reply->buf, reply->len);
+	if (reply->owned)
+		Free(reply->buf);
+}
 
-		rio_itoa(print[i]->ID, s1, 10);
-		rio_itoa(print[i]->left_stock, s2, 10);		// transform integer into string
-		rio_itoa(print[i]->price, s3, 10);
+/* Move the first request line of the 'len' bytes read into 'in' to 'line'
+   (as Rio_readlineb would return it, 'eof': nothing more comes); return
+   its length, 0 if there is no whole line yet */
+int take_line(char *in, int *len, char *line, int eof) {
+	char *nl = memchr(in, '\n', *len);
+	int n;
+
+	if (!nl && *len < MAXLINE - 1 && !(eof && *len > 0))
+		return 0;
+	n = nl ? nl - in + 1 : *len;
+	memcpy(line, in, n);
+	line[n] = '\0';
+	memmove(in, in + n, *len -= n);
+	return n;
+}
 
-		strcat(printbuf, s1); strcat(printbuf, " ");
-		strcat(printbuf, s2); strcat(printbuf, " ");
-		strcat(printbuf, s3); strcat(printbuf, "\n");
+/* Routine for 'show' service of the IDs lo..hi (routine of 'Reader', never
+   blocks writers) */
+reply_t show_routine(int lo, int hi) {
+	reply_t reply;
+	size_t len;
+	char *printbuf = stock_show_range(lo, hi, &len, MAXLINE);	// shards are scanned in parallel
+
+	reply.buf = printbuf;
+	reply.len = frames(printbuf, len);
+	reply.owned = 1;
+	return reply;
+}
 
-		P(&(print[i]->mutex));
-		(print[i]->readcnt)--;
-		if (print[i]->readcnt == 0)			// allow writers to do their tasks only if
-			V(&(print[i]->w));				// there's no readers!
-		V(&(print[i]->mutex));
-	}
+/* Bounds of the IDs of a 'show <lo> <hi>' request ('show' alone: every item,
+   'show <lo>': from lo on) */
+void show_range(char *buf, int *lo, int *hi) {
+	*lo = INT_MIN;
+	*hi = INT_MAX;
+	sscanf(buf, "%*s %d %d", lo, hi);
+}
+
+/* Pad a reply to MAXLINE-sized frames, a full frame means 'to be continued';
+   return the padded length */
+size_t frames(char *buf, size_t len) {
+	size_t total = (len / MAXLINE + 1) * MAXLINE;	// at least one '\0' at the end
 
-	Rio_writen(connfd, printbuf, MAXLINE);	// write routine is not under the exclusion
+	memset(buf + len, 0, total - len);				// (buf must hold len + MAXLINE)
+	return total;
 }
 
 /* Routine for 'buy' service (routine of 'Writer 1') */
-void buy_routine(int connfd, int id, int amount) {
-	Item *temp = SearchTree(root, id);
-	char *buy_msg;
-
-	P(&(temp->w));						// mutual exclusion for the present item
-	if (temp->left_stock < amount)		// only one writer can access at one time
-		buy_msg = buy_error_msg;
-	else {
-		temp->left_stock -= amount;		// update the left_stock
-		buy_msg = buy_success_msg;
+reply_t buy_routine(int id, int amount) {
+	switch (stock_buy(id, amount)) {
+	case _ok_: return message(buy_success_msg);
+	case _not_enough_: return message(buy_error_msg);
+	default: return message(no_item_msg);
 	}
-	V(&(temp->w));
-
-	Rio_writen(connfd, buy_msg, MAXLINE);
 }
 
 /* Routine for 'sell' service (routine for 'Writer 2') */
-void sell_routine(int connfd, int id, int amount) {
-	Item *temp = SearchTree(root, id);
+reply_t sell_routine(int id, int amount) {
+	if (stock_sell(id, amount) == _ok_)
+		return message(sell_success_msg);
+	return message(no_item_msg);
+}
+
+/* Routine for 'list' service (adds a new item while readers keep going) */
+reply_t list_routine(int id, int amount, int price) {
+	if (id < stock_lo || id > stock_hi)				// another server's range
+		return message(range_error_msg);
+	if (stock_list(id, amount, price) == _ok_)
+		return message(list_success_msg);
+	return message(list_error_msg);
+}
+
+/* Routine for 'delist' service (removes an item while readers keep going) */
+reply_t delist_routine(int id) {
+	if (stock_delist(id) == _ok_)
+		return message(delist_success_msg);
+	return message(no_item_msg);
+}
 
-	P(&(temp->w));						// mutual exclusion for 'writer'
-	temp->left_stock += amount;			// update the left_stock
-	V(&(temp->w));
+/* Routine for 'lag' service (how far replicas are behind the primary) */
+reply_t lag_routine(void) {
+	reply_t reply = { Calloc(1, MAXLINE), MAXLINE, 1 };
 
-	Rio_writen(connfd, sell_success_msg, MAXLINE);
+	repl_report(reply.buf, MAXLINE - 1);
+	return reply;
+}
+
+/* Routine for 'pool' service (size of the pool and queueing delay, or the
+   counters of work stealing) */
+reply_t pool_routine(void) {
+	reply_t reply = { Calloc(1, MAXLINE), MAXLINE, 1 };
+
+	if (steal_workers > 0)
+		sched_report(reply.buf, MAXLINE - 1);
+	else if (coro_loops > 0)
+		coro_report(reply.buf, MAXLINE - 1);
+	else
+		pool_report(reply.buf, MAXLINE - 1);
+	return reply;
+}
+
+/* Routine for 'stats' service (percentiles of every phase of the requests
+   served so far, by kind) */
+reply_t stats_routine(void) {
+	reply_t reply = { Malloc(STATS_REPLY + MAXLINE), 0, 1 };
+
+	reply.len = frames(reply.buf, stats_report(reply.buf, STATS_REPLY));
+	return reply;
 }
 
 /* Routine for 'exit' service */
-void exit_routine(int connfd) {
-	Rio_writen(connfd, exit_msg, MAXLINE);
+reply_t exit_routine(void) {
+	return message(exit_msg);
 	// server has nothing to do with termination of client!
 	// client will be terminated based on its own routine.
 	//  ex) client check the message from server at every iteration,
 	//      and if the message is "exit", then, terminate itself.
 }
 
-/* Routine for errorneous requests from clients */
-void error_routine(int connfd) {
-	Rio_writen(connfd, error_msg, MAXLINE);		// just send the 'error msg'
-}
-
-/* Read the 'stock.txt' file and construct the AVL tree */
-void stock_load(void) {
-	int id, left_stock, price;
-	char eachLine[128];
-	FILE *fp;
+/* Thread routine (routine of 'Worker/Consumer Threads'), 'vargp' is the
+   slot of the worker in the pool */
+void *thread(void *vargp) {
+	Pthread_detach(pthread_self());				// reserve the reaping of thread
+	rcu_register();								// this thread reads the catalog
+	if (placed)
+		place_pin((long)vargp);					// (by slot: a worker per core)
 
-	if (!(fp = fopen("stock.txt", "rt"))) {
-		fprintf(stderr, "The 'stock.txt' file does not exist.\n");
-		exit(0);
-	}
-
-	while (Fgets(eachLine, sizeof(eachLine), fp)) {
-		sscanf(eachLine, "%d %d %d", &id, &left_stock, &price);
-		root = InsertTree(root, id, left_stock, price);
+	while (1) {
+		double stamp;
+		int n, connfd = ring_remove(&sbuf, POOL_IDLE, &stamp); 	// consume the item from the buffer
+		char buf[MAXLINE];
+		rio_t rio;
+		uint64_t queued;
+
+		if (connfd < 0) {							// idle for a while
+			if (pool_retire((long)vargp))
+				break;
+			continue;
+		}
+		pool_delay(stamp);
+		queued = (ring_now() - stamp) * 1e9;		// (the first request waited)
+		if (!conn_begin((long)vargp, connfd))	// kept for the new server
+			continue;
+		Rio_readinitb(&rio, connfd);
+		while (conn_wait((long)vargp, &rio)) {	// (unless kept for a new server)
+			if ((n = Rio_readlineb(&rio, buf, MAXLINE)) == 0) {		// get requests
+				conn_end((long)vargp);								// until the
+				log_event(LOG_CLOSE, connfd, 0, 0);					// client leaves
+				Close(connfd);
+				break;
+			}
+			log_event(LOG_REQUEST, connfd, n, 0);
+			service(connfd, buf, n, queued);							// and service!
+			queued = 0;
+		}
 	}
 
-	Fclose(fp);
+	rcu_unregister();
+	return NULL;
 }
 
-/* Store the updated 'stock.txt' file (when the server terminates) */
-void stock_store(void) {
-	FILE *fp;
+/* Thread routine of periodic checkpoints (written by a forked child) */
+void *checkpointer(void *vargp) {
+	Pthread_detach(pthread_self());
+	rcu_register();								// the child reads the catalog
 
-	if (!(fp = fopen("stock.txt", "wt"))) {
-		fprintf(stderr, "File open error occurs in Store Routine.\n");
-		exit(0);
+	while (1) {
+		Checkpoint ck;
+
+		sleep(ckpt_interval);
+		P(&ckpt_hold);							// (a new server replays this log)
+		ck = stock_checkpoint("stock.snap");
+		V(&ckpt_hold);
+		printf("checkpoint %s: %u items up to LSN %llu, pause %.3f ms, duration %.1f ms\n",
+				ck.ok ? "done" : "FAILED", ck.items, (unsigned long long)ck.lsn,
+				ck.pause * 1e3, ck.duration * 1e3);
 	}
+}
 
-	for (int i = 0; i < print_size; i++) {		// just traverse the pointer array
-		char eachLine[128];
-
-		sprintf(eachLine, "%d %d %d\n", print[i]->ID, print[i]->left_stock, print[i]->price);
-
-		Fputs(eachLine, fp);
+/* Load the newest valid file and replay the changes logged after it;
+   return the LSN of the last change. On an upgrade ('ctl' >= 0) the old
+   server hands over in between, once it has logged its last change */
+uint64_t recover(int ctl, int *listenfd) {
+	struct timespec start, handover, end;
+	char *from = "stock.snap";
+	uint64_t lsn = 0;
+	uint32_t failed;
+	WalRecord *recs;
+	size_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!snapshot_newer("stock.snap", "stock.txt")			// map the last checkpoint,
+			|| stock_load_snapshot("stock.snap", &lsn) < 0) {
+		from = "stock.txt";
+		lsn = stock_load("stock.txt");		// or import 'stock.txt'
+	}
+	if (ctl >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &handover);
+		*listenfd = upgrade_take(ctl);
 	}
 
-	Fclose(fp);
+	recs = wal_recover("stock.wal", lsn, &n);
+	failed = stock_replay(recs, n);		// (a clean shutdown leaves no log)
+	if (n > 0)
+		lsn = recs[n - 1].lsn;
+	free(recs);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Recovered %u items from '%s' and %zu logged changes (%u failed) up to LSN %llu in %.1f ms\n",
+			stock_size(), from, n, failed, (unsigned long long)lsn,
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	if (failed > 0)						// (records are in the order of the changes)
+		fprintf(stderr, "Warning: %u logged changes failed again, the store differs "
+				"from the one before the crash\n", failed);
+	if (ctl >= 0)
+		printf("Took over %d connections, accepting was held for %.1f ms\n", nkept,
+				(end.tv_sec - handover.tv_sec) * 1e3 + (end.tv_nsec - handover.tv_nsec) / 1e6);
+	fflush(stdout);
+	return lsn;
 }
 
-/* Thread routine (routine of 'Worker/Consumer Threads') */
-void *thread(void *vargp) {
-	Pthread_detach(pthread_self());				// reserve the reaping of thread
-
-	while (1) {
-		int n, connfd = sbuf_remove(&sbuf); 	// consume the item from the buffer
-		char buf[MAXLINE];
-		rio_t rio;
-
-		Rio_readinitb(&rio, connfd);
-		while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {			// get requests
-			printf("server received %d bytes\n", n);
-			service(connfd, buf, n);									// and service!
-		}
-
-		Close(connfd);
-	}
+/* Whether 'snapshot' exists and isn't older than 'text' (an edited text
+   file is imported instead) */
+int snapshot_newer(char *snapshot, char *text) {
+	struct stat snap_st, text_st;
+
+	if (stat(snapshot, &snap_st) < 0)
+		return 0;
+	if (stat(text, &text_st) < 0)
+		return 1;
+	if (snap_st.st_mtim.tv_sec != text_st.st_mtim.tv_sec)
+		return snap_st.st_mtim.tv_sec > text_st.st_mtim.tv_sec;
+	return snap_st.st_mtim.tv_nsec >= text_st.st_mtim.tv_nsec;
 }
 
 /* Signal handler for SIGINT signal */
 void sigint_handler(int sig) {
 	int olderrno = errno;
+	char buf[MAXLINE];
 
-	stock_store();				// if Ctrl+C pressed, update the 'stock.txt',
-	sbuf_deinit(&sbuf);			// clear the shared buffer,
-	ClearTree(root);			// clear the AVL tree.
-	printf("\nServer has terminated with 'stock.txt' update!\n");
+	log_flush();				// (what the flusher has not written yet)
+	if (repl_replica) {			// a replica owns no files
+		printf("\nReplica has terminated!\n");
+		exit(0);
+	}
+	stock_pause();				// if Ctrl+C pressed, hold every change,
+	stock_store("stock.txt");	// update the 'stock.txt' and the snapshot,
+	stock_store_snapshot("stock.snap");
+	wal_reset();				// empty the log (the files hold every change),
+	stock_clear();				// clear the AVL trees.
+	printf("\nWAL commit latency (usec): p50 %ld, p99 %ld, p99.9 %ld\n",
+			wal_latency(0.5), wal_latency(0.99), wal_latency(0.999));
+	if (steal_workers > 0 || coro_loops > 0) {
+		if (steal_workers > 0)
+			sched_report(buf, sizeof(buf));
+		else
+			coro_report(buf, sizeof(buf));
+		printf("%s", buf);
+	}
+	else
+		printf("Worker pool: peak %d workers, %ld started, %ld retired, queueing delay max %.3f ms\n",
+				pool.peak, pool.started, pool.retired, pool.delay_max / 1e3);
+	ring_deinit(&sbuf);			// clear the shared buffer
+	printf("Server has terminated with 'stock.txt' update!\n");
 	exit(0);
 
 	errno = olderrno;
@@ -307,165 +767,828 @@ void sigint_handler(int sig) {
 
 
 
-/** Subroutines for 'Producer-Consumer Problem' **/
-/* Create 'Empty, Bounded, Shared FIFO buffer' which can contain n slots */
-void sbuf_init(sbuf_t *sp, int n) {
-	sp->buf = Calloc(n, sizeof(int));		// dynamic allocation for buffer
-	sp->n = n; 								// maximum of n slots
-	sp->front = sp->rear = 0; 				// initialize as empty
-	Sem_init(&sp->mutex, 0, 1); 			// binary semaphore for locking
-	Sem_init(&sp->slots, 0, n); 			// counting semaphore with 'n'
-	Sem_init(&sp->items, 0, 0); 			// initial state for 'items' is zero
+/**        Subroutines for Work Stealing        **/
+/* Start the workers and the reactor which turns a readable connection
+   into a task for the worker that served it last */
+void steal_init(int workers, int stack_kb) {
+	struct rlimit rl;
+	pthread_t tid;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20))
+		rl.rlim_cur = 1 << 20;
+	conn_max = rl.rlim_cur;
+	conns = Calloc(conn_max, sizeof(Conn *));
+	if ((epfd = epoll_create1(0)) < 0)
+		unix_error("epoll_create1 error");
+	sched_init(workers, stack_kb, step, steal_start);
+	Pthread_create(&tid, NULL, reactor, NULL);
 }
 
-/* Function for clearing the shared buffer */
-void sbuf_deinit(sbuf_t *sp) {
-	Free(sp->buf);								// just free the pointer
+/* Start serving a new connection: it becomes a task once it is readable */
+void steal_open(int connfd) {
+	struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .fd = connfd } };
+	Conn *c;
+
+	if (connfd >= conn_max) {
+		Close(connfd);
+		return;
+	}
+	c = Calloc(1, sizeof(Conn));
+	c->fd = connfd;
+	c->home = connfd % sched_workers();
+	c->step = _parse_;
+	c->pushed = stats_now();
+	conns[connfd] = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+		unix_error("epoll_ctl error");
 }
 
-/* Insert new item into the 'rear' point of shared buffer */
-void sbuf_insert(sbuf_t *sp, int item) {
-	P(&sp->slots); 								// waits for available slots
-	P(&sp->mutex); 								// lock
-	sp->buf[(++sp->rear) % (sp->n)] = item;		// item insertion (produce)
-	V(&sp->mutex); 								// unlock
-	V(&sp->items); 							// notify that there's new available item!
+/* Thread routine of the reactor: every readable connection goes to the
+   inbox of its home worker (one-shot: it is not watched while a task runs) */
+void *reactor(void *vargp) {
+	struct epoll_event events[REACTOR_EVENTS];
+
+	Pthread_detach(pthread_self());
+	if (placed)
+		place_pin(PLACE_REACTOR);
+	while (1) {
+		int n = epoll_wait(epfd, events, REACTOR_EVENTS, -1);
+
+		if (n < 0 && errno != EINTR)
+			unix_error("epoll_wait error");
+		for (int i = 0; i < n; i++) {
+			Conn *c = conns[events[i].data.fd];
+
+			c->pushed = stats_now();				// (its task is queued from now)
+			sched_submit(c->fd, c->home);
+		}
+	}
+
+	return NULL;
 }
 
-/* Delete the item at the 'front' point of shared buffer, and return it */
-int sbuf_remove(sbuf_t *sp) {
-	int item;
+/* Run the next step of connection 'fd' on worker 'w': parse a request,
+   execute it, write its reply; each step queues the next one on the
+   deque of 'w', where an idle worker may steal it */
+void step(int fd, int w) {
+	Conn *c = conns[fd];
+	uint64_t start = stats_now();
 
-	P(&sp->items); 								// waits for available items
-	P(&sp->mutex); 								// provides serialization 
-	item = sp->buf[(++sp->front) % (sp->n)]; 	// item removement (consume)
-	V(&sp->mutex);
-	V(&sp->slots); 							// notify that there's new available slot!
+	c->home = w;
+	c->stat.phase[STAT_QUEUE] += start - c->pushed;
+	switch (c->step) {
+	case _parse_:
+		if (!parse_step(c))
+			return;								// waits for the client again
+		c->step = _execute_;
+		break;
+	case _execute_:
+		c->reply = execute(c->line, &c->stat);
+		c->step = _write_;
+		break;
+	case _write_:
+		send_reply(fd, &c->reply);
+		c->stat.phase[STAT_WRITE] = stats_now() - start;
+		stats_record(&c->stat);
+		memset(&c->stat, 0, sizeof(StatSample));
+		c->step = _parse_;						// (more requests may be buffered)
+		break;
+	}
+	c->pushed = stats_now();
+	sched_push(fd, w);
+}
 
-	return item;
+/* Take the next request line of a connection into 'line'; 0 if there is
+   none yet (the connection is watched again) or the client has left */
+int parse_step(Conn *c) {
+	struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .fd = c->fd } };
+	int eof = 0;
+
+	while (1) {
+		int n;
+
+		if ((n = take_line(c->in, &c->len, c->line, eof)) > 0) {
+			log_event(LOG_REQUEST, c->fd, n, 0);
+			return 1;
+		}
+		if (eof)
+			break;
+		if ((n = recv(c->fd, c->in + c->len, MAXLINE - 1 - c->len, MSG_DONTWAIT)) > 0)
+			c->len += n;
+		else if (n == 0)
+			eof = 1;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+				unix_error("epoll_ctl error");
+			return 0;
+		}
+		else if (errno != EINTR)
+			break;
+	}
+
+	steal_close(c);								// the client has left
+	return 0;
 }
-/*Subroutines for 'Producer-Consumer Problem' End*/
 
+/* Close a connection of the work-stealing mode */
+void steal_close(Conn *c) {
+	log_event(LOG_CLOSE, c->fd, 0, 0);
+	conns[c->fd] = NULL;
+	Close(c->fd);								// (leaves the epoll set too)
+	Free(c);
+	P(&conn_mutex);
+	conn_done++;
+	V(&conn_mutex);
+}
+
+/* Start routine of every work-stealing worker */
+void steal_start(int w) {
+	rcu_register();								// the workers read the catalog
+	if (placed)
+		place_pin(w);
+}
+/**      Subroutines for Work Stealing End      **/
 
 
-/***        Subroutines for the AVL Tree       ***/
-/* Node insertion routine of AVL tree */
-Item* InsertTree(Item* node, int id, int left_stock, int price) {
-	Item* new_item;
 
-	if (node == NULL) {								// if recursion met NULL,
-		new_item = (Item*)malloc(sizeof(Item));		// create new node!
-		new_item->ID = id;
-		new_item->left_stock = left_stock;
-		new_item->price = price;
-		new_item->height = 0;
-		new_item->left = new_item->right = NULL;	// initialization routine
-		new_item->readcnt = 0;
-		Sem_init(&(new_item->mutex), 0, 1);			// initialize semaphore variables
-		Sem_init(&(new_item->w), 0, 1);
-		print[print_size++] = new_item;				// insert into pointer array too!
-		return new_item;
+/**          Subroutines for Coroutines         **/
+/* Start 'n' event loops, each on its own thread */
+void coro_init(int n) {
+	pthread_t tid;
+
+	coro_loops = n;
+	loops = Calloc(n, sizeof(CoLoop));
+	for (long i = 0; i < n; i++) {
+		co_loop_init(&loops[i], conn_open, conn_close);
+		if (partitions > 0)
+			loops[i].poll = part_poll;			// requests from the other cores
+		Pthread_create(&tid, NULL, coro_loop, (void *)i);
 	}
+}
 
-	if (id > node->ID) {
-		node->right = InsertTree(node->right, id, left_stock, price);
+/* Hand a new connection to its loop, where it becomes a coroutine */
+void coro_open(int connfd) {
+	co_submit(&loops[connfd % coro_loops], connfd);
+}
 
-		if ((GetHeight(node->right) - GetHeight(node->left)) == 2) {
-			if (id > node->right->ID)
-				node = SingleRotateRight(node);
-			else
-				node = DoubleRotateRight(node);
-		}											// insertion algorithm of AVL tree
+/* Thread routine of loop 'vargp' */
+void *coro_loop(void *vargp) {
+	Pthread_detach(pthread_self());
+	rcu_register();								// the coroutines read the catalog
+	if (placed)
+		place_pin((long)vargp);
+	co_run(&loops[(long)vargp]);
+
+	return NULL;
+}
+
+/* Make a coroutine of connection 'connfd' (called by its loop) */
+void conn_open(CoLoop *loop, int connfd) {
+	CoConn *c = Malloc(sizeof(CoConn));
+
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+	c->eof = c->len = 0;
+	co_start(loop, &c->co, connfd, conn_coro);
+}
+
+/* Coroutine of a connection: the read/service/write loop of thread(),
+   which waits for the connection wherever thread() would block */
+int conn_coro(Coro *co) {
+	CoConn *c = (CoConn *)co;
+	ssize_t n;
+
+	CO_BEGIN(co);
+	while (1) {
+		while ((n = take_line(c->in, &c->len, c->line, c->eof)) == 0) {	// get a request
+			if (c->eof)
+				goto closed;
+			if ((n = recv(co->fd, c->in + c->len, MAXLINE - 1 - c->len, 0)) > 0)
+				c->len += n;
+			else if (n == 0)
+				c->eof = 1;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				CO_WAIT(co, EPOLLIN);
+			else if (errno != EINTR)
+				goto closed;
+		}
+		log_event(LOG_REQUEST, co->fd, n, 0);
+
+		memset(&c->stat, 0, sizeof(StatSample));
+		if (partitions > 0 && part_route(c) != PART_LOCAL) {	// served by the owners
+			c->stat.phase[STAT_QUEUE] = stats_now();			// of its items
+			while (!part_post(c))
+				CO_YIELD(co);									// (a queue is full)
+			while (c->pending > 0)
+				CO_WAIT(co, 0);									// (the last reply
+			c->reply = part_reply(c);							// resumes us)
+			c->stat.phase[STAT_QUEUE] = stats_now() - c->stat.phase[STAT_QUEUE];
+		}
+		else
+			c->reply = execute(c->line, &c->stat);				// and service!
+		c->stat.phase[STAT_WRITE] = stats_now();
+		for (c->sent = 0; c->sent < c->reply.len; ) {
+			if ((n = send(co->fd, c->reply.buf + c->sent, c->reply.len - c->sent,
+					MSG_NOSIGNAL)) > 0)
+				c->sent += n;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				CO_WAIT(co, EPOLLOUT);
+			else if (errno != EINTR)
+				break;								// (the next recv finds out)
+		}
+		c->stat.phase[STAT_WRITE] = stats_now() - c->stat.phase[STAT_WRITE];
+		stats_record(&c->stat);
+		if (c->reply.owned)
+			Free(c->reply.buf);
 	}
-	else if (id < node->ID) {
-		node->left = InsertTree(node->left, id, left_stock, price);
+closed:
+	CO_END(co);
+}
 
-		if ((GetHeight(node->left) - GetHeight(node->right)) == 2) {
-			if (id < node->left->ID)
-				node = SingleRotateLeft(node);
+/* Free the coroutine of a connection which has ended */
+void conn_close(Coro *co) {
+	log_event(LOG_CLOSE, co->fd, 0, 0);
+	Close(co->fd);								// (leaves the epoll set too)
+	Free(co);
+	P(&conn_mutex);
+	conn_done++;
+	V(&conn_mutex);
+}
+
+/* Write the counters of the loops into 'buf' */
+void coro_report(char *buf, size_t size) {
+	long resumed = 0, sent = 0;
+	int live = 0;
+
+	for (int i = 0; i < coro_loops; i++) {
+		resumed += __atomic_load_n(&loops[i].resumed, __ATOMIC_RELAXED);
+		live += __atomic_load_n(&loops[i].live, __ATOMIC_RELAXED);
+		if (partitions > 0)
+			sent += __atomic_load_n(&part_sent[i], __ATOMIC_RELAXED);
+	}
+	if (partitions > 0)
+		snprintf(buf, size, "Shared-nothing: %d cores, %d connections, %ld resumes, "
+				"%ld requests sent to owners\n", partitions, live, resumed, sent);
+	else
+		snprintf(buf, size, "Coroutines: %d loops, %d connections, %ld resumes\n", coro_loops,
+				live, resumed);
+}
+/**        Subroutines for Coroutines End       **/
+
+
+
+/**    Subroutines for Shared-Nothing Cores     **/
+/* Start 'n' cores: each runs a loop of coroutines, and owns (is the only
+   writer of) the shards i with i mod n == its index */
+void part_init(int n) {
+	partitions = n;
+	part_req = Calloc(n * n, sizeof(Spsc));
+	part_rep = Calloc(n * n, sizeof(Spsc));
+	part_sent = Calloc(n, sizeof(long));
+	for (int i = 0; i < n * n; i++)
+		if (i / n != i % n) {					// (no queue to itself)
+			spsc_init(&part_req[i], PART_QUEUE);
+			spsc_init(&part_rep[i], PART_QUEUE);
+		}
+	if (!repl_replica)
+		stock_owned = 1;						// (a replica's log applier writes too)
+	coro_init(n);
+}
+
+/* Prepare the requests to other cores which serving the request of 'c'
+   takes; return PART_LOCAL if its core serves it alone */
+int part_route(CoConn *c) {
+	int me = c->co.loop - loops, id, amount, price, owner;
+	command cmd = what_command(c->line, &id, &amount, &price);
+
+	switch (cmd) {
+	case _buy_: case _sell_: case _list_: case _delist_:
+		if ((owner = stock_shard(id) % partitions) == me)
+			return PART_LOCAL;
+		c->stat.kind = cmd == _buy_ ? STAT_BUY : cmd == _sell_ ? STAT_SELL : STAT_OTHER;
+		c->msg = (PartMsg){ c, owner, -1, c->line, { NULL, 0, 0 } };
+		c->parts = &c->msg;
+		c->nparts = 1;
+		break;
+	case _show_:								// every core formats its items,
+		c->stat.kind = STAT_SHOW;
+		c->parts = Calloc(partitions, sizeof(PartMsg));	// ours right now
+		for (int i = 0; i < partitions; i++)
+			c->parts[i] = (PartMsg){ c, i, i, c->line, { NULL, 0, 1 } };
+		show_range(c->line, &id, &amount);
+		c->parts[me].reply.buf = stock_show_part(me, partitions, id, amount, &c->parts[me].reply.len);
+		c->nparts = partitions;
+		break;
+	default:
+		return PART_LOCAL;
+	}
+	c->posted = c->pending = 0;
+	return c->nparts == 1 ? c->msg.to : PART_ALL;
+}
+
+/* Post the requests of 'c' to their cores; 0 if a queue is full (the rest
+   is posted by the next call) */
+int part_post(CoConn *c) {
+	int me = c->co.loop - loops;
+
+	for (; c->posted < c->nparts; c->posted++) {
+		PartMsg *m = &c->parts[c->posted];
+
+		if (m->to == me)
+			continue;							// (done already)
+		if (!spsc_push(&part_req[me * partitions + m->to], m))
+			return 0;
+		c->pending++;
+		__atomic_store_n(&part_sent[me], part_sent[me] + 1, __ATOMIC_RELAXED);
+		co_notify(&loops[m->to]);
+	}
+	return 1;
+}
+
+/* Own work of core 'loop' before it sleeps: take the replies to its
+   connections, and serve the requests of other cores for its items as
+   long as their replies fit; return how many messages it took */
+int part_poll(CoLoop *loop) {
+	int me = loop - loops, found = 0;
+
+	for (int from = 0; from < partitions; from++) {
+		Spsc *reps = &part_rep[from * partitions + me], *reqs = &part_req[from * partitions + me];
+		Spsc *back = &part_rep[me * partitions + from];
+		PartMsg *m;
+		int room, served = 0;
+
+		if (from == me)
+			continue;
+		while ((m = spsc_pop(reps)) != NULL) {		// (replies never wait, so no
+			found++;								// two cores wait for each other)
+			if (--m->conn->pending == 0)
+				co_resume(&m->conn->co);
+		}
+		for (room = spsc_room(back); room > 0 && (m = spsc_pop(reqs)) != NULL; room--) {
+			StatSample unused;						// (counted by the connection)
+			int lo, hi;
+
+			if (m->part >= 0) {
+				show_range(m->line, &lo, &hi);
+				m->reply.buf = stock_show_part(me, partitions, lo, hi, &m->reply.len);
+			}
 			else
-				node = DoubleRotateLeft(node);
+				m->reply = execute(m->line, &unused);
+			spsc_push(back, m);
+			served++;
+		}
+		if (served > 0)
+			co_notify(&loops[from]);
+		found += served;
+	}
+	return found;
+}
+
+/* Return the reply of 'c' once every request has been served: the owner's
+   reply, or the parts of 'show' from every core */
+reply_t part_reply(CoConn *c) {
+	reply_t reply = { NULL, 0, 1 };
+	char **text;
+	size_t *lens, off;
+
+	if (c->parts == &c->msg)
+		return c->msg.reply;
+
+	text = Malloc(c->nparts * sizeof(char *));
+	lens = Malloc(c->nparts * sizeof(size_t));
+	for (int i = 0; i < c->nparts; i++) {
+		text[i] = c->parts[i].reply.buf;
+		lens[i] = c->parts[i].reply.len;
+	}
+	reply.buf = stock_merge(text, lens, c->nparts, &off, MAXLINE);	// in ID order
+	for (int i = 0; i < c->nparts; i++)
+		Free(c->parts[i].reply.buf);
+	Free(text);
+	Free(lens);
+	Free(c->parts);
+	reply.len = frames(reply.buf, off);
+	return reply;
+}
+/**   Subroutines for Shared-Nothing Cores End  **/
+
+
+
+/**         Subroutines for Hot Upgrade         **/
+/* Open the control socket where a new server asks for the handoff */
+int upgrade_listen(void) {
+	struct sockaddr_un addr;
+	int fd = Socket(AF_UNIX, SOCK_SEQPACKET, 0);		// messages keep their bounds
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, UPGRADE_SOCK);
+	unlink(UPGRADE_SOCK);							// left by the previous server
+	if (bind(fd, (SA *)&addr, sizeof(addr)) < 0)
+		unix_error("Upgrade socket error");
+	Listen(fd, 1);
+
+	return fd;
+}
+
+/* Connect to the server running in this directory and hold its checkpoints,
+   so the log after the files which are about to be loaded stays in place */
+int upgrade_connect(void) {
+	struct sockaddr_un addr;
+	int ctl = Socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	char tag[UPGRADE_TAG + 1];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, UPGRADE_SOCK);
+	if (connect(ctl, (SA *)&addr, sizeof(addr)) < 0)
+		unix_error("No server to take over");
+	if (send_msg(ctl, "hold", NULL, 0, NULL, 0) < 0
+			|| recv_msg(ctl, tag, NULL, 0, NULL, NULL) < 0 || strcmp(tag, "ok"))
+		app_error("The running server refused the upgrade");
+
+	return ctl;
+}
+
+/* Ask the old server to hand over, and return the listening socket; its
+   connections (none in the middle of a request) go to 'kept' */
+int upgrade_take(int ctl) {
+	int fds[UPGRADE_FDS], nfds, listenfd = -1;
+	char tag[UPGRADE_TAG + 1];
+
+	if (send_msg(ctl, "handoff", NULL, 0, NULL, 0) < 0)
+		app_error("The running server is gone");
+	while (recv_msg(ctl, tag, NULL, 0, fds, &nfds) >= 0) {
+		if (!strcmp(tag, "listen") && nfds >= 1) {
+			listenfd = fds[0];
+			if (nfds > 1)
+				kept_repl = fds[1];				// (replicas connect again)
+		}
+		else if (!strcmp(tag, "conns")) {
+			if (nkept + nfds > SBUFSIZE + NTHREADS) {	// more than we can serve: fail,
+				for (int i = 0; i < nfds; i++)			// so the old server serves on
+					Close(fds[i]);
+				break;
+			}
+			memcpy(kept + nkept, fds, nfds * sizeof(int));
+			nkept += nfds;
+		}
+		else if (!strcmp(tag, "done") && listenfd >= 0) {
+			send_msg(ctl, "taken", NULL, 0, NULL, 0);	// the old server may exit
+			Close(ctl);
+			return listenfd;
 		}
 	}
-	else unix_error("Stock list in stock.txt has something wrong!\n");
+	app_error("The running server failed to hand over");
+	return -1;
+}
+
+/* Thread routine which waits for a new server: the checkpoints are held
+   while it loads the files, then the main thread hands over */
+void *upgrader(void *vargp) {
+	int ctlfd = (long)vargp;
+	char tag[UPGRADE_TAG + 1];
 
-	node->height = GetGreater(GetHeight(node->left), GetHeight(node->right)) + 1;
-	// coordinates heights!
-	return node;
+	Pthread_detach(pthread_self());
+	while (1) {
+		int ctl = accept(ctlfd, NULL, NULL);
+
+		if (ctl < 0)
+			continue;
+		if (recv_msg(ctl, tag, NULL, 0, NULL, NULL) >= 0 && !strcmp(tag, "hold")) {
+			P(&ckpt_hold);						// waits for a running checkpoint
+			if (send_msg(ctl, "ok", NULL, 0, NULL, 0) == 0
+					&& recv_msg(ctl, tag, NULL, 0, NULL, NULL) >= 0 && !strcmp(tag, "handoff")) {
+				Rio_writen(upgrade_pipe[1], &ctl, sizeof(ctl));
+				P(&upgrade_failed);				// (the process exits on success)
+			}
+			V(&ckpt_hold);						// the new server gave up
+		}
+		Close(ctl);
+	}
 }
 
-/* Inorder traversal for searching some items */
-Item* SearchTree(Item* node, int id) {
-	if (node == NULL || node->ID == id)
-		return node;
+/* Hand the listening sockets to the new server: the requests in flight are
+   served and logged first, then every connection goes along with the
+   socket (the client keeps its session), and the process exits. Nothing
+   is closed, so a failed handoff just serves on */
+void handoff(int ctl, int listenfd) {
+	int socks[2] = {listenfd, repl_listenfd};		// (and the one of replicas)
+	char c = 0, tag[UPGRADE_TAG + 1];
+	uint64_t last;
+	int i, idle = 0;
+
+	P(&conn_mutex);
+	draining = 1;										// no connection starts, and
+	V(&conn_mutex);										// the workers keep theirs
+	Rio_writen(drain_pipe[1], &c, 1);					// after the current request
+	while (!idle) {
+		P(&conn_mutex);
+		idle = (conn_done == conn_accepted);			// the buffer is empty too
+		V(&conn_mutex);
+		if (!idle)
+			usleep(1000);
+	}
+	last = wal_last();
+	wal_close();									// every change is on disk
+
+	if (send_msg(ctl, "listen", NULL, 0, socks, repl_listenfd >= 0 ? 2 : 1) == 0) {
+		for (i = 0; i < nkept; i += UPGRADE_FDS)
+			if (send_msg(ctl, "conns", NULL, 0, kept + i,
+						nkept - i < UPGRADE_FDS ? nkept - i : UPGRADE_FDS) < 0)
+				break;
+		if (i >= nkept && send_msg(ctl, "done", NULL, 0, NULL, 0) == 0	// (until the
+				&& recv_msg(ctl, tag, NULL, 0, NULL, NULL) >= 0	// new server has
+				&& !strcmp(tag, "taken")) {						// them, we have too)
+			printf("Handed over to the new server with %d connections\n", nkept);
+			log_flush();
+			exit(0);
+		}
+	}
 
-	if (node->ID > id)
-		return SearchTree(node->left, id);
+	fprintf(stderr, "The upgrade failed, serving on\n");
+	wal_open("stock.wal", last);
+	Rio_readn(drain_pipe[0], &c, 1);					// (no worker is waiting on it)
+	P(&conn_mutex);
+	draining = 0;
+	conn_done -= nkept;
+	i = nkept;
+	nkept = 0;
+	V(&conn_mutex);
+	ring_insert_batch(&sbuf, kept, i);
+	V(&upgrade_failed);
+}
+
+/* Register the connection which worker 'w' starts to serve (0 if it is
+   kept for the new server instead) */
+int conn_begin(int w, int connfd) {
+	int serve;
+
+	P(&conn_mutex);
+	if ((serve = !draining))
+		conn_active[w] = connfd;
+	else {
+		kept[nkept++] = connfd;
+		conn_done++;
+	}
+	V(&conn_mutex);
 
-	return SearchTree(node->right, id);
+	return serve;
 }
 
-/* Inorder traversal for freeing AVL tree */
-void ClearTree(Item* node) {
-	if (node != NULL) {
-		ClearTree(node->left);
-		ClearTree(node->right);
-		Free(node);
+/* Wait until the connection of worker 'w' has a request (or the client
+   has left); 0 if it was kept for the new server instead, which happens
+   only between two requests (no byte of one is in 'rp') */
+int conn_wait(int w, rio_t *rp) {
+	struct pollfd fds[2] = {{rp->rio_fd, POLLIN, 0}, {drain_pipe[0], POLLIN, 0}};
+
+	if (rp->rio_cnt > 0 || drain_pipe[0] < 0)
+		return 1;								// (read ahead, or no upgrades)
+	while (poll(fds, 2, -1) < 0)
+		if (errno != EINTR)
+			unix_error("poll error");
+	if (!fds[1].revents)
+		return 1;
+
+	P(&conn_mutex);								// draining: the bytes the socket
+	conn_active[w] = -1;						// holds go to the new server
+	kept[nkept++] = rp->rio_fd;
+	conn_done++;
+	V(&conn_mutex);
+	return 0;
+}
+
+/* Unregister the connection of worker 'w' (the client has left) */
+void conn_end(int w) {
+	P(&conn_mutex);
+	conn_active[w] = -1;
+	conn_done++;
+	V(&conn_mutex);
+}
+
+/* Send a message of the upgrade protocol: a tag, 'len' bytes of data and
+   up to UPGRADE_FDS descriptors; -1 if the peer is gone */
+int send_msg(int sock, char *tag, void *data, size_t len, int *fds, int nfds) {
+	char head[UPGRADE_TAG] = {0};
+	struct iovec iov[2] = {{head, UPGRADE_TAG}, {data, len}};
+	union {											// aligned for cmsghdr
+		char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+
+	memcpy(head, tag, strnlen(tag, UPGRADE_TAG));
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	if (nfds > 0) {									// the descriptors are
+		memset(&ctrl, 0, sizeof(ctrl));				// duplicated into the peer
+		mh.msg_control = ctrl.buf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
 	}
+
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) < 0 ? -1 : 0;
 }
 
-/* Left single rotation */
-Item* SingleRotateLeft(Item *nodeB) {
-	Item* nodeA = NULL;
+/* Receive a message of the upgrade protocol into 'tag' (UPGRADE_TAG + 1
+   bytes), 'data' and 'fds'; return the length of the data (-1: gone) */
+ssize_t recv_msg(int sock, char *tag, void *data, size_t size, int *fds, int *nfds) {
+	struct iovec iov[2] = {{tag, UPGRADE_TAG}, {data, size}};
+	union {
+		char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	ssize_t n;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	mh.msg_control = ctrl.buf;
+	mh.msg_controllen = sizeof(ctrl.buf);
+	if ((n = recvmsg(sock, &mh, 0)) < UPGRADE_TAG || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+		return -1;
+	tag[UPGRADE_TAG] = '\0';
+
+	if (nfds)
+		*nfds = 0;
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && fds) {
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+
+	return n - UPGRADE_TAG;
+}
+/**       Subroutines for Hot Upgrade End       **/
 
-	nodeA = nodeB->left;
-	nodeB->left = nodeA->right;		// rotating process
-	nodeA->right = nodeB;
 
-	nodeB->height = GetGreater(GetHeight(nodeB->left), GetHeight(nodeB->right)) + 1;
-	nodeA->height = GetGreater(GetHeight(nodeA->left), GetHeight(nodeB)) + 1;
 
-	return nodeA;
+/**       Subroutines for the Worker Pool       **/
+/* Bound the pool and start its least workers with stacks of 'stack_kb' KB */
+void pool_init(int min, int max, int stack_kb) {
+	size_t stack = (size_t)stack_kb * 1024;
+
+	pool.max = max < 1 || max > NTHREADS ? NTHREADS : max;
+	pool.min = min < 1 ? 1 : min > pool.max ? pool.max : min;
+	if (stack < PTHREAD_STACK_MIN)
+		stack = PTHREAD_STACK_MIN;
+	pthread_attr_init(&pool.attr);
+	if (pthread_attr_setstacksize(&pool.attr, stack) != 0)
+		app_error("Invalid stack size of the workers");
+	Sem_init(&pool.mutex, 0, 1);
+
+	pool_grow(pool.min);
+}
+
+/* Start up to 'n' more workers in free slots; return how many started */
+int pool_grow(int n) {
+	pthread_t tid;
+	int started = 0;
+
+	P(&pool.mutex);
+	for (long w = 0; w < pool.max && started < n && pool.size < pool.max; w++) {
+		if (pool.used[w])
+			continue;
+		pool.used[w] = 1;
+		Pthread_create(&tid, &pool.attr, thread, (void *)w);
+		pool.size++;
+		started++;
+	}
+	pool.started += started;
+	if (pool.size > pool.peak)
+		pool.peak = pool.size;
+	V(&pool.mutex);
+
+	return started;
+}
+
+/* Let idle worker 'w' exit unless the pool is at its least size (1 if the
+   worker should exit) */
+int pool_retire(int w) {
+	int retire;
+
+	P(&pool.mutex);
+	if ((retire = pool.size > pool.min)) {
+		pool.used[w] = 0;
+		pool.size--;
+		pool.retired++;
+	}
+	V(&pool.mutex);
+
+	return retire;
+}
+
+/* Account the queueing delay of a connection inserted at 'stamp' (a lost
+   update of the average costs one sample) */
+void pool_delay(double stamp) {
+	long delay = (long)((ring_now() - stamp) * 1e6), max;
+	long avg = __atomic_load_n(&pool.delay, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&pool.delay, avg + (delay - avg) / 16, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&pool.delay_max, __ATOMIC_RELAXED);
+	while (delay > max && !__atomic_compare_exchange_n(&pool.delay_max, &max, delay, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
 }
 
-/* Right single rotation */
-Item* SingleRotateRight(Item *nodeA) {
-	Item* nodeB = NULL;
+/* Thread routine which grows the pool: a connection that has waited in the
+   shared buffer for longer than POOL_DELAY finds nobody to take it, so a
+   worker is started for every waiting connection (idle ones retire) */
+void *pool_manager(void *vargp) {
+	Pthread_detach(pthread_self());
 
-	nodeB = nodeA->right;
-	nodeA->right = nodeB->left;		// rotating process
-	nodeB->left = nodeA;
+	while (1) {
+		double age;
+		int queued;
 
-	nodeA->height = GetGreater(GetHeight(nodeA->left), GetHeight(nodeA->right)) + 1;
-	nodeB->height = GetGreater(GetHeight(nodeB->right), GetHeight(nodeA)) + 1;
+		usleep(POOL_TICK * 1000);
+		if ((queued = ring_length(&sbuf, &age)) > 0 && age * 1e3 >= POOL_DELAY)
+			pool_grow(queued);
+	}
 
-	return nodeB;
+	return NULL;
 }
 
-/* Left double rotation */
-Item* DoubleRotateLeft(Item *node) {
-	node->left = SingleRotateRight(node->left);
+/* Write the state of the pool and of the shared buffer into 'buf' */
+void pool_report(char *buf, size_t size) {
+	int busy = 0, queued, size_now, peak;
+	long started, retired;
+	double age;
+
+	P(&conn_mutex);
+	for (int i = 0; i < NTHREADS; i++)
+		busy += conn_active[i] >= 0;
+	V(&conn_mutex);
+	P(&pool.mutex);
+	size_now = pool.size;
+	peak = pool.peak;
+	started = pool.started;
+	retired = pool.retired;
+	V(&pool.mutex);
+	queued = ring_length(&sbuf, &age);
+
+	snprintf(buf, size, "Worker pool: %d workers (%d busy, %d..%d, peak %d), %ld started, "
+			"%ld retired; %d queued, queueing delay %.3f ms (max %.3f ms)\n", size_now, busy,
+			pool.min, pool.max, peak, started, retired, queued,
+			__atomic_load_n(&pool.delay, __ATOMIC_RELAXED) / 1e3,
+			__atomic_load_n(&pool.delay_max, __ATOMIC_RELAXED) / 1e3);
+}
+/**     Subroutines for the Worker Pool End     **/
 
-	return SingleRotateLeft(node);
+
+
+/**          Subroutines for Placement          **/
+/* Read the CPUs and nodes we may use, and put the items of shard i on
+   the i-th node, wrapping around (nothing to place on a single node) */
+void place_init(void) {
+	int ncpus = affinity_init(), nodes = affinity_nodes();
+
+	if (ncpus < 2)							// pinning everything to one CPU
+		placed = 0;							// buys nothing
+	else									// the acceptor alone on the first,
+		place_first = steal_workers > 0 && ncpus > 2 ? 2 : 1;	// the reactor on the
+											// next, the workers on the rest
+	if (nodes > 1) {
+		stock_alloc = place_alloc;
+		stock_free = affinity_free;
+	}
+	printf("Placement: %d CPUs on %d node%s, %s, %s\n", ncpus, nodes, nodes > 1 ? "s" : "",
+			placed ? "threads pinned" : "threads not pinned",
+			nodes > 1 ? "items on the node of their shard" : "items anywhere");
 }
 
-/* Right double rotation */
-Item* DoubleRotateRight(Item *node) {
-	node->right = SingleRotateLeft(node->right);
+/* Return the CPU of a role: PLACE_ACCEPTOR, PLACE_REACTOR or a worker */
+int place_cpu(int role) {
+	int n = affinity_cpus() - place_first;
 
-	return SingleRotateRight(node);
+	if (role == PLACE_ACCEPTOR)
+		return affinity_cpu(0);
+	if (role == PLACE_REACTOR)
+		return affinity_cpu(1);
+	return affinity_cpu(place_first + role % n);	// round-robin over the rest
 }
 
-/* Return the height of input node */
-int GetHeight(Item *node) {
-	if (node == NULL)
-		return -1;					// -1 for comparison and addition
-	return node->height;
+/* Pin the calling thread to the CPU of its role (it runs anywhere if the
+   kernel refuses) */
+void place_pin(int role) {
+	int cpu = place_cpu(role);
+
+	if (affinity_pin(cpu) < 0)
+		fprintf(stderr, "Can't pin a thread to CPU %d\n", cpu);
 }
 
-/* Return greater one between two heights */
-int GetGreater(int heightA, int heightB) {
-	return (heightA > heightB) ? heightA : heightB;
+/* Allocator of item memory: the node of the core which owns 'shard' in the
+   shared-nothing mode, else spread over the nodes (stock_alloc) */
+void *place_alloc(size_t size, int shard) {
+	if (partitions > 0 && placed)
+		return affinity_alloc(size, affinity_node_of(place_cpu(shard % partitions)));
+	return affinity_alloc(size, affinity_node(shard));
 }
-/***      Subroutines for the AVL Tree End     ***/
-/************** End of the Program ***************/
\ No newline at end of file
+/**        Subroutines for Placement End        **/
+/************** End of the Program ***************/
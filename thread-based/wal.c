@@ -0,0 +1,457 @@
+/**************************************************
+ * Title: SP-Project 2  -  Write-Ahead Log
+ * Summary: implementation of 'wal.h'. Writers take an
+ LSN with one atomic add and fill its slot of a ring
+ without a lock; the committer copies the run of
+ filled slots out in LSN order, then writes and syncs
+ it, so a group is as large as the traffic of one
+ fsync.
+ At startup the log is read back for recovery; it
+ ends at the first torn or out-of-sequence record.
+**************************************************/
+
+/****************** Declaration ******************/
+/* Headers */
+#include "wal.h"
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+
+/* Types */
+typedef struct {					/* slot of a record in the ring */
+	WalRecord rec;
+	uint64_t stamp;					// append time (nsec)
+	uint64_t seq;					// LSN of the record once it is filled
+}WalSlot;
+
+typedef struct {					/* records waiting for one fdatasync */
+	WalRecord *recs;
+	uint64_t *stamps;				// append time of every record (nsec)
+	size_t n, size;
+}WalGroup;
+
+
+/* Global Variables */
+int wal_strict = 0;					/* acknowledge only durable changes */
+int wal_interval = WAL_INTERVAL;	/* longest wait (usec) of a pending record */
+int wal_batch = WAL_BATCH;			/* number of pending records which flushes at once */
+void (*wal_tap)(WalRecord *recs, size_t n);	/* gets every group once durable (in order) */
+
+int wal_fd = -1;					/* log file (-1 while logging is off) */
+char wal_path[MAXLINE - 8];			/* name of the log file */
+pthread_t wal_tid;					/* the committer thread */
+pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_durable_cond;	/* broadcast to strict writers after a flush */
+WalSlot *wal_ring;					/* slot of LSN n is wal_ring[n % WAL_RING] */
+WalGroup wal_group;					/* records taken out of the ring (committer only) */
+int wal_closing;					/* asks the committer to flush and quit */
+int wal_urgent;						/* asks the committer to flush without waiting */
+uint64_t wal_next_lsn __attribute__((aligned(64)));	/* last LSN handed out */
+uint64_t wal_taken __attribute__((aligned(64)));	/* every slot up to this LSN is free */
+uint64_t wal_durable;				/* every LSN up to this one is on disk */
+uint32_t wal_bell __attribute__((aligned(64)));	/* futex of the sleeping committer, */
+int wal_idle;						/* which sets this before it sleeps: 1 for any */
+uint64_t wal_wake_at;				/* record, 2 for LSN 'wal_wake_at' (a full batch) */
+long wal_hist[WAL_BUCKETS];			/* histogram of commit latencies (usec) */
+
+
+/* Subroutines */
+static void *committer(void *vargp);
+static size_t ready_run(uint64_t from);
+static void committer_sleep(int idle, uint64_t due);
+static void wake_committer(void);
+static void flush_group(WalGroup *g);
+static void wait_durable(uint64_t lsn);
+static void old_path(char *buf);
+static void append_file(int dst, int src);
+static uint64_t now_ns(void);
+static int bucket_of(uint64_t usec);
+static long bucket_value(int b);
+
+
+/**************** Implementation *****************/
+/***      Write-Ahead Log Routines             ***/
+/* Read '<name>.old' and '<name>' (before wal_open) and return the records
+   after 'lsn' in LSN order. A torn record ends the log: it is cut off with
+   everything after it */
+WalRecord *wal_recover(char *filename, uint64_t lsn, size_t *n) {
+	char old[MAXLINE];
+	char *files[2] = { old, filename };
+	WalRecord *recs = NULL;
+	size_t size = 0;
+	uint64_t last = 0;						// LSN of the last good record
+
+	snprintf(old, sizeof(old), "%s.old", filename);
+	*n = 0;
+	for (int f = 0; f < 2; f++) {
+		size_t count, good = 0;
+		WalRecord *map;
+		struct stat st;
+		int fd;
+
+		if ((fd = open(files[f], O_RDWR)) < 0) {
+			if (errno == ENOENT)
+				continue;
+			unix_error("WAL open error");
+		}
+		Fstat(fd, &st);
+		count = st.st_size / sizeof(WalRecord);
+
+		if (count > 0) {
+			map = Mmap(NULL, count * sizeof(WalRecord), PROT_READ, MAP_PRIVATE, fd, 0);
+			for (; good < count; good++) {
+				WalRecord rec = map[good];
+
+				if (rec.check != wal_checksum(&rec) || (last != 0 && rec.lsn != last + 1))
+					break;					// torn, or after a torn one
+				last = rec.lsn;
+				if (rec.lsn <= lsn)
+					continue;				// the loaded file holds it already
+				if (*n == 0 && rec.lsn != lsn + 1) {
+					fprintf(stderr, "The log misses the changes %llu..%llu.\n",
+							(unsigned long long)lsn + 1, (unsigned long long)rec.lsn - 1);
+					exit(0);
+				}
+				if (*n == size)
+					recs = Realloc(recs, (size = size ? 2 * size : 1024) * sizeof(WalRecord));
+				recs[(*n)++] = rec;
+			}
+			Munmap(map, count * sizeof(WalRecord));
+		}
+
+		if (good * sizeof(WalRecord) != (size_t)st.st_size) {
+			fprintf(stderr, "Cut %lld bytes of torn records off '%s'.\n",
+					(long long)(st.st_size - good * sizeof(WalRecord)), files[f]);
+			if (ftruncate(fd, good * sizeof(WalRecord)) < 0 || fdatasync(fd) < 0)
+				unix_error("WAL truncate error");
+		}
+		Close(fd);
+	}
+
+	return recs;
+}
+
+/* Open (or create) the log for appending, LSNs go on after 'lsn' */
+void wal_open(char *filename, uint64_t lsn) {
+	if ((wal_fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+		unix_error("WAL open error");
+	strncpy(wal_path, filename, sizeof(wal_path) - 1);
+	wal_next_lsn = wal_taken = wal_durable = lsn;
+
+	if (wal_ring == NULL)
+		wal_ring = Malloc(WAL_RING * sizeof(WalSlot));
+	memset(wal_ring, 0, WAL_RING * sizeof(WalSlot));	// (no slot holds a later LSN)
+	pthread_cond_init(&wal_durable_cond, NULL);
+
+	wal_closing = wal_urgent = 0;
+	memset(wal_hist, 0, sizeof(wal_hist));		// latencies of this session only
+	Pthread_create(&wal_tid, NULL, committer, NULL);
+}
+
+/* Flush every pending record, stop the committer and close the log */
+void wal_close(void) {
+	if (wal_fd < 0)
+		return;
+
+	__atomic_store_n(&wal_closing, 1, __ATOMIC_SEQ_CST);
+	wake_committer();
+	Pthread_join(wal_tid, NULL);
+
+	Close(wal_fd);
+	wal_fd = -1;
+	Free(wal_group.recs);
+	Free(wal_group.stamps);
+	wal_group.recs = NULL;
+	wal_group.stamps = NULL;
+	wal_group.n = wal_group.size = 0;
+}
+
+/* Empty the log once the store is stored ('stock.txt' holds every change) */
+void wal_reset(void) {
+	if (wal_fd < 0)
+		return;
+
+	wait_durable(wal_last());			// in any mode
+	if (ftruncate(wal_fd, 0) < 0 || fdatasync(wal_fd) < 0)
+		unix_error("WAL truncate error");
+	wal_drop_old();
+}
+
+/* Start a new log for the changes after a checkpoint (writers are paused).
+   The old records go to '<name>.old', after the ones of a failed checkpoint */
+void wal_rotate(void) {
+	char old[MAXLINE];
+	int fd;
+
+	if (wal_fd < 0)
+		return;
+
+	__atomic_store_n(&wal_urgent, 1, __ATOMIC_SEQ_CST);	// don't wait for the deadline
+	wake_committer();
+	wait_durable(wal_last());
+
+	pthread_mutex_lock(&wal_mutex);		// (the committer is idle now)
+	__atomic_store_n(&wal_urgent, 0, __ATOMIC_SEQ_CST);
+	old_path(old);
+	if ((fd = open(old, O_WRONLY | O_APPEND)) >= 0) {
+		append_file(fd, wal_fd);		// an older checkpoint failed, so
+		if (fdatasync(fd) < 0 || ftruncate(wal_fd, 0) < 0)	// keep every
+			unix_error("WAL rotate error");	// record since the last good one
+		Close(fd);
+	}
+	else {
+		if (rename(wal_path, old) < 0)
+			unix_error("WAL rename error");
+		Close(wal_fd);
+		if ((wal_fd = open(wal_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+			unix_error("WAL open error");
+	}
+	pthread_mutex_unlock(&wal_mutex);
+}
+
+/* Remove the log of the changes which a finished checkpoint holds */
+void wal_drop_old(void) {
+	char old[MAXLINE];
+
+	old_path(old);
+	if (unlink(old) < 0 && errno != ENOENT)
+		unix_error("WAL unlink error");
+}
+
+/* Return the LSN of the last appended record (of the last reserved one while
+   appends run: with writers paused, every reserved record is in its slot) */
+uint64_t wal_last(void) {
+	return __atomic_load_n(&wal_next_lsn, __ATOMIC_ACQUIRE);
+}
+
+/* Append a record to the ring and return its LSN (0 if logging is off). The
+   caller holds the lock of the item, so the LSNs of an item are in the order
+   of its changes; records of other items only meet in the committer */
+uint64_t wal_append(int op, int id, int amount, int price) {
+	WalRecord rec = { 0, op, id, amount, price, 0, 0 };
+	uint64_t stamp;
+	WalSlot *s;
+	int idle;
+
+	if (wal_fd < 0)
+		return 0;
+
+	stamp = now_ns();					// (keep the reserved slot short)
+	rec.lsn = __atomic_add_fetch(&wal_next_lsn, 1, __ATOMIC_RELAXED);
+	rec.check = wal_checksum(&rec);
+	s = &wal_ring[rec.lsn & (WAL_RING - 1)];
+	while (rec.lsn - __atomic_load_n(&wal_taken, __ATOMIC_ACQUIRE) > WAL_RING)
+		sched_yield();					// the committer is a whole ring behind
+
+	s->rec = rec;
+	s->stamp = stamp;
+	__atomic_store_n(&s->seq, rec.lsn, __ATOMIC_SEQ_CST);	// filled
+	if ((idle = __atomic_load_n(&wal_idle, __ATOMIC_SEQ_CST)) == 1
+			|| (idle == 2 && rec.lsn >= __atomic_load_n(&wal_wake_at, __ATOMIC_RELAXED)))
+		wake_committer();				// start the deadline, or flush now
+
+	return rec.lsn;
+}
+
+/* Wait until record 'lsn' is durable (strict mode only) */
+void wal_wait(uint64_t lsn) {
+	if (wal_strict)
+		wait_durable(lsn);
+}
+
+/* FNV-1a checksum of a record (every field before 'check') */
+uint32_t wal_checksum(WalRecord *rec) {
+	unsigned char *p = (unsigned char *)rec;
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < offsetof(WalRecord, check); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+/* Return the q-quantile (0..1) of the commit latency in microseconds */
+long wal_latency(double q) {
+	long total = 0, seen = 0, hist[WAL_BUCKETS];
+
+	pthread_mutex_lock(&wal_mutex);
+	memcpy(hist, wal_hist, sizeof(hist));
+	pthread_mutex_unlock(&wal_mutex);
+
+	for (int b = 0; b < WAL_BUCKETS; b++)
+		total += hist[b];
+	for (int b = 0; b < WAL_BUCKETS; b++)
+		if ((seen += hist[b]) > 0 && seen >= q * total)
+			return bucket_value(b);
+	return 0;
+}
+/***      Write-Ahead Log Routines End         ***/
+
+
+
+/***      Subroutines for Group Commit         ***/
+/* Thread routine of the committer: take the filled run of the ring out per
+   deadline or batch, then flush it */
+static void *committer(void *vargp) {
+	WalGroup *g = &wal_group;
+	uint64_t done;
+
+	while (1) {
+		uint64_t next = wal_taken + 1, due;
+		size_t n = ready_run(next);
+
+		if (n == 0) {
+			if (__atomic_load_n(&wal_closing, __ATOMIC_SEQ_CST)) {
+				if (__atomic_load_n(&wal_next_lsn, __ATOMIC_ACQUIRE) == wal_taken)
+					break;					// everything is flushed
+				sched_yield();				// (a reserved slot is being filled)
+				continue;
+			}
+			committer_sleep(1, 0);			// nothing to do until the first record
+			continue;
+		}
+		due = wal_ring[next & (WAL_RING - 1)].stamp + wal_interval * 1000ULL;
+		if (n < (size_t)wal_batch && due > now_ns()
+				&& !__atomic_load_n(&wal_closing, __ATOMIC_SEQ_CST)
+				&& !__atomic_load_n(&wal_urgent, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&wal_wake_at, next + wal_batch - 1, __ATOMIC_RELAXED);
+			committer_sleep(2, due);		// until the deadline or a full batch
+			continue;
+		}
+
+		if (n > g->size) {					// grow the group with the traffic
+			g->size = (n > 2 * g->size) ? n : 2 * g->size;
+			g->recs = Realloc(g->recs, g->size * sizeof(WalRecord));
+			g->stamps = Realloc(g->stamps, g->size * sizeof(uint64_t));
+		}
+		for (g->n = 0; g->n < n; g->n++) {
+			WalSlot *s = &wal_ring[(next + g->n) & (WAL_RING - 1)];
+
+			g->recs[g->n] = s->rec;
+			g->stamps[g->n] = s->stamp;
+		}
+		__atomic_store_n(&wal_taken, next + n - 1, __ATOMIC_RELEASE);	// slots are free
+
+		flush_group(g);
+		if (wal_tap)						// (groups are flushed in LSN order)
+			wal_tap(g->recs, g->n);
+		done = now_ns();
+		pthread_mutex_lock(&wal_mutex);
+
+		for (size_t i = 0; i < g->n; i++)	// record the commit latencies
+			wal_hist[bucket_of((done - g->stamps[i]) / 1000)]++;
+		__atomic_store_n(&wal_durable, g->recs[g->n - 1].lsn, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&wal_durable_cond);	// wake up strict writers
+		pthread_mutex_unlock(&wal_mutex);
+	}
+
+	return NULL;
+}
+
+/* Return the number of filled slots in a row from LSN 'from' on */
+static size_t ready_run(uint64_t from) {
+	size_t n = 0;
+
+	while (n < WAL_RING && __atomic_load_n(&wal_ring[(from + n) & (WAL_RING - 1)].seq,
+			__ATOMIC_ACQUIRE) == from + n)
+		n++;
+	return n;
+}
+
+/* Sleep on the bell until an appender rings it: 'idle' 1 waits for any record,
+   2 for a full batch or the deadline 'due' */
+static void committer_sleep(int idle, uint64_t due) {
+	uint64_t next = wal_taken + 1, lsn = (idle == 1) ? next : wal_wake_at;
+	struct timespec ts, *timeout = NULL;
+	uint32_t bell;
+
+	__atomic_store_n(&wal_idle, idle, __ATOMIC_SEQ_CST);
+	bell = __atomic_load_n(&wal_bell, __ATOMIC_SEQ_CST);
+	if (idle == 2) {
+		uint64_t now = now_ns();
+
+		due = (due > now) ? due - now : 0;
+		ts.tv_sec = due / 1000000000;
+		ts.tv_nsec = due % 1000000000;
+		timeout = &ts;
+	}
+	if (__atomic_load_n(&wal_ring[lsn & (WAL_RING - 1)].seq, __ATOMIC_SEQ_CST) != lsn
+			&& !__atomic_load_n(&wal_closing, __ATOMIC_SEQ_CST)
+			&& !__atomic_load_n(&wal_urgent, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &wal_bell, FUTEX_WAIT_PRIVATE, bell, timeout, NULL, 0);
+	__atomic_store_n(&wal_idle, 0, __ATOMIC_RELAXED);
+}
+
+/* Ring the bell of the committer */
+static void wake_committer(void) {
+	__atomic_add_fetch(&wal_bell, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &wal_bell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Write a group with one system call and sync it */
+static void flush_group(WalGroup *g) {
+	Rio_writen(wal_fd, g->recs, g->n * sizeof(WalRecord));
+	if (fdatasync(wal_fd) < 0)
+		unix_error("WAL fdatasync error");
+}
+
+/* Block until every record up to 'lsn' is durable */
+static void wait_durable(uint64_t lsn) {
+	if (lsn == 0 || __atomic_load_n(&wal_durable, __ATOMIC_ACQUIRE) >= lsn)
+		return;
+
+	pthread_mutex_lock(&wal_mutex);
+	while (wal_durable < lsn)
+		pthread_cond_wait(&wal_durable_cond, &wal_mutex);
+	pthread_mutex_unlock(&wal_mutex);
+}
+
+/* Name of the log of the changes before the running checkpoint */
+static void old_path(char *buf) {
+	snprintf(buf, MAXLINE, "%s.old", wal_path);
+}
+
+/* Append the whole file 'src' at the end of 'dst' */
+static void append_file(int dst, int src) {
+	char buf[MAXBUF];
+	ssize_t n;
+	off_t off = 0;
+
+	while ((n = pread(src, buf, sizeof(buf), off)) > 0) {
+		Rio_writen(dst, buf, n);
+		off += n;
+	}
+	if (n < 0)
+		unix_error("WAL read error");
+}
+
+/* Return the monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Histogram bucket of a latency: exact below 8, then 8 buckets per power of two */
+static int bucket_of(uint64_t usec) {
+	int msb, b;
+
+	if (usec < (1 << WAL_SUB_BITS))
+		return (int)usec;
+	msb = 63 - __builtin_clzll(usec);
+	b = ((msb - WAL_SUB_BITS + 1) << WAL_SUB_BITS)
+		+ (int)((usec >> (msb - WAL_SUB_BITS)) & ((1 << WAL_SUB_BITS) - 1));
+	return (b < WAL_BUCKETS) ? b : WAL_BUCKETS - 1;
+}
+
+/* Smallest latency which falls into bucket 'b' */
+static long bucket_value(int b) {
+	int msb = (b >> WAL_SUB_BITS) + WAL_SUB_BITS - 1;
+
+	if (b < (1 << WAL_SUB_BITS))
+		return b;
+	return (long)(((1 << WAL_SUB_BITS) | (b & ((1 << WAL_SUB_BITS) - 1)))) << (msb - WAL_SUB_BITS);
+}
+/***      Subroutines for Group Commit End     ***/
+/************** End of the Program ***************/
@@ -0,0 +1,67 @@
+/**************************************************
+ * Title: SP-Project 2  -  Write-Ahead Log
+ * Summary: append-only binary log of the changes of
+ the stock store. A committer thread writes records
+ in groups with one fdatasync per group, as soon as
+ 'wal_batch' records are pending or the oldest one
+ has waited 'wal_interval' microseconds. In strict
+ mode a change is acknowledged only after its record
+ is durable. A checkpoint rotates the log into
+ '<name>.old', which is dropped once the checkpoint
+ file is in place. wal_recover reads the log back
+ after a crash, and 'wal_tap' sees every durable
+ group (replication).
+**************************************************/
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include "csapp.h"
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* Preprocessor Directives */
+#define WAL_INTERVAL	1000		/* default wait (usec) of a group before it is flushed */
+#define WAL_BATCH		256			/* default size of a group which is flushed at once */
+#define WAL_RING		65536		/* records appended but not yet taken by the committer */
+#define WAL_SUB_BITS	3			/* latency histogram: 8 buckets per power of two */
+#define WAL_BUCKETS		320			/* (about 12% resolution up to 2^40 usec) */
+
+
+/* Types */
+typedef enum {						/* type of a logged change */
+	_wal_buy_ = 1, _wal_sell_, _wal_list_, _wal_delist_
+}wal_op;
+
+typedef struct {					/* one record of the log file (32 bytes) */
+	uint64_t lsn;					// log sequence number (1, 2, 3, ...)
+	int32_t op;						// wal_op
+	int32_t id;						// ID of the item
+	int32_t amount;					// amount of buy/sell, left_stock of list
+	int32_t price;					// price of list
+	uint32_t check;					// checksum of the fields above (torn writes)
+	uint32_t pad;
+}WalRecord;
+
+
+/* Global Variables */
+extern int wal_strict;				/* acknowledge only durable changes (default 0) */
+extern int wal_interval;			/* longest wait (usec) of a pending record */
+extern int wal_batch;				/* number of pending records which flushes at once */
+extern void (*wal_tap)(WalRecord *recs, size_t n);	/* gets every group once durable */
+
+
+/* Write-Ahead Log routines (nothing is logged until wal_open) */
+WalRecord *wal_recover(char *filename, uint64_t lsn, size_t *n);
+void wal_open(char *filename, uint64_t lsn);
+void wal_close(void);
+void wal_reset(void);
+void wal_rotate(void);
+void wal_drop_old(void);
+uint64_t wal_last(void);
+uint64_t wal_append(int op, int id, int amount, int price);
+void wal_wait(uint64_t lsn);
+uint32_t wal_checksum(WalRecord *rec);
+long wal_latency(double q);
+
+#endif /* __WAL_H__ */